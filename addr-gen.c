@@ -1,70 +1,117 @@
 #include "addr-gen.h"
 #include <stdlib.h>
-#include <stdio.h>
 
-int init_addrgen(struct AddressGenerator *addr_gen) {
+// Parameters of the LCG that permutes the targets; any odd increment gives a full period modulo a power of two
+#define LCG_MULTIPLIER 6364136223846793005ULL
+#define LCG_INCREMENT 1442695040888963407ULL
+
+int init_addrgen(struct AddressGenerator *addr_gen, const struct ExcludeList *exclude, const uint16_t *ports, int num_ports) {
 
     addr_gen->finished = false;
     addr_gen->state = 0;
+    addr_gen->ports = ports;
+    addr_gen->num_ports = num_ports;
+    addr_gen->priority = NULL;
+    addr_gen->bounded = false;
 
-    int sz = 64;
-    addr_gen->exclude_prefixes= malloc(sz * sizeof(uint32_t));
-    addr_gen->exclude_masks = malloc(sz * sizeof(uint32_t));
-
-    // Read excluded subnets list
-    FILE *fp = fopen("exclude.txt", "r");
-    if(fp == NULL) {
-        perror("failed to read exclude.txt");
-        return 1;
+    // The permutation runs over address x port-index pairs, rounded up to a power of two
+    int port_bits = 0;
+    while((1 << port_bits) < num_ports) {
+        port_bits++;
     }
+    addr_gen->mask = ((uint64_t)1 << (32 + port_bits)) - 1;
+
+    addr_gen->exclude = exclude;
+    return 0;
+
+}
+
+/* Scan ports in order of learned priority instead of all at once: every address is visited once per pass, and the port
+ * used in pass N is the address's N-th ranked port. Only the first `num_passes` ranks are scanned. */
+void set_port_priority(struct AddressGenerator *addr_gen, const struct PortPriority *priority, int num_passes) {
+    addr_gen->priority = priority;
+    addr_gen->rank = 0;
+    addr_gen->num_passes = num_passes;
+    addr_gen->mask = 0xffffffff;
+    addr_gen->state = 0;
+    addr_gen->finished = num_passes == 0;
+}
+
+static bool next_prioritized_target(struct AddressGenerator *addr_gen, struct Target *target) {
+
+    while(!addr_gen->finished) {
+
+        addr_gen->state = (addr_gen->state * LCG_MULTIPLIER + LCG_INCREMENT) & addr_gen->mask;
+        int rank = addr_gen->rank;
+        if(addr_gen->state == 0 && ++addr_gen->rank == addr_gen->num_passes) {
+            addr_gen->finished = true;
+        }
 
-    char line[32];
-    int octets[4];
-    int prefixLen;
-    int idx = 0;
-    while(fgets(line, sizeof(line), fp)) {
-        if(sscanf(line, "%d.%d.%d.%d/%d", octets, octets + 1, octets + 2, octets + 3, &prefixLen) == 5) {
-            addr_gen->exclude_prefixes[idx] = (uint32_t)(octets[0] & 0xff) << 24 | (uint32_t)(octets[1] & 0xff) << 16 | (uint32_t)(octets[2] & 0xff) << 8 | (uint32_t)(octets[3] & 0xff);
-            addr_gen->exclude_masks[idx] = ~((uint32_t)0xffffffff >> prefixLen);
-            idx++;
-            if(idx > sz) {
-                addr_gen->exclude_prefixes = realloc(addr_gen->exclude_prefixes, sz * 2 * sizeof(uint32_t));
-                addr_gen->exclude_masks =  realloc(addr_gen->exclude_masks, sz * 2 * sizeof(uint32_t));
-            }
+        uint32_t addr = addr_gen->state;
+        if(should_exclude(addr_gen->exclude, addr)) {
+            continue;
         }
+
+        map_ipv4(&target->addr, htonl(addr));
+        target->port = port_for_rank(addr_gen->priority, htonl(addr), rank);
+        return true;
+
     }
 
-    addr_gen->num_excluded_subnets = idx;
-    fclose(fp);
-    return 0;
+    return false;
 
 }
 
-int should_exclude(struct AddressGenerator *addr_gen, uint32_t addr) {
-    for(int i = 0; i < addr_gen->num_excluded_subnets; i++) {
-        if((addr & addr_gen->exclude_masks[i]) == addr_gen->exclude_prefixes[i]) {
-            return 1;
+/* Restrict the generator to `count` steps of the permutation, starting after the first `start`, so that separate
+ * processes can scan disjoint ranges of the same permutation. The LCG is jumped ahead in O(log start) time by
+ * composing powers of its step function, starting from the state 0 that a full scan starts from. */
+void seek_addrgen(struct AddressGenerator *addr_gen, uint64_t start, uint64_t count) {
+
+    uint64_t state = 0, step_mult = LCG_MULTIPLIER, step_plus = LCG_INCREMENT;
+    for(uint64_t n = start; n > 0; n >>= 1) {
+        if(n & 1) {
+            state = state * step_mult + step_plus;
         }
+        step_plus *= step_mult + 1;
+        step_mult *= step_mult;
     }
-    return 0;
+
+    addr_gen->state = state & addr_gen->mask;
+    addr_gen->bounded = true;
+    addr_gen->steps_left = count;
+    addr_gen->finished = count == 0;
+
 }
 
-/* Get the next address to scan; returns zero if no more addresses available. */
-in_addr_t next_address(struct AddressGenerator *addr_gen) {
+/* Get the next (address, port) pair to scan; returns false if no more targets are available. */
+bool next_target(struct AddressGenerator *addr_gen, struct Target *target) {
 
-    if(addr_gen->finished) {
-        return 0;
+    if(addr_gen->priority != NULL) {
+        return next_prioritized_target(addr_gen, target);
     }
 
-    // Iterate through values 0..2^32-1 using an LCG such that each value is visited exactly once
-    do {
-        addr_gen->state = addr_gen->state * 1664525 + 1013904223;
-    } while(should_exclude(addr_gen, addr_gen->state));
+    // Iterate through values 0..2^(32+port_bits)-1 using an LCG such that each value is visited exactly once. The low
+    // 32 bits are the address and the high bits pick the port, so the ports of any one host are spread over the scan.
+    // Values whose port index is out of range are skipped, which costs at most one extra step on average.
+    while(!addr_gen->finished) {
+
+        addr_gen->state = (addr_gen->state * LCG_MULTIPLIER + LCG_INCREMENT) & addr_gen->mask;
+        if(addr_gen->state == 0 || (addr_gen->bounded && --addr_gen->steps_left == 0)) {
+            addr_gen->finished = true;
+        }
+
+        uint32_t addr = addr_gen->state;
+        uint64_t port_idx = addr_gen->state >> 32;
+        if(port_idx >= (uint64_t)addr_gen->num_ports || should_exclude(addr_gen->exclude, addr)) {
+            continue;
+        }
+
+        map_ipv4(&target->addr, htonl(addr));
+        target->port = addr_gen->ports[port_idx];
+        return true;
 
-    if(addr_gen->state == 0) {
-        addr_gen->finished = true;
     }
 
-    return htonl(addr_gen->state);
+    return false;
 
-}
\ No newline at end of file
+}
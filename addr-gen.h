@@ -1,19 +1,36 @@
 #ifndef __ADDR_GEN_H
 #define __ADDR_GEN_H
 
+#include "port-priority.h"
+#include "exclude.h"
+#include "address.h"
 #include <arpa/inet.h>
 #include <stdbool.h>
 #include <stdint.h>
 
+// A single (address, port) pair to probe; IPv4 addresses are v4-mapped
+struct Target {
+    struct in6_addr addr;
+    uint16_t port;
+};
+
 struct AddressGenerator {
-    uint32_t state;
+    uint64_t state;
+    uint64_t mask;
     bool finished;
-    int num_excluded_subnets;
-    uint32_t *exclude_prefixes;
-    uint32_t *exclude_masks;
+    const struct ExcludeList *exclude;
+    const uint16_t *ports;
+    int num_ports;
+    const struct PortPriority *priority;
+    int rank;
+    int num_passes;
+    bool bounded; // only steps_left more steps of the permutation are taken, for a leased range of it
+    uint64_t steps_left;
 };
 
-int init_addrgen(struct AddressGenerator *addr_gen);
-in_addr_t next_address(struct AddressGenerator *addr_gen);
+int init_addrgen(struct AddressGenerator *addr_gen, const struct ExcludeList *exclude, const uint16_t *ports, int num_ports);
+void set_port_priority(struct AddressGenerator *addr_gen, const struct PortPriority *priority, int num_passes);
+void seek_addrgen(struct AddressGenerator *addr_gen, uint64_t start, uint64_t count);
+bool next_target(struct AddressGenerator *addr_gen, struct Target *target);
 
-#endif
\ No newline at end of file
+#endif
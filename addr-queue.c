@@ -0,0 +1,42 @@
+#include "addr-queue.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+int init_addr_queue(struct AddrQueue *queue, int capacity) {
+    queue->items = malloc(capacity * sizeof(struct Target));
+    if(queue->items == NULL) {
+        fprintf(stderr, "failed to allocate address queue\n");
+        return 1;
+    }
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    queue->dropped = 0;
+    return 0;
+}
+
+/* Append a target; when the queue is full the target is dropped and counted instead. */
+bool push_target(struct AddrQueue *queue, struct Target target) {
+    if(queue->count == queue->capacity) {
+        queue->dropped++;
+        return false;
+    }
+    queue->items[(queue->head + queue->count) % queue->capacity] = target;
+    queue->count++;
+    return true;
+}
+
+/* Remove the oldest target; returns false if the queue is empty. */
+bool pop_target(struct AddrQueue *queue, struct Target *target) {
+    if(queue->count == 0) {
+        return false;
+    }
+    *target = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    return true;
+}
+
+void free_addr_queue(struct AddrQueue *queue) {
+    free(queue->items);
+}
@@ -0,0 +1,21 @@
+#ifndef __ADDR_QUEUE_H
+#define __ADDR_QUEUE_H
+
+#include "addr-gen.h"
+#include <stdbool.h>
+
+// Fixed-capacity FIFO of targets waiting to be probed again
+struct AddrQueue {
+    struct Target *items;
+    int capacity;
+    int head;
+    int count;
+    long dropped;
+};
+
+int init_addr_queue(struct AddrQueue *queue, int capacity);
+bool push_target(struct AddrQueue *queue, struct Target target);
+bool pop_target(struct AddrQueue *queue, struct Target *target);
+void free_addr_queue(struct AddrQueue *queue);
+
+#endif
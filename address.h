@@ -0,0 +1,97 @@
+#ifndef __ADDRESS_H
+#define __ADDRESS_H
+
+#include "hash.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// Buffer size needed by format_address()
+#define MAX_ADDRESS_LENGTH INET6_ADDRSTRLEN
+
+/* Target addresses are stored as IPv6 everywhere, with IPv4 addresses in their v4-mapped form (::ffff:a.b.c.d), so
+ * the per-connection code has one layout and never branches on the address family. Only sockets are opened in the
+ * target's own family, converting with to_sockaddr() and from_sockaddr(), so that IPv4 scans still work on hosts where
+ * IPv6 is disabled. */
+
+static inline void map_ipv4(struct in6_addr *out, in_addr_t addr) {
+    memset(out->s6_addr, 0, 10);
+    out->s6_addr[10] = 0xff;
+    out->s6_addr[11] = 0xff;
+    memcpy(out->s6_addr + 12, &addr, 4);
+}
+
+static inline bool is_ipv4(const struct in6_addr *addr) {
+    return IN6_IS_ADDR_V4MAPPED(addr);
+}
+
+// The IPv4 address (in network byte order) of a v4-mapped address
+static inline in_addr_t ipv4_of(const struct in6_addr *addr) {
+    in_addr_t v4;
+    memcpy(&v4, addr->s6_addr + 12, 4);
+    return v4;
+}
+
+static inline uint32_t hash_address(const struct in6_addr *addr) {
+    uint32_t words[4];
+    memcpy(words, addr->s6_addr, 16);
+    return mix32(words[3] ^ mix32(words[2] ^ mix32(words[1] ^ mix32(words[0]))));
+}
+
+// The socket family that reaches an address
+static inline int address_family(const struct in6_addr *addr) {
+    return is_ipv4(addr) ? AF_INET : AF_INET6;
+}
+
+// Fill in the socket address for an address and port (in host byte order), returning its length
+static inline socklen_t to_sockaddr(const struct in6_addr *addr, uint16_t port, struct sockaddr_storage *out) {
+    memset(out, 0, sizeof(*out));
+    if(is_ipv4(addr)) {
+        struct sockaddr_in *in = (struct sockaddr_in *)out;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        in->sin_addr.s_addr = ipv4_of(addr);
+        return sizeof(*in);
+    }
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)out;
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(port);
+    in6->sin6_addr = *addr;
+    return sizeof(*in6);
+}
+
+// The address and port (in host byte order) of a socket address of either family
+static inline void from_sockaddr(const struct sockaddr_storage *in, struct in6_addr *addr, uint16_t *port) {
+    if(in->ss_family == AF_INET) {
+        const struct sockaddr_in *in4 = (const struct sockaddr_in *)in;
+        map_ipv4(addr, in4->sin_addr.s_addr);
+        *port = ntohs(in4->sin_port);
+        return;
+    }
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)in;
+    *addr = in6->sin6_addr;
+    *port = ntohs(in6->sin6_port);
+}
+
+// Format an address, using dotted notation for IPv4; `buf` must hold MAX_ADDRESS_LENGTH bytes
+static inline const char *format_address(const struct in6_addr *addr, char *buf) {
+    if(is_ipv4(addr)) {
+        return inet_ntop(AF_INET, addr->s6_addr + 12, buf, MAX_ADDRESS_LENGTH);
+    }
+    return inet_ntop(AF_INET6, addr, buf, MAX_ADDRESS_LENGTH);
+}
+
+// Parse an IPv4 or IPv6 address
+static inline bool parse_address(const char *str, struct in6_addr *out) {
+    struct in_addr v4;
+    if(inet_pton(AF_INET, str, &v4) == 1) {
+        map_ipv4(out, v4.s_addr);
+        return true;
+    }
+    return inet_pton(AF_INET6, str, out) == 1;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+#include "arena.h"
+#include <sys/mman.h>
+#include <stdint.h>
+
+// Slots are aligned for any type, and start one cache line into their chunk, after its header
+#define SLOT_ALIGNMENT 16
+#define CHUNK_HEADER_SIZE 64
+
+// The header at the start of every chunk, which fills the first cache line
+struct ArenaChunk {
+    struct Arena *arena;
+    struct ArenaChunk *next; // all chunks of the arena
+    struct ArenaChunk *prev;
+    struct ArenaChunk *next_free; // chunks with a slot to spare
+    struct ArenaChunk *prev_free;
+    void *free_list; // slots that have been freed
+    char *unused; // slots from here on have never been handed out
+    long used;
+};
+
+void init_arena(struct Arena *arena, size_t slot_size, bool huge_pages) {
+    arena->slot_size = (slot_size + SLOT_ALIGNMENT - 1) & ~(size_t)(SLOT_ALIGNMENT - 1);
+    arena->huge_pages = huge_pages;
+    arena->chunks = NULL;
+    arena->free_chunks = NULL;
+    arena->spare = NULL;
+    arena->slots_in_use = 0;
+    arena->chunks_mapped = 0;
+    arena->hugetlb_chunks = 0;
+    arena->thp_chunks = 0;
+    arena->small_chunks = 0;
+}
+
+// Map one chunk-aligned chunk, preferring huge pages; NULL when out of memory
+static void *map_chunk(struct Arena *arena) {
+
+    if(arena->huge_pages) {
+        void *chunk = mmap(NULL, ARENA_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(chunk != MAP_FAILED) {
+            arena->hugetlb_chunks++;
+            return chunk;
+        }
+    }
+
+    // Map twice the size and trim it down to an aligned chunk, which the kernel can back with a single huge page
+    char *region = mmap(NULL, ARENA_CHUNK_SIZE * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(region == MAP_FAILED) {
+        return NULL;
+    }
+    char *chunk = (char *)(((uintptr_t)region + ARENA_CHUNK_SIZE - 1) & ~(uintptr_t)(ARENA_CHUNK_SIZE - 1));
+    if(chunk > region) {
+        munmap(region, chunk - region);
+    }
+    munmap(chunk + ARENA_CHUNK_SIZE, region + ARENA_CHUNK_SIZE * 2 - (chunk + ARENA_CHUNK_SIZE));
+
+    if(arena->huge_pages && madvise(chunk, ARENA_CHUNK_SIZE, MADV_HUGEPAGE) == 0) {
+        arena->thp_chunks++;
+    } else {
+        arena->small_chunks++;
+    }
+    return chunk;
+
+}
+
+static bool chunk_has_room(const struct Arena *arena, const struct ArenaChunk *chunk) {
+    return chunk->free_list != NULL || chunk->unused + arena->slot_size <= (char *)chunk + ARENA_CHUNK_SIZE;
+}
+
+static void link_free(struct Arena *arena, struct ArenaChunk *chunk) {
+    chunk->prev_free = NULL;
+    chunk->next_free = arena->free_chunks;
+    if(arena->free_chunks != NULL) {
+        arena->free_chunks->prev_free = chunk;
+    }
+    arena->free_chunks = chunk;
+}
+
+static void unlink_free(struct Arena *arena, struct ArenaChunk *chunk) {
+    if(chunk->prev_free != NULL) {
+        chunk->prev_free->next_free = chunk->next_free;
+    } else {
+        arena->free_chunks = chunk->next_free;
+    }
+    if(chunk->next_free != NULL) {
+        chunk->next_free->prev_free = chunk->prev_free;
+    }
+}
+
+// Return an empty chunk to the system
+static void release_chunk(struct Arena *arena, struct ArenaChunk *chunk) {
+    unlink_free(arena, chunk);
+    if(chunk->prev != NULL) {
+        chunk->prev->next = chunk->next;
+    } else {
+        arena->chunks = chunk->next;
+    }
+    if(chunk->next != NULL) {
+        chunk->next->prev = chunk->prev;
+    }
+    munmap(chunk, ARENA_CHUNK_SIZE);
+    arena->chunks_mapped--;
+}
+
+// Get a slot, adding a chunk when none are free; NULL when out of memory
+void *arena_alloc(struct Arena *arena) {
+
+    struct ArenaChunk *chunk = arena->free_chunks;
+    if(chunk == NULL) {
+
+        chunk = map_chunk(arena);
+        if(chunk == NULL) {
+            return NULL;
+        }
+        chunk->arena = arena;
+        chunk->prev = NULL;
+        chunk->next = arena->chunks;
+        if(arena->chunks != NULL) {
+            arena->chunks->prev = chunk;
+        }
+        arena->chunks = chunk;
+        chunk->free_list = NULL;
+        chunk->unused = (char *)chunk + CHUNK_HEADER_SIZE;
+        chunk->used = 0;
+        link_free(arena, chunk);
+        arena->chunks_mapped++;
+
+    }
+    if(chunk == arena->spare) {
+        arena->spare = NULL;
+    }
+
+    // Reuse freed slots first; new ones are handed out front to back
+    void *slot;
+    if(chunk->free_list != NULL) {
+        slot = chunk->free_list;
+        chunk->free_list = *(void **)slot;
+    } else {
+        slot = chunk->unused;
+        chunk->unused += arena->slot_size;
+    }
+    chunk->used++;
+    if(!chunk_has_room(arena, chunk)) {
+        unlink_free(arena, chunk);
+    }
+    arena->slots_in_use++;
+    return slot;
+
+}
+
+// Return a slot to the arena it came from, and its chunk to the system once the chunk is empty
+void arena_free(void *slot) {
+
+    if(slot == NULL) {
+        return;
+    }
+    struct ArenaChunk *chunk = (struct ArenaChunk *)((uintptr_t)slot & ~(uintptr_t)(ARENA_CHUNK_SIZE - 1));
+    struct Arena *arena = chunk->arena;
+    if(!chunk_has_room(arena, chunk)) {
+        link_free(arena, chunk);
+    }
+    *(void **)slot = chunk->free_list;
+    chunk->free_list = slot;
+    chunk->used--;
+    arena->slots_in_use--;
+
+    if(chunk->used == 0) {
+        if(arena->spare == NULL) {
+            arena->spare = chunk;
+        } else {
+            release_chunk(arena, chunk);
+        }
+    }
+
+}
+
+void free_arena(struct Arena *arena) {
+    while(arena->chunks != NULL) {
+        struct ArenaChunk *next = arena->chunks->next;
+        munmap(arena->chunks, ARENA_CHUNK_SIZE);
+        arena->chunks = next;
+    }
+    arena->free_chunks = NULL;
+    arena->spare = NULL;
+    arena->chunks_mapped = 0;
+}
+
+// Whether a slot can be handed out without mapping another chunk
+bool arena_has_free_slot(const struct Arena *arena) {
+    return arena->free_chunks != NULL;
+}
+
+void init_buffer_arenas(struct BufferArenas *arenas, bool huge_pages) {
+    size_t size = SMALLEST_BUFFER;
+    for(int i = 0; i < BUFFER_CLASSES; i++) {
+        init_arena(&arenas->classes[i], size, huge_pages);
+        size *= 4;
+    }
+}
+
+// Get a buffer of at least `size` bytes from the smallest class that fits; NULL if it's too large or out of memory
+void *alloc_buffer(struct BufferArenas *arenas, size_t size) {
+    for(int i = 0; i < BUFFER_CLASSES; i++) {
+        if(size <= arenas->classes[i].slot_size) {
+            return arena_alloc(&arenas->classes[i]);
+        }
+    }
+    return NULL;
+}
+
+// The size class a buffer of `size` bytes comes from; NULL if it's too large
+const struct Arena *buffer_class(const struct BufferArenas *arenas, size_t size) {
+    for(int i = 0; i < BUFFER_CLASSES; i++) {
+        if(size <= arenas->classes[i].slot_size) {
+            return &arenas->classes[i];
+        }
+    }
+    return NULL;
+}
+
+void free_buffer_arenas(struct BufferArenas *arenas) {
+    for(int i = 0; i < BUFFER_CLASSES; i++) {
+        free_arena(&arenas->classes[i]);
+    }
+}
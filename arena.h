@@ -0,0 +1,50 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Arenas grow in chunks of one 2 MiB huge page, aligned to their size so that a slot's chunk can be found from its address
+#define ARENA_CHUNK_SIZE ((size_t)2 << 20)
+
+// Response buffer size classes, from 256 bytes up to 64 KiB in steps of four
+#define BUFFER_CLASSES 5
+#define SMALLEST_BUFFER 256
+
+struct ArenaChunk;
+
+/* Fixed-size slots carved out of 2 MiB chunks. With huge pages each chunk is a single TLB entry, which matters when the
+ * event loop touches hundreds of thousands of connection states spread over the heap. Chunks come from the hugetlbfs
+ * pool when it has pages to spare, otherwise from ordinary memory marked for transparent huge pages, and failing that
+ * from ordinary pages. Each chunk keeps its own free list, so that a chunk whose slots have all been freed can be
+ * returned to the system; one empty chunk is kept back per arena so that a busy arena doesn't map and unmap a chunk on
+ * every allocation. */
+struct Arena {
+    size_t slot_size;
+    bool huge_pages;
+    struct ArenaChunk *chunks;
+    struct ArenaChunk *free_chunks; // chunks with a slot to spare
+    struct ArenaChunk *spare; // an empty chunk kept mapped, if any
+    long slots_in_use;
+    long chunks_mapped; // mapped now, for the memory budget
+    long hugetlb_chunks; // how every chunk ever mapped was backed
+    long thp_chunks;
+    long small_chunks;
+};
+
+// One arena per response buffer size class
+struct BufferArenas {
+    struct Arena classes[BUFFER_CLASSES];
+};
+
+void init_arena(struct Arena *arena, size_t slot_size, bool huge_pages);
+void *arena_alloc(struct Arena *arena);
+void arena_free(void *slot);
+void free_arena(struct Arena *arena);
+bool arena_has_free_slot(const struct Arena *arena);
+void init_buffer_arenas(struct BufferArenas *arenas, bool huge_pages);
+void *alloc_buffer(struct BufferArenas *arenas, size_t size);
+const struct Arena *buffer_class(const struct BufferArenas *arenas, size_t size);
+void free_buffer_arenas(struct BufferArenas *arenas);
+
+#endif
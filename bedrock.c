@@ -0,0 +1,463 @@
+#define _GNU_SOURCE
+#include "bedrock.h"
+#include "hash.h"
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+// For full documentation of the RakNet unconnected ping see https://wiki.vg/Raknet_Protocol#Unconnected_Ping
+
+// Number of UDP sockets of each family that pings are spread over
+#define BEDROCK_NUM_SOCKETS 4
+
+// Number of datagrams handed to a single sendmmsg()/recvmmsg() call
+#define BEDROCK_BATCH_SIZE 256
+
+// Largest pong we accept; real ones are a couple hundred bytes
+#define MAX_PONG_SIZE 1500
+
+// How long to keep listening for pongs after the last ping was sent, in milliseconds
+#define BEDROCK_LINGER_MS 5000
+
+// Pongs echoing a send time older than this are rejected
+#define BEDROCK_MAX_RTT_MS 10000
+
+/* Pongs answered recently, so that duplicated or replayed copies of a pong are only counted once. Pongs are only
+ * accepted for BEDROCK_MAX_RTT_MS after their ping, so entries expire then; a pong is looked for among a few slots,
+ * and when all of them are live the one that expires first is overwritten. */
+#define BEDROCK_SEEN_SLOTS (1 << 20)
+#define BEDROCK_SEEN_PROBES 8
+
+#define PING_LENGTH 33
+#define PONG_HEADER_LENGTH 35
+
+// A pong that has been answered, identified by the cookie of its ping
+struct SeenPong {
+    uint32_t cookie;
+    uint32_t expires_ms; // 0 for an empty slot
+};
+
+static const unsigned char raknet_magic[16] = {0x00, 0xff, 0xff, 0x00, 0xfe, 0xfe, 0xfe, 0xfe, 0xfd, 0xfd, 0xfd, 0xfd, 0x12, 0x34, 0x56, 0x78};
+
+struct BedrockScan {
+
+    int fds4[BEDROCK_NUM_SOCKETS];
+    int fds6[BEDROCK_NUM_SOCKETS]; // all -1 when IPv6 is unavailable
+    int next_fd;
+    struct timespec start;
+    uint32_t secret;
+    uint64_t guid;
+
+    long pings_sent;
+    long pongs_received;
+    long pongs_rejected;
+    long pongs_duplicate;
+    struct SeenPong *seen;
+
+    // IPv6 targets that were skipped because the host can't open IPv6 sockets
+    long skipped_ipv6;
+
+    // Pending outgoing batch; batch_pos counts datagrams of the batch that have already been sent
+    unsigned char ping_bufs[BEDROCK_BATCH_SIZE][PING_LENGTH];
+    struct sockaddr_storage dests[BEDROCK_BATCH_SIZE];
+    struct iovec send_iovs[BEDROCK_BATCH_SIZE];
+    struct mmsghdr send_msgs[BEDROCK_BATCH_SIZE];
+    struct Target targets[BEDROCK_BATCH_SIZE];
+    int batch_len;
+    int batch_pos;
+
+    unsigned char pong_bufs[BEDROCK_BATCH_SIZE][MAX_PONG_SIZE];
+    struct sockaddr_storage srcs[BEDROCK_BATCH_SIZE];
+    struct iovec recv_iovs[BEDROCK_BATCH_SIZE];
+    struct mmsghdr recv_msgs[BEDROCK_BATCH_SIZE];
+
+};
+
+static uint32_t elapsed_ms(struct BedrockScan *scan) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - scan->start.tv_sec) * 1000 + (now.tv_nsec - scan->start.tv_nsec) / 1000000;
+}
+
+// The low half of the ping's time field authenticates the (address, port, send time) triple so that no per-target state is needed
+static uint32_t ping_cookie(struct BedrockScan *scan, const struct in6_addr *addr, uint16_t port, uint32_t send_ms) {
+    return mix32(hash_address(addr) ^ scan->secret ^ mix32(send_ms ^ (uint32_t)port << 16));
+}
+
+// Remember a pong, returning false if it has been seen before
+static bool first_pong(struct BedrockScan *scan, uint32_t cookie, uint32_t send_ms, uint32_t now) {
+
+    uint32_t expires_ms = send_ms + BEDROCK_MAX_RTT_MS;
+    uint32_t slot = mix32(cookie);
+    struct SeenPong *victim = NULL;
+    for(int i = 0; i < BEDROCK_SEEN_PROBES; i++) {
+        struct SeenPong *entry = &scan->seen[(slot + i) % BEDROCK_SEEN_SLOTS];
+        if(entry->expires_ms == expires_ms && entry->cookie == cookie) {
+            return false;
+        }
+        if(entry->expires_ms < now) {
+            entry->expires_ms = 0;
+        }
+        if(victim == NULL || entry->expires_ms < victim->expires_ms) {
+            victim = entry;
+        }
+    }
+
+    victim->cookie = cookie;
+    victim->expires_ms = expires_ms;
+    return true;
+
+}
+
+static void write_u64(unsigned char *buf, uint64_t value) {
+    for(int i = 0; i < 8; i++) {
+        buf[i] = value >> (56 - i * 8);
+    }
+}
+
+static uint64_t read_u64(const unsigned char *buf) {
+    uint64_t value = 0;
+    for(int i = 0; i < 8; i++) {
+        value = value << 8 | buf[i];
+    }
+    return value;
+}
+
+// Open a socket of the given family, spread over the configured source addresses of that family; ports are left to the kernel
+static int open_socket(struct Config *config, int family, int index, int epoll_fd) {
+
+    int fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if(fd == -1) {
+        if(family == AF_INET6 && errno == EAFNOSUPPORT) {
+            return -1;
+        }
+        perror("socket");
+        return -2;
+    }
+
+    struct in6_addr any;
+    if(family == AF_INET) {
+        map_ipv4(&any, htonl(INADDR_ANY));
+    } else {
+        any = in6addr_any;
+    }
+    struct sockaddr_in6 source;
+    pick_source(&config->source_pool, &any, index, &source);
+    struct sockaddr_storage local_addr;
+    socklen_t local_length = to_sockaddr(&source.sin6_addr, 0, &local_addr);
+    if(bind(fd, (struct sockaddr *)&local_addr, local_length) == -1) {
+        perror("bind");
+        close(fd);
+        return -2;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        perror("epoll_ctl");
+        close(fd);
+        return -2;
+    }
+
+    return fd;
+
+}
+
+/* IPv4 and IPv6 targets get sockets of their own family. Hosts with IPv6 disabled can't open IPv6 sockets, in which
+ * case the IPv4 ones are used alone and IPv6 targets are skipped. */
+static int open_sockets(struct BedrockScan *scan, struct Config *config, int epoll_fd) {
+
+    for(int i = 0; i < BEDROCK_NUM_SOCKETS; i++) {
+        scan->fds4[i] = open_socket(config, AF_INET, i, epoll_fd);
+        if(scan->fds4[i] < 0) {
+            return 1;
+        }
+    }
+
+    for(int i = 0; i < BEDROCK_NUM_SOCKETS; i++) {
+        scan->fds6[i] = open_socket(config, AF_INET6, i, epoll_fd);
+        if(scan->fds6[i] == -2) {
+            return 1;
+        }
+        if(scan->fds6[i] == -1) {
+            break;
+        }
+    }
+
+    return 0;
+
+}
+
+// Fill the outgoing batch with up to `count` new targets
+static void fill_batch(struct BedrockScan *scan, struct TargetSource *source, int count) {
+
+    uint32_t now = elapsed_ms(scan);
+    int num_targets = source->next_batch(source, scan->targets, count);
+    scan->batch_len = 0;
+    scan->batch_pos = 0;
+
+    for(int j = 0; j < num_targets; j++) {
+
+        struct Target target = scan->targets[j];
+        if(!is_ipv4(&target.addr) && scan->fds6[0] < 0) {
+            scan->skipped_ipv6++;
+            continue;
+        }
+
+        int i = scan->batch_len++;
+        unsigned char *buf = scan->ping_bufs[i];
+        buf[0] = 0x01; // packet ID (unconnected ping)
+        write_u64(buf + 1, (uint64_t)now << 32 | ping_cookie(scan, &target.addr, target.port, now));
+        memcpy(buf + 9, raknet_magic, sizeof(raknet_magic));
+        write_u64(buf + 25, scan->guid);
+
+        scan->send_msgs[i].msg_hdr.msg_namelen = to_sockaddr(&target.addr, target.port, &scan->dests[i]);
+
+    }
+
+}
+
+// Send as much of the pending batch as the sockets accept, each run of targets of one family through a socket of that family
+static void send_batch(struct BedrockScan *scan) {
+
+    while(scan->batch_pos < scan->batch_len) {
+
+        int family = scan->dests[scan->batch_pos].ss_family;
+        int run = 1;
+        while(scan->batch_pos + run < scan->batch_len && scan->dests[scan->batch_pos + run].ss_family == family) {
+            run++;
+        }
+
+        int fd = (family == AF_INET ? scan->fds4 : scan->fds6)[scan->next_fd];
+        int sent = sendmmsg(fd, scan->send_msgs + scan->batch_pos, run, 0);
+        if(sent == -1) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+
+            // Per-destination errors such as ENETUNREACH are reported for the first unsent datagram, skip it
+            scan->batch_pos++;
+            continue;
+        }
+
+        scan->batch_pos += sent;
+        scan->pings_sent += sent;
+        scan->next_fd = (scan->next_fd + 1) % BEDROCK_NUM_SOCKETS;
+
+    }
+
+}
+
+static void handle_pong(struct BedrockScan *scan, struct Database *db, const unsigned char *buf, int length, const struct sockaddr_storage *src, uint32_t now) {
+
+    if(length < PONG_HEADER_LENGTH || buf[0] != 0x1c || memcmp(buf + 17, raknet_magic, sizeof(raknet_magic)) != 0) {
+        scan->pongs_rejected++;
+        return;
+    }
+
+    uint64_t ping_time = read_u64(buf + 1);
+    uint32_t send_ms = ping_time >> 32;
+    struct in6_addr addr;
+    uint16_t port;
+    from_sockaddr(src, &addr, &port);
+    if((uint32_t)ping_time != ping_cookie(scan, &addr, port, send_ms) || now - send_ms > BEDROCK_MAX_RTT_MS) {
+        scan->pongs_rejected++;
+        return;
+    }
+
+    int str_length = buf[33] << 8 | buf[34];
+    if(str_length > length - PONG_HEADER_LENGTH) {
+        scan->pongs_rejected++;
+        return;
+    }
+
+    // The cookie stays valid for every copy of the pong, so copies of one that was already stored are dropped
+    if(!first_pong(scan, (uint32_t)ping_time, send_ms, now)) {
+        scan->pongs_duplicate++;
+        return;
+    }
+
+    scan->pongs_received++;
+
+    char addr_str[MAX_ADDRESS_LENGTH];
+    format_address(&addr, addr_str);
+    printf("found a bedrock server on %s:%d (%u ms); servers found: %ld, addresses searched: %ld\n", addr_str, port, now - send_ms, scan->pongs_received, scan->pings_sent);
+
+    struct ServerRecord record = {
+        .addr = addr,
+        .port = port,
+        .edition = "bedrock",
+        .response = (const char *)buf + PONG_HEADER_LENGTH,
+        .response_length = str_length,
+        .rtt_ms = now - send_ms
+    };
+    insert_server(db, &record);
+
+}
+
+static void receive_pongs(struct BedrockScan *scan, struct Database *db, int fd) {
+
+    while(1) {
+
+        for(int i = 0; i < BEDROCK_BATCH_SIZE; i++) {
+            scan->recv_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        }
+
+        int received = recvmmsg(fd, scan->recv_msgs, BEDROCK_BATCH_SIZE, MSG_DONTWAIT, NULL);
+        if(received == -1) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("recvmmsg");
+            }
+            return;
+        }
+
+        uint32_t now = elapsed_ms(scan);
+        for(int i = 0; i < received; i++) {
+            handle_pong(scan, db, scan->pong_bufs[i], scan->recv_msgs[i].msg_len, &scan->srcs[i], now);
+        }
+
+        if(received < BEDROCK_BATCH_SIZE) {
+            return;
+        }
+
+    }
+
+}
+
+static void init_messages(struct BedrockScan *scan) {
+
+    memset(scan->send_msgs, 0, sizeof(scan->send_msgs));
+    memset(scan->recv_msgs, 0, sizeof(scan->recv_msgs));
+    memset(scan->dests, 0, sizeof(scan->dests));
+
+    for(int i = 0; i < BEDROCK_BATCH_SIZE; i++) {
+
+        scan->send_iovs[i].iov_base = scan->ping_bufs[i];
+        scan->send_iovs[i].iov_len = PING_LENGTH;
+        scan->send_msgs[i].msg_hdr.msg_name = &scan->dests[i];
+        scan->send_msgs[i].msg_hdr.msg_iov = &scan->send_iovs[i];
+        scan->send_msgs[i].msg_hdr.msg_iovlen = 1;
+
+        scan->recv_iovs[i].iov_base = scan->pong_bufs[i];
+        scan->recv_iovs[i].iov_len = MAX_PONG_SIZE;
+        scan->recv_msgs[i].msg_hdr.msg_name = &scan->srcs[i];
+        scan->recv_msgs[i].msg_hdr.msg_iov = &scan->recv_iovs[i];
+        scan->recv_msgs[i].msg_hdr.msg_iovlen = 1;
+
+    }
+
+}
+
+/* Scan for Bedrock Edition servers. Pings are sent at the configured rate in batches over a handful of UDP sockets and
+ * validated statelessly when the pongs come back, so memory use does not depend on the number of targets in flight. */
+int run_bedrock_scan(struct Config *config, struct TargetSource *source, struct Database *db, int epoll_fd) {
+
+    struct BedrockScan *scan = malloc(sizeof(struct BedrockScan));
+    if(scan == NULL) {
+        fprintf(stderr, "failed to allocate bedrock scan state\n");
+        return 1;
+    }
+
+    for(int i = 0; i < BEDROCK_NUM_SOCKETS; i++) {
+        scan->fds4[i] = -1;
+        scan->fds6[i] = -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &scan->start);
+    scan->secret = mix32(scan->start.tv_nsec ^ getpid() ^ time(NULL));
+    scan->guid = (uint64_t)mix32(scan->secret) << 32 | mix32(~scan->secret);
+    scan->next_fd = 0;
+    scan->pings_sent = 0;
+    scan->pongs_received = 0;
+    scan->pongs_rejected = 0;
+    scan->pongs_duplicate = 0;
+    scan->seen = calloc(BEDROCK_SEEN_SLOTS, sizeof(struct SeenPong));
+    scan->skipped_ipv6 = 0;
+    scan->batch_len = 0;
+    scan->batch_pos = 0;
+    init_messages(scan);
+
+    int status = 0;
+    if(scan->seen == NULL) {
+        fprintf(stderr, "failed to allocate bedrock pong table\n");
+        status = 1;
+        goto cleanup;
+    }
+    if(open_sockets(scan, config, epoll_fd)) {
+        status = 1;
+        goto cleanup;
+    }
+
+    printf("bedrock scan: %d sockets%s, rate %d pps\n", BEDROCK_NUM_SOCKETS, scan->fds6[0] >= 0 ? " per address family" : " (IPv4 only)", config->rate);
+
+    struct epoll_event events[2 * BEDROCK_NUM_SOCKETS];
+    uint32_t last_send_ms = 0;
+    while(1) {
+
+        poll_exclude_reload();
+
+        uint32_t now = elapsed_ms(scan);
+        bool exhausted = source->finished || budget_exhausted(config, scan->pings_sent, now);
+        bool sending = !exhausted || scan->batch_pos < scan->batch_len;
+
+        if(sending) {
+
+            // Top up the batch with however many pings the rate limit allows by now
+            if(scan->batch_pos == scan->batch_len && !exhausted) {
+                long allowed = (long)((uint64_t)config->rate * now / 1000) - scan->pings_sent;
+                if(config->max_probes > 0 && allowed > config->max_probes - scan->pings_sent) {
+                    allowed = config->max_probes - scan->pings_sent;
+                }
+                if(allowed > 0) {
+                    fill_batch(scan, source, allowed < BEDROCK_BATCH_SIZE ? allowed : BEDROCK_BATCH_SIZE);
+                }
+            }
+
+            send_batch(scan);
+            last_send_ms = now;
+
+        } else if(now - last_send_ms > BEDROCK_LINGER_MS) {
+            break;
+        }
+
+        int num_events = epoll_wait(epoll_fd, events, 2 * BEDROCK_NUM_SOCKETS, sending ? 1 : 100);
+        if(num_events == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            status = 1;
+            break;
+        }
+
+        for(int i = 0; i < num_events; i++) {
+            receive_pongs(scan, db, events[i].data.fd);
+        }
+
+    }
+
+    printf("bedrock scan finished; servers found: %ld, addresses searched: %ld, rejected pongs: %ld, duplicate pongs: %ld\n", scan->pongs_received, scan->pings_sent, scan->pongs_rejected, scan->pongs_duplicate);
+    if(scan->skipped_ipv6 > 0) {
+        printf("skipped %ld IPv6 targets, IPv6 is unavailable on this host\n", scan->skipped_ipv6);
+    }
+
+cleanup:
+    for(int i = 0; i < BEDROCK_NUM_SOCKETS; i++) {
+        if(scan->fds4[i] >= 0) {
+            close(scan->fds4[i]);
+        }
+        if(scan->fds6[i] >= 0) {
+            close(scan->fds6[i]);
+        }
+    }
+    free(scan->seen);
+    free(scan);
+    return status;
+
+}
\ No newline at end of file
@@ -0,0 +1,10 @@
+#ifndef __BEDROCK_H
+#define __BEDROCK_H
+
+#include "target-source.h"
+#include "config.h"
+#include "db.h"
+
+int run_bedrock_scan(struct Config *config, struct TargetSource *source, struct Database *db, int epoll_fd);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,15 @@
+#include "exclude.h"
+#include <stdio.h>
+
+/* Compile a text list of subnets, in the format of exclude.txt, into the binary blocklist format that minescan maps
+ * directly at startup. Writing the output over the file a running scan uses and sending it SIGHUP swaps the new list in. */
+int main(int argc, char **argv) {
+
+    if(argc != 3) {
+        fprintf(stderr, "usage: %s INPUT OUTPUT\n", argv[0]);
+        return 1;
+    }
+
+    return compile_exclude_list(argv[1], argv[2]);
+
+}
@@ -0,0 +1,565 @@
+#include "config.h"
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+// Subnets that are never scanned, whatever the target source
+#define EXCLUDE_FILE "exclude.txt"
+
+// Default target ports of Java and Bedrock Edition servers
+#define JAVA_PORT 25565
+#define BEDROCK_PORT 19132
+
+// Client port used for outgoing connections when no source port range is given
+#define CLIENT_PORT 12345
+
+// Number of sockets to open at a time
+#define MAX_SOCKETS 10000
+
+// Number of sockets used by --rescan unless --max-sockets is given. Known servers answer quickly, so a refresh needs
+// far less concurrency than a sweep where most probes wait for their deadline.
+#define RESCAN_MAX_SOCKETS 2000
+
+// Seconds between probes of a watched server unless its watchlist entry says otherwise
+#define WATCH_INTERVAL 60
+
+// Per-prefix caps on concurrent probes and probes started per second (per /16 for IPv4, per /32 for IPv6)
+#define PREFIX_MAX_SOCKETS 64
+#define PREFIX_RATE 128
+
+// Block size ranked by --density, and the share of probes it spends outside the ranked blocks
+#define DENSITY_PREFIX 16
+#define EXPLORE_FRACTION 0.1
+
+// Seconds a coordinator's lease lasts without renewal, and the number of blocks it splits the permutation into
+#define LEASE_TIME 300
+#define LEASE_BLOCKS 1024
+
+// Socket count used by --stress
+#define STRESS_SOCKETS 1000000
+
+// Time allowed for a whole probe, from connect() to the end of the response
+#define PROBE_TIMEOUT_MS 10000
+
+// Packets per second sent by the Bedrock scanner unless --rate is given
+#define DEFAULT_RATE 10000
+
+// Defaults applied by the lean socket profile unless overridden
+#define LEAN_SYN_RETRIES 1
+#define LEAN_USER_TIMEOUT_MS 5000
+
+// Largest SYN retransmission count the kernel accepts for TCP_SYNCNT
+#define MAX_SYN_RETRIES 127
+
+// Parse a positive integer option, printing an error if it is malformed
+static int parse_positive(const char *name, const char *str, int *out) {
+    char *end;
+    long value = strtol(str, &end, 10);
+    if(*str == '\0' || *end != '\0' || value <= 0 || value > 0x7fffffff) {
+        fprintf(stderr, "invalid value for --%s: %s\n", name, str);
+        return 1;
+    }
+    *out = value;
+    return 0;
+}
+
+/* Parse a comma-separated list of ports and port ranges such as "25565,25566-25600". Duplicates are dropped. */
+static int parse_ports(struct Config *config, const char *str) {
+
+    static uint8_t seen[65536 / 8];
+    memset(seen, 0, sizeof(seen));
+    free(config->ports);
+    config->ports = malloc(65536 * sizeof(uint16_t));
+    config->num_ports = 0;
+    config->ports_given = false;
+    if(config->ports == NULL) {
+        fprintf(stderr, "failed to allocate port list\n");
+        return 1;
+    }
+
+    const char *pos = str;
+    while(*pos != '\0') {
+
+        // Parsed as strictly as --source-ports
+        int lo, hi;
+        if(parse_port_range(pos, &pos, &lo, &hi)) {
+            fprintf(stderr, "invalid port or port range in port list: %s\n", str);
+            return 1;
+        }
+
+        for(int port = lo; port <= hi; port++) {
+            if(!(seen[port / 8] & 1 << port % 8)) {
+                seen[port / 8] |= 1 << port % 8;
+                config->ports[config->num_ports++] = port;
+            }
+        }
+
+        if(*pos == ',' && pos[1] != '\0') {
+            pos++;
+        } else if(*pos != '\0') {
+            fprintf(stderr, "invalid port list: %s\n", str);
+            return 1;
+        }
+
+    }
+
+    return 0;
+
+}
+
+static void print_usage(const char *argv0) {
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  --source-addr ADDR    bind outgoing connections to ADDR; may be repeated\n"
+        "  --source-ports LO-HI  range of local ports to bind (default %d)\n"
+        "  --source-hash         pick source address/port by hashing the target instead of round-robin\n"
+        "  --cidr-file FILE      scan only the subnets listed in FILE instead of all of IPv4\n"
+        "  --ip-file FILE        scan the addresses (ADDR or ADDR:PORT) listed in FILE, in shuffled order\n"
+        "  --stdin               scan addresses read line by line from standard input as they arrive\n"
+        "  --rescan              re-probe the servers already in scan.db (only those on --ports, if given)\n"
+        "  --seen-within SECONDS with --rescan, only servers found within the last SECONDS\n"
+        "  --older-than SECONDS  with --rescan, only servers not found within the last SECONDS\n"
+        "  --watch FILE          run as a monitor, probing the servers in FILE (ADDR[:PORT] [INTERVAL]) forever\n"
+        "  --watch-interval SECONDS  default interval between probes of a watched server (default %d)\n"
+        "  --density             scan the blocks where earlier runs found the most servers first\n"
+        "  --density-prefix N    size of the blocks ranked by --density, 16 or 24 (default %d)\n"
+        "  --explore FRACTION    with --density, share of probes spent outside the ranked blocks (default %.2f)\n"
+        "  --sample FRACTION     probe a uniform sample of this share of IPv4 and estimate totals and distributions\n"
+        "  --coordinator SOCKET  hand out blocks of a full scan to workers connecting to SOCKET and store their results\n"
+        "  --worker SOCKET       scan the blocks leased by the coordinator at SOCKET\n"
+        "  --lease-time SECONDS  with --coordinator, how long a lease lasts without renewal (default %d)\n"
+        "  --lease-blocks N      with --coordinator, number of blocks the scan is split into (default %d)\n",
+        argv0, CLIENT_PORT, WATCH_INTERVAL, DENSITY_PREFIX, EXPLORE_FRACTION, LEASE_TIME, LEASE_BLOCKS);
+    fprintf(stderr,
+        "  --exclude FILE        subnets to never scan (default %s)\n"
+        "  --ports LIST          target ports and ranges, e.g. 25565,25566-25600 (default %d, or %d with --bedrock)\n"
+        "  --learn-ports         scan ports in order of how many servers earlier scans found on them\n"
+        "  --learn-ports-per-prefix  like --learn-ports, but rank ports separately for each /16\n"
+        "  --top-ports N         with --learn-ports, only scan the N highest-yield ports\n"
+        "  --max-probes N        stop starting new probes after N targets\n"
+        "  --time-limit SECONDS  stop starting new probes after this long\n"
+        "  --max-sockets N       number of connections kept open at once (default %d, or %d with --rescan)\n"
+        "  --prefix-sockets N    connections kept open at once to any one /16 (default %d)\n"
+        "  --prefix-rate N       new connections per second to any one /16 (default %d)\n"
+        "  --lean                RST on close and minimal kernel buffers for each socket\n"
+        "  --syn-retries N       per-socket SYN retransmission limit (lean default %d)\n"
+        "  --user-timeout MS     per-socket TCP_USER_TIMEOUT (lean default %d)\n"
+        "  --cpu N               pin the scanner to CPU N, keeping its memory on that CPU's NUMA node\n"
+        "  --memory-limit MIB    keep memory use under MIB, pausing new connections as it gets close\n"
+        "  --no-huge-pages       keep connection state and buffers on regular pages instead of 2 MiB huge pages\n"
+        "  --drop-field NAME     leave the top-level field NAME out of stored responses; may be repeated\n"
+        "  --keep-favicon        store favicons in responses instead of only their hash\n"
+        "  --stats               print socket and memory usage every second\n"
+        "  --stress              lean profile with %d concurrent sockets and --stats\n"
+        "  --timeout MS          deadline for each probe (default %d)\n"
+        "  --fixed-timeout       use --timeout for every probe instead of deadlines from per-prefix RTT estimates\n"
+        "  --no-legacy           don't retry silent hosts with the pre-1.7 ping\n"
+        "  --no-retry            don't probe targets a second time after a timeout or reset\n"
+        "  --no-skip-unreachable keep probing prefixes that routers report as unreachable\n"
+        "  --protocol N          protocol version sent in the handshake (default -1)\n"
+        "  --hostname NAME       server address sent in the handshake (default: the target's IP)\n"
+        "  --rtt                 pipeline a ping packet after the status request and store the RTT\n"
+        "  --bedrock             scan for Bedrock Edition servers over UDP instead\n"
+        "  --rate N              Bedrock pings sent per second (default %d)\n",
+        EXCLUDE_FILE, JAVA_PORT, BEDROCK_PORT, MAX_SOCKETS, RESCAN_MAX_SOCKETS, PREFIX_MAX_SOCKETS, PREFIX_RATE, LEAN_SYN_RETRIES, LEAN_USER_TIMEOUT_MS, STRESS_SOCKETS, PROBE_TIMEOUT_MS, DEFAULT_RATE);
+}
+
+int parse_args(struct Config *config, int argc, char **argv) {
+
+    init_source_pool(&config->source_pool, CLIENT_PORT);
+    config->max_sockets = MAX_SOCKETS;
+    config->prefix_max_sockets = PREFIX_MAX_SOCKETS;
+    config->prefix_rate = PREFIX_RATE;
+    config->lean = false;
+    config->syn_retries = 0;
+    config->user_timeout_ms = 0;
+    config->print_stats = false;
+    config->bedrock = false;
+    config->rate = DEFAULT_RATE;
+    config->timeout_ms = PROBE_TIMEOUT_MS;
+    config->adaptive_timeout = true;
+    config->legacy = true;
+    config->skip_unreachable = true;
+    config->retry = true;
+    config->rtt = false;
+    config->protocol = -1;
+    config->hostname = NULL;
+    config->ports = NULL;
+    config->num_ports = 0;
+    config->ports_given = false;
+    config->exclude_path = EXCLUDE_FILE;
+    config->cidr_path = NULL;
+    config->ip_path = NULL;
+    config->from_stdin = false;
+    config->rescan = false;
+    config->watch_path = NULL;
+    config->watch_interval = WATCH_INTERVAL;
+    config->density = false;
+    config->density_prefix = DENSITY_PREFIX;
+    config->explore_fraction = EXPLORE_FRACTION;
+    config->sample_fraction = 0;
+    config->coordinator_path = NULL;
+    config->worker_path = NULL;
+    config->lease_time = 0;
+    config->lease_blocks = 0;
+    config->cpu = -1;
+    config->huge_pages = true;
+    config->memory_limit_mib = 0;
+    config->fields.num_dropped = 0;
+    config->fields.keep_favicon = false;
+    config->seen_within = 0;
+    config->older_than = 0;
+    config->learn_ports = false;
+    config->learn_per_prefix = false;
+    config->top_ports = 0;
+    config->max_probes = 0;
+    config->time_limit = 0;
+
+    static const struct option options[] = {
+        {"source-addr", required_argument, NULL, 'a'},
+        {"source-ports", required_argument, NULL, 'p'},
+        {"source-hash", no_argument, NULL, 'H'},
+        {"cidr-file", required_argument, NULL, 'c'},
+        {"ip-file", required_argument, NULL, 'i'},
+        {"stdin", no_argument, NULL, 'I'},
+        {"rescan", no_argument, NULL, 'u'},
+        {"seen-within", required_argument, NULL, 'w'},
+        {"older-than", required_argument, NULL, 'g'},
+        {"watch", required_argument, NULL, 'W'},
+        {"watch-interval", required_argument, NULL, 'V'},
+        {"density", no_argument, NULL, 'D'},
+        {"density-prefix", required_argument, NULL, 'B'},
+        {"explore", required_argument, NULL, 'X'},
+        {"sample", required_argument, NULL, 'M'},
+        {"coordinator", required_argument, NULL, 'C'},
+        {"worker", required_argument, NULL, 'J'},
+        {"lease-time", required_argument, NULL, 'f'},
+        {"lease-blocks", required_argument, NULL, 'K'},
+        {"exclude", required_argument, NULL, 'x'},
+        {"ports", required_argument, NULL, 'o'},
+        {"learn-ports", no_argument, NULL, 'e'},
+        {"learn-ports-per-prefix", no_argument, NULL, 'E'},
+        {"top-ports", required_argument, NULL, 'k'},
+        {"max-probes", required_argument, NULL, 'm'},
+        {"time-limit", required_argument, NULL, 'd'},
+        {"max-sockets", required_argument, NULL, 'n'},
+        {"prefix-sockets", required_argument, NULL, 'y'},
+        {"prefix-rate", required_argument, NULL, 'z'},
+        {"lean", no_argument, NULL, 'l'},
+        {"syn-retries", required_argument, NULL, 'r'},
+        {"user-timeout", required_argument, NULL, 't'},
+        {"cpu", required_argument, NULL, 'G'},
+        {"memory-limit", required_argument, NULL, 'Z'},
+        {"no-huge-pages", no_argument, NULL, 'O'},
+        {"drop-field", required_argument, NULL, 'q'},
+        {"keep-favicon", no_argument, NULL, 'Q'},
+        {"stats", no_argument, NULL, 's'},
+        {"stress", no_argument, NULL, 'S'},
+        {"timeout", required_argument, NULL, 'T'},
+        {"fixed-timeout", no_argument, NULL, 'F'},
+        {"no-legacy", no_argument, NULL, 'L'},
+        {"no-skip-unreachable", no_argument, NULL, 'U'},
+        {"no-retry", no_argument, NULL, 'Y'},
+        {"rtt", no_argument, NULL, 'P'},
+        {"protocol", required_argument, NULL, 'v'},
+        {"hostname", required_argument, NULL, 'N'},
+        {"bedrock", no_argument, NULL, 'b'},
+        {"rate", required_argument, NULL, 'R'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    bool sockets_given = false;
+    int opt;
+    while((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch(opt) {
+            case 'a':
+                if(add_source_addr(&config->source_pool, optarg)) return 1;
+                break;
+            case 'p':
+                if(set_source_ports(&config->source_pool, optarg)) return 1;
+                break;
+            case 'H':
+                config->source_pool.by_hash = true;
+                break;
+            case 'c':
+                config->cidr_path = optarg;
+                break;
+            case 'i':
+                config->ip_path = optarg;
+                break;
+            case 'I':
+                config->from_stdin = true;
+                break;
+            case 'u':
+                config->rescan = true;
+                break;
+            case 'w':
+                if(parse_positive("seen-within", optarg, &config->seen_within)) return 1;
+                break;
+            case 'g':
+                if(parse_positive("older-than", optarg, &config->older_than)) return 1;
+                break;
+            case 'W':
+                config->watch_path = optarg;
+                break;
+            case 'V':
+                if(parse_positive("watch-interval", optarg, &config->watch_interval)) return 1;
+                break;
+            case 'D':
+                config->density = true;
+                break;
+            case 'B':
+                if(parse_positive("density-prefix", optarg, &config->density_prefix)) return 1;
+                if(config->density_prefix != 16 && config->density_prefix != 24) {
+                    fprintf(stderr, "--density-prefix must be 16 or 24\n");
+                    return 1;
+                }
+                break;
+            case 'X': {
+                char *end;
+                config->explore_fraction = strtod(optarg, &end);
+                if(*optarg == '\0' || *end != '\0' || !(config->explore_fraction >= 0 && config->explore_fraction <= 1)) {
+                    fprintf(stderr, "invalid value for --explore: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case 'M': {
+                char *end;
+                config->sample_fraction = strtod(optarg, &end);
+                if(*optarg == '\0' || *end != '\0' || !(config->sample_fraction > 0 && config->sample_fraction <= 1)) {
+                    fprintf(stderr, "invalid value for --sample: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case 'C':
+                config->coordinator_path = optarg;
+                break;
+            case 'J':
+                config->worker_path = optarg;
+                break;
+            case 'f':
+                if(parse_positive("lease-time", optarg, &config->lease_time)) return 1;
+                break;
+            case 'K':
+                if(parse_positive("lease-blocks", optarg, &config->lease_blocks)) return 1;
+                break;
+            case 'x':
+                config->exclude_path = optarg;
+                break;
+            case 'o':
+                if(parse_ports(config, optarg)) return 1;
+                config->ports_given = true;
+                break;
+            case 'E':
+                config->learn_per_prefix = true;
+                // fall through
+            case 'e':
+                config->learn_ports = true;
+                break;
+            case 'k':
+                if(parse_positive("top-ports", optarg, &config->top_ports)) return 1;
+                break;
+            case 'm': {
+                int max_probes;
+                if(parse_positive("max-probes", optarg, &max_probes)) return 1;
+                config->max_probes = max_probes;
+                break;
+            }
+            case 'd':
+                if(parse_positive("time-limit", optarg, &config->time_limit)) return 1;
+                break;
+            case 'n':
+                if(parse_positive("max-sockets", optarg, &config->max_sockets)) return 1;
+                sockets_given = true;
+                break;
+            case 'y':
+                if(parse_positive("prefix-sockets", optarg, &config->prefix_max_sockets)) return 1;
+                break;
+            case 'z':
+                if(parse_positive("prefix-rate", optarg, &config->prefix_rate)) return 1;
+                break;
+            case 'l':
+                config->lean = true;
+                break;
+            case 'r':
+                if(parse_positive("syn-retries", optarg, &config->syn_retries)) return 1;
+                if(config->syn_retries > MAX_SYN_RETRIES) {
+                    fprintf(stderr, "--syn-retries must be between 1 and %d\n", MAX_SYN_RETRIES);
+                    return 1;
+                }
+                break;
+            case 't':
+                if(parse_positive("user-timeout", optarg, &config->user_timeout_ms)) return 1;
+                break;
+            case 'G': {
+                char *end;
+                long cpu = strtol(optarg, &end, 10);
+                if(*optarg == '\0' || *end != '\0' || cpu < 0 || cpu > 0x7fffffff) {
+                    fprintf(stderr, "invalid value for --cpu: %s\n", optarg);
+                    return 1;
+                }
+                config->cpu = cpu;
+                break;
+            }
+            case 'Z':
+                if(parse_positive("memory-limit", optarg, &config->memory_limit_mib)) return 1;
+                break;
+            case 'O':
+                config->huge_pages = false;
+                break;
+            case 'q':
+                if(config->fields.num_dropped == MAX_DROPPED_FIELDS) {
+                    fprintf(stderr, "--drop-field can be given at most %d times\n", MAX_DROPPED_FIELDS);
+                    return 1;
+                }
+                if(*optarg == '\0' || strlen(optarg) > MAX_FIELD_NAME) {
+                    fprintf(stderr, "invalid field name for --drop-field: %s\n", optarg);
+                    return 1;
+                }
+                strcpy(config->fields.dropped[config->fields.num_dropped++], optarg);
+                break;
+            case 'Q':
+                config->fields.keep_favicon = true;
+                break;
+            case 's':
+                config->print_stats = true;
+                break;
+            case 'S':
+                config->max_sockets = STRESS_SOCKETS;
+                sockets_given = true;
+                config->lean = true;
+                config->print_stats = true;
+                break;
+            case 'T':
+                if(parse_positive("timeout", optarg, &config->timeout_ms)) return 1;
+                break;
+            case 'F':
+                config->adaptive_timeout = false;
+                break;
+            case 'L':
+                config->legacy = false;
+                break;
+            case 'U':
+                config->skip_unreachable = false;
+                break;
+            case 'Y':
+                config->retry = false;
+                break;
+            case 'P':
+                config->rtt = true;
+                break;
+            case 'v': {
+                char *end;
+                config->protocol = strtol(optarg, &end, 10);
+                if(*optarg == '\0' || *end != '\0') {
+                    fprintf(stderr, "invalid value for --protocol: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case 'N':
+                config->hostname = optarg;
+                break;
+            case 'b':
+                config->bedrock = true;
+                break;
+            case 'R':
+                if(parse_positive("rate", optarg, &config->rate)) return 1;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(optind < argc) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if(config->ports == NULL) {
+        config->ports = malloc(sizeof(uint16_t));
+        if(config->ports == NULL) {
+            fprintf(stderr, "failed to allocate port list\n");
+            return 1;
+        }
+        config->ports[0] = config->bedrock ? BEDROCK_PORT : JAVA_PORT;
+        config->num_ports = 1;
+    }
+
+    int num_sources = (config->cidr_path != NULL) + (config->ip_path != NULL) + config->from_stdin + config->rescan + (config->watch_path != NULL) + config->density + (config->sample_fraction > 0) + (config->worker_path != NULL);
+    if(num_sources > 1) {
+        fprintf(stderr, "--cidr-file, --ip-file, --stdin, --rescan, --watch, --density, --sample and --worker can't be combined\n");
+        return 1;
+    }
+    if((config->density || config->sample_fraction > 0) && config->bedrock) {
+        fprintf(stderr, "--density and --sample only support Java Edition servers\n");
+        return 1;
+    }
+    if(config->watch_path != NULL && config->bedrock) {
+        fprintf(stderr, "--watch only supports Java Edition servers\n");
+        return 1;
+    }
+    if(config->coordinator_path != NULL && (num_sources > 0 || config->learn_ports || config->bedrock)) {
+        fprintf(stderr, "--coordinator only splits a full IPv4 scan for Java Edition servers\n");
+        return 1;
+    }
+    if(config->worker_path != NULL && config->bedrock) {
+        fprintf(stderr, "--worker only supports Java Edition servers\n");
+        return 1;
+    }
+    if((config->lease_time > 0 || config->lease_blocks > 0) && config->coordinator_path == NULL) {
+        fprintf(stderr, "--lease-time and --lease-blocks require --coordinator\n");
+        return 1;
+    }
+    if(config->lease_time == 0) config->lease_time = LEASE_TIME;
+    if(config->lease_blocks == 0) config->lease_blocks = LEASE_BLOCKS;
+    if(num_sources > 0 && config->learn_ports) {
+        fprintf(stderr, "--learn-ports only applies to a full IPv4 scan\n");
+        return 1;
+    }
+
+    if((config->seen_within > 0 || config->older_than > 0) && !config->rescan) {
+        fprintf(stderr, "--seen-within and --older-than require --rescan\n");
+        return 1;
+    }
+
+    // A monitor has to keep probing its servers through outages, so nothing is ever skipped; it also has its own
+    // schedule for probing failed servers again
+    if(config->watch_path != NULL) {
+        config->skip_unreachable = false;
+        config->retry = false;
+    }
+
+    // Hitlists and known servers are expected to answer, so silence from them is more likely a lost SYN than a dead host
+    config->retry_silent = config->ip_path != NULL || config->from_stdin || config->rescan;
+
+    if(config->rescan && !sockets_given) {
+        config->max_sockets = RESCAN_MAX_SOCKETS;
+    }
+
+    if(config->top_ports > 0 && !config->learn_ports) {
+        fprintf(stderr, "--top-ports requires --learn-ports\n");
+        return 1;
+    }
+
+    if(config->lean) {
+        if(config->syn_retries == 0) config->syn_retries = LEAN_SYN_RETRIES;
+        if(config->user_timeout_ms == 0) config->user_timeout_ms = LEAN_USER_TIMEOUT_MS;
+    }
+
+    return 0;
+
+}
+
+/* Whether a --max-probes or --time-limit budget has been used up, after which no new targets are started. */
+bool budget_exhausted(const struct Config *config, long probes, uint64_t elapsed_ms) {
+    if(config->max_probes > 0 && probes >= config->max_probes) {
+        return true;
+    }
+    return config->time_limit > 0 && elapsed_ms >= (uint64_t)config->time_limit * 1000;
+}
\ No newline at end of file
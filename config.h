@@ -0,0 +1,63 @@
+#ifndef __CONFIG_H
+#define __CONFIG_H
+
+#include "source-pool.h"
+#include "json-filter.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+struct Config {
+    struct SourcePool source_pool;
+    int max_sockets;
+    int prefix_max_sockets;
+    int prefix_rate;
+    bool lean;
+    int syn_retries;
+    int user_timeout_ms;
+    bool print_stats;
+    bool bedrock;
+    int rate;
+    int timeout_ms;
+    bool adaptive_timeout;
+    bool legacy;
+    bool skip_unreachable;
+    bool retry;
+    bool retry_silent;
+    bool rtt;
+    int protocol;
+    const char *hostname;
+    uint16_t *ports;
+    int num_ports;
+    bool ports_given;
+    const char *exclude_path;
+    const char *cidr_path;
+    const char *ip_path;
+    bool from_stdin;
+    bool rescan;
+    const char *watch_path;
+    bool density;
+    int density_prefix;
+    double explore_fraction;
+    double sample_fraction;
+    const char *coordinator_path;
+    const char *worker_path;
+    int lease_time;
+    int lease_blocks;
+    int cpu;
+    bool huge_pages;
+    int memory_limit_mib;
+    struct FieldRules fields;
+    int watch_interval;
+    int seen_within;
+    int older_than;
+    bool learn_ports;
+    bool learn_per_prefix;
+    int top_ports;
+    long max_probes;
+    int time_limit;
+};
+
+int parse_args(struct Config *config, int argc, char **argv);
+bool budget_exhausted(const struct Config *config, long probes, uint64_t elapsed_ms);
+
+#endif
@@ -0,0 +1,129 @@
+#include "content-hash.h"
+#include <string.h>
+
+// XXH64 primes
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int bits) {
+    return x << bits | x >> (64 - bits);
+}
+
+// Lanes are read little-endian, which is how every target the scanner runs on stores them
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t mix_lane(uint64_t lane, uint64_t input) {
+    lane += input * PRIME2;
+    return rotl64(lane, 31) * PRIME1;
+}
+
+static inline uint64_t merge_lane(uint64_t hash, uint64_t lane) {
+    hash ^= mix_lane(0, lane);
+    return hash * PRIME1 + PRIME4;
+}
+
+static void consume_stripe(uint64_t *lanes, const unsigned char *stripe) {
+    lanes[0] = mix_lane(lanes[0], read64(stripe));
+    lanes[1] = mix_lane(lanes[1], read64(stripe + 8));
+    lanes[2] = mix_lane(lanes[2], read64(stripe + 16));
+    lanes[3] = mix_lane(lanes[3], read64(stripe + 24));
+}
+
+void init_content_hash(struct ContentHash *hash) {
+    hash->lanes[0] = PRIME1 + PRIME2;
+    hash->lanes[1] = PRIME2;
+    hash->lanes[2] = 0;
+    hash->lanes[3] = -PRIME1;
+    hash->stripe_length = 0;
+    hash->total_length = 0;
+}
+
+void update_content_hash(struct ContentHash *hash, const void *data, size_t length) {
+
+    const unsigned char *pos = data;
+    const unsigned char *end = pos + length;
+    hash->total_length += length;
+
+    // Top up a stripe left over from the last call first
+    if(hash->stripe_length > 0) {
+        size_t wanted = CONTENT_HASH_STRIPE - hash->stripe_length;
+        if(length < wanted) {
+            memcpy(hash->stripe + hash->stripe_length, pos, length);
+            hash->stripe_length += length;
+            return;
+        }
+        memcpy(hash->stripe + hash->stripe_length, pos, wanted);
+        consume_stripe(hash->lanes, hash->stripe);
+        hash->stripe_length = 0;
+        pos += wanted;
+    }
+
+    while(end - pos >= CONTENT_HASH_STRIPE) {
+        consume_stripe(hash->lanes, pos);
+        pos += CONTENT_HASH_STRIPE;
+    }
+
+    memcpy(hash->stripe, pos, end - pos);
+    hash->stripe_length = end - pos;
+
+}
+
+uint64_t finish_content_hash(const struct ContentHash *hash) {
+
+    uint64_t result;
+    if(hash->total_length >= CONTENT_HASH_STRIPE) {
+        const uint64_t *lanes = hash->lanes;
+        result = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+        for(int i = 0; i < 4; i++) {
+            result = merge_lane(result, lanes[i]);
+        }
+    } else {
+        result = PRIME5;
+    }
+    result += hash->total_length;
+
+    // Fold in the tail that didn't fill a stripe
+    const unsigned char *pos = hash->stripe;
+    const unsigned char *end = pos + hash->stripe_length;
+    for(; end - pos >= 8; pos += 8) {
+        result ^= mix_lane(0, read64(pos));
+        result = rotl64(result, 27) * PRIME1 + PRIME4;
+    }
+    if(end - pos >= 4) {
+        result ^= read32(pos) * PRIME1;
+        result = rotl64(result, 23) * PRIME2 + PRIME3;
+        pos += 4;
+    }
+    for(; pos < end; pos++) {
+        result ^= *pos * PRIME5;
+        result = rotl64(result, 11) * PRIME1;
+    }
+
+    result ^= result >> 33;
+    result *= PRIME2;
+    result ^= result >> 29;
+    result *= PRIME3;
+    result ^= result >> 32;
+    return result;
+
+}
+
+uint64_t hash_content(const void *data, size_t length) {
+    struct ContentHash hash;
+    init_content_hash(&hash);
+    update_content_hash(&hash, data, length);
+    return finish_content_hash(&hash);
+}
@@ -0,0 +1,24 @@
+#ifndef __CONTENT_HASH_H
+#define __CONTENT_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// XXH64 consumes its input in stripes of four 64-bit lanes
+#define CONTENT_HASH_STRIPE 32
+
+/* Incremental XXH64 of a byte stream, for fingerprinting response fields such as favicons as they are read. The
+ * result is the same as hashing all of the bytes at once, however the stream was split up. */
+struct ContentHash {
+    uint64_t lanes[4];
+    unsigned char stripe[CONTENT_HASH_STRIPE];
+    int stripe_length;
+    uint64_t total_length;
+};
+
+void init_content_hash(struct ContentHash *hash);
+void update_content_hash(struct ContentHash *hash, const void *data, size_t length);
+uint64_t finish_content_hash(const struct ContentHash *hash);
+uint64_t hash_content(const void *data, size_t length);
+
+#endif
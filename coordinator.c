@@ -0,0 +1,671 @@
+#define _GNU_SOURCE
+#include "coordinator.h"
+#include "addr-gen.h"
+#include "timer-wheel.h"
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+// Maximum number of workers connected at once
+#define MAX_WORKERS 1024
+
+// Seconds between progress lines
+#define COORDINATOR_PROGRESS_INTERVAL_S 60
+
+// How long a write waits for another process that has the database locked, such as a scan run in the same directory
+#define COORDINATOR_BUSY_TIMEOUT_MS 10000
+
+enum BlockState {
+    BLOCK_FREE,
+    BLOCK_LEASED,
+    BLOCK_DONE
+};
+
+struct Block {
+    enum BlockState state;
+    uint64_t expires_ms;
+    struct Worker *holder;
+};
+
+// A server reported for a block whose lease hasn't completed yet
+struct PendingResult {
+    struct ServerRecord record;
+    char *response;
+};
+
+struct Worker {
+    int fd;
+    int id;
+    bool greeted;
+    char *buffer;
+    size_t length;
+    size_t capacity;
+    long block; // -1 when holding no lease
+    struct PendingResult *results;
+    int num_results;
+    int results_capacity;
+};
+
+/* Hands out the permutation of a full scan to workers as leased blocks of consecutive steps. A block counts as scanned
+ * only once its worker says it has finished every target in it; until then its results are held in memory, and they
+ * are written to the database in the same transaction that records the block as completed. A block whose worker
+ * disconnects or stops renewing the lease goes back to the pool with its results discarded, so every block's results
+ * are stored exactly once however often it was leased. */
+struct Coordinator {
+    const struct Config *config;
+    struct Database *db;
+    int listen_fd;
+    int epoll_fd;
+    char ports[LEASE_LINE_SIZE];
+    struct Block *blocks;
+    long num_blocks;
+    uint64_t block_steps;
+    uint64_t period;
+    long completed;
+    long next_free; // no block before this one is free
+    int num_workers;
+    int next_worker_id;
+    long servers;
+};
+
+int format_port_list(const uint16_t *ports, int num_ports, char *buf, size_t size) {
+    size_t length = 0;
+    for(int i = 0; i < num_ports; i++) {
+        int written = snprintf(buf + length, size - length, i == 0 ? "%d" : ",%d", ports[i]);
+        if(written < 0 || (size_t)written >= size - length) {
+            return 1;
+        }
+        length += written;
+    }
+    return 0;
+}
+
+static int exec_query(sqlite3 *db, const char *query) {
+    char *err_msg;
+    if(sqlite3_exec(db, query, NULL, NULL, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "coordinator database error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        return 1;
+    }
+    return 0;
+}
+
+/* Pick up the latest unfinished coordinated scan over the same ports and block count, or start a new one. A resumed
+ * scan keeps writing its original generation, so its results stay together in the servers table. */
+static int resume_scan(struct Coordinator *coord) {
+
+    sqlite3 *db = coord->db->db;
+    if(exec_query(db,
+        "CREATE TABLE IF NOT EXISTS coordinated_scans (generation INTEGER PRIMARY KEY, ports TEXT NOT NULL, blocks INTEGER NOT NULL, started INTEGER NOT NULL, finished INTEGER);"
+        "CREATE TABLE IF NOT EXISTS completed_blocks (generation INTEGER NOT NULL, block INTEGER NOT NULL, timestamp INTEGER NOT NULL, targets INTEGER NOT NULL, servers INTEGER NOT NULL, PRIMARY KEY (generation, block))")) {
+        return 1;
+    }
+
+    sqlite3_stmt *stmt;
+    if(sqlite3_prepare_v2(db, "SELECT generation FROM coordinated_scans WHERE finished IS NULL AND ports = ? AND blocks = ? ORDER BY generation DESC LIMIT 1", -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "failed to query coordinated scans: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+    sqlite3_bind_text(stmt, 1, coord->ports, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, coord->num_blocks);
+    bool resumed = sqlite3_step(stmt) == SQLITE_ROW;
+    if(resumed) {
+        coord->db->generation = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+
+    if(!resumed) {
+
+        // The new generation has to be past any earlier coordinated scan as well, even one that found nothing
+        if(sqlite3_prepare_v2(db, "SELECT COALESCE(MAX(generation), 0) + 1 FROM coordinated_scans", -1, &stmt, NULL) != SQLITE_OK || sqlite3_step(stmt) != SQLITE_ROW) {
+            fprintf(stderr, "failed to query coordinated scans: %s\n", sqlite3_errmsg(db));
+            sqlite3_finalize(stmt);
+            return 1;
+        }
+        if(sqlite3_column_int(stmt, 0) > coord->db->generation) {
+            coord->db->generation = sqlite3_column_int(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+
+        if(sqlite3_prepare_v2(db, "INSERT INTO coordinated_scans (generation, ports, blocks, started) VALUES (?, ?, ?, ?)", -1, &stmt, NULL) != SQLITE_OK) {
+            fprintf(stderr, "failed to record coordinated scan: %s\n", sqlite3_errmsg(db));
+            return 1;
+        }
+        sqlite3_bind_int(stmt, 1, coord->db->generation);
+        sqlite3_bind_text(stmt, 2, coord->ports, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 3, coord->num_blocks);
+        sqlite3_bind_int64(stmt, 4, time(NULL));
+        int result = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        if(result != SQLITE_DONE) {
+            fprintf(stderr, "failed to record coordinated scan: %s\n", sqlite3_errmsg(db));
+            return 1;
+        }
+        printf("starting coordinated scan generation %d: %ld blocks of %lu steps\n", coord->db->generation, coord->num_blocks, (unsigned long)coord->block_steps);
+        return 0;
+
+    }
+
+    if(sqlite3_prepare_v2(db, "SELECT block FROM completed_blocks WHERE generation = ?", -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "failed to query completed blocks: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+    sqlite3_bind_int(stmt, 1, coord->db->generation);
+    while(sqlite3_step(stmt) == SQLITE_ROW) {
+        long block = sqlite3_column_int64(stmt, 0);
+        if(block >= 0 && block < coord->num_blocks && coord->blocks[block].state != BLOCK_DONE) {
+            coord->blocks[block].state = BLOCK_DONE;
+            coord->completed++;
+        }
+    }
+    sqlite3_finalize(stmt);
+    printf("resuming coordinated scan generation %d: %ld of %ld blocks already completed\n", coord->db->generation, coord->completed, coord->num_blocks);
+    return 0;
+
+}
+
+// Undo the writes of a block that couldn't be stored, including the favicons it added
+static void rollback_block(struct Coordinator *coord) {
+    exec_query(coord->db->db, "ROLLBACK");
+    reload_favicon_store(&coord->db->favicons, coord->db->db);
+}
+
+// Store a completed block and its results in one transaction, so that a crash can't leave either without the other
+static int store_block(struct Coordinator *coord, struct Worker *worker, long targets) {
+
+    sqlite3 *db = coord->db->db;
+    if(exec_query(db, "BEGIN")) {
+        return 1;
+    }
+    for(int i = 0; i < worker->num_results; i++) {
+        if(insert_server(coord->db, &worker->results[i].record)) {
+            rollback_block(coord);
+            return 1;
+        }
+    }
+
+    sqlite3_stmt *stmt;
+    if(sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO completed_blocks (generation, block, timestamp, targets, servers) VALUES (?, ?, ?, ?, ?)", -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "failed to record completed block: %s\n", sqlite3_errmsg(db));
+        rollback_block(coord);
+        return 1;
+    }
+    sqlite3_bind_int(stmt, 1, coord->db->generation);
+    sqlite3_bind_int64(stmt, 2, worker->block);
+    sqlite3_bind_int64(stmt, 3, time(NULL));
+    sqlite3_bind_int64(stmt, 4, targets);
+    sqlite3_bind_int(stmt, 5, worker->num_results);
+    int result = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if(result != SQLITE_DONE) {
+        fprintf(stderr, "failed to record completed block: %s\n", sqlite3_errmsg(db));
+        rollback_block(coord);
+        return 1;
+    }
+
+    return exec_query(db, "COMMIT");
+
+}
+
+static void discard_results(struct Worker *worker) {
+    for(int i = 0; i < worker->num_results; i++) {
+        free(worker->results[i].response);
+    }
+    worker->num_results = 0;
+}
+
+static bool holds_block(const struct Worker *worker, long block) {
+    return block >= 0 && block == worker->block;
+}
+
+// Give up a worker's lease, putting the block back in the pool
+static void release_block(struct Coordinator *coord, struct Worker *worker) {
+    if(worker->block == -1) {
+        return;
+    }
+    struct Block *block = &coord->blocks[worker->block];
+    block->state = BLOCK_FREE;
+    block->holder = NULL;
+    if(worker->block < coord->next_free) {
+        coord->next_free = worker->block;
+    }
+    worker->block = -1;
+    discard_results(worker);
+}
+
+static bool send_line(struct Worker *worker, const char *line) {
+    size_t length = strlen(line);
+    return send(worker->fd, line, length, MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t)length;
+}
+
+static void drop_worker(struct Coordinator *coord, struct Worker *worker) {
+    if(worker->block != -1) {
+        printf("worker %d disconnected; block %ld goes back to the pool\n", worker->id, worker->block);
+        release_block(coord, worker);
+    }
+    close(worker->fd);
+    free(worker->results);
+    free(worker->buffer);
+    free(worker);
+    coord->num_workers--;
+}
+
+static void handle_lease(struct Coordinator *coord, struct Worker *worker, uint64_t now) {
+
+    release_block(coord, worker);
+
+    while(coord->next_free < coord->num_blocks && coord->blocks[coord->next_free].state != BLOCK_FREE) {
+        coord->next_free++;
+    }
+
+    char reply[LEASE_LINE_SIZE];
+    if(coord->next_free < coord->num_blocks) {
+        long block = coord->next_free++;
+        uint64_t first = block * coord->block_steps;
+        uint64_t steps = first + coord->block_steps > coord->period ? coord->period - first : coord->block_steps;
+        coord->blocks[block].state = BLOCK_LEASED;
+        coord->blocks[block].holder = worker;
+        coord->blocks[block].expires_ms = now + (uint64_t)coord->config->lease_time * 1000;
+        worker->block = block;
+        snprintf(reply, sizeof(reply), "BLOCK %ld %lu %lu\n", block, (unsigned long)first, (unsigned long)steps);
+        printf("block %ld leased to worker %d\n", block, worker->id);
+    } else if(coord->completed < coord->num_blocks) {
+        snprintf(reply, sizeof(reply), "WAIT %d\n", LEASE_POLL_S);
+    } else {
+        snprintf(reply, sizeof(reply), "DONE\n");
+    }
+    send_line(worker, reply);
+
+}
+
+// Hold on to a reported server until its block completes. Returns false if the message is malformed.
+static bool handle_result(struct Coordinator *coord, struct Worker *worker, long block, const char *fields, const char *payload, int length, uint64_t now) {
+
+    char addr_str[MAX_ADDRESS_LENGTH], edition[16], favicon[17];
+    int port, rtt_ms, favicon_length;
+    struct in6_addr addr;
+    if(sscanf(fields, "%45s %d %15s %d %16s %d", addr_str, &port, edition, &rtt_ms, favicon, &favicon_length) != 6 || !parse_address(addr_str, &addr) || port < 1 || port > 65535 || favicon_length < 0 || favicon_length > length) {
+        return false;
+    }
+    unsigned long long favicon_hash = 0;
+    bool has_favicon = strcmp(favicon, "-") != 0;
+    if(has_favicon && sscanf(favicon, "%16llx", &favicon_hash) != 1) {
+        return false;
+    }
+
+    // Results for a block the worker no longer holds belong to a lease that has been given to someone else
+    if(!holds_block(worker, block)) {
+        return true;
+    }
+    coord->blocks[block].expires_ms = now + (uint64_t)coord->config->lease_time * 1000;
+
+    if(worker->num_results == worker->results_capacity) {
+        int capacity = worker->results_capacity == 0 ? 64 : worker->results_capacity * 2;
+        struct PendingResult *grown = realloc(worker->results, capacity * sizeof(struct PendingResult));
+        if(grown == NULL) {
+            fprintf(stderr, "failed to allocate results of block %ld\n", block);
+            return false;
+        }
+        worker->results = grown;
+        worker->results_capacity = capacity;
+    }
+
+    struct PendingResult *result = &worker->results[worker->num_results];
+    result->response = malloc(length > 0 ? length : 1);
+    if(result->response == NULL) {
+        fprintf(stderr, "failed to allocate results of block %ld\n", block);
+        return false;
+    }
+    memcpy(result->response, payload, length);
+    result->record.addr = addr;
+    result->record.port = port;
+    result->record.edition = strcmp(edition, "legacy") == 0 ? "legacy" : "java";
+    result->record.response = result->response;
+    result->record.response_length = length - favicon_length;
+    result->record.rtt_ms = rtt_ms;
+    result->record.has_favicon = has_favicon;
+    result->record.favicon_hash = favicon_hash;
+    result->record.favicon = favicon_length > 0 ? result->response + length - favicon_length : NULL;
+    result->record.favicon_length = favicon_length;
+    worker->num_results++;
+    return true;
+
+}
+
+static void handle_complete(struct Coordinator *coord, struct Worker *worker, long block, long targets) {
+
+    if(!holds_block(worker, block)) {
+        send_line(worker, "LOST\n");
+        return;
+    }
+
+    // If the results can't be stored, the block is leased again later rather than lost
+    if(store_block(coord, worker, targets)) {
+        release_block(coord, worker);
+        send_line(worker, "LOST\n");
+        return;
+    }
+
+    coord->blocks[block].state = BLOCK_DONE;
+    coord->blocks[block].holder = NULL;
+    coord->completed++;
+    coord->servers += worker->num_results;
+    printf("block %ld completed by worker %d: %ld targets, %d servers; %ld of %ld blocks done\n", block, worker->id, targets, worker->num_results, coord->completed, coord->num_blocks);
+    fflush(stdout);
+    discard_results(worker);
+    worker->block = -1;
+    send_line(worker, "OK\n");
+
+}
+
+/* Handle every complete message in a worker's buffer. Returns false if the worker broke the protocol and has to be
+ * disconnected. */
+static bool handle_messages(struct Coordinator *coord, struct Worker *worker) {
+
+    size_t pos = 0;
+    uint64_t now = monotonic_ms();
+    while(pos < worker->length) {
+
+        char *line = worker->buffer + pos;
+        char *newline = memchr(line, '\n', worker->length - pos);
+        if(newline == NULL) {
+            if(worker->length - pos >= LEASE_LINE_SIZE) {
+                return false;
+            }
+            break;
+        }
+        *newline = '\0';
+        size_t consumed = newline + 1 - line;
+
+        char command[16];
+        int offset = 0;
+        if(sscanf(line, "%15s %n", command, &offset) != 1) {
+            return false;
+        }
+        const char *args = line + offset;
+
+        if(strcmp(command, "HELLO") == 0) {
+            if(strcmp(args, coord->ports) != 0) {
+                send_line(worker, "ERROR target ports differ from the coordinator's\n");
+                return false;
+            }
+            worker->greeted = true;
+            char reply[LEASE_LINE_SIZE];
+            snprintf(reply, sizeof(reply), "OK %d\n", coord->config->lease_time);
+            send_line(worker, reply);
+        } else if(!worker->greeted) {
+            return false;
+        } else if(strcmp(command, "LEASE") == 0) {
+            handle_lease(coord, worker, now);
+        } else if(strcmp(command, "RENEW") == 0) {
+            long block;
+            if(sscanf(args, "%ld", &block) != 1) {
+                return false;
+            }
+            if(holds_block(worker, block)) {
+                coord->blocks[block].expires_ms = now + (uint64_t)coord->config->lease_time * 1000;
+                send_line(worker, "OK\n");
+            } else {
+                send_line(worker, "LOST\n");
+            }
+        } else if(strcmp(command, "RESULT") == 0) {
+
+            // The response follows the line; wait until all of it has arrived
+            long block;
+            int length, fields_offset;
+            const char *last_space = strrchr(args, ' ');
+            if(sscanf(args, "%ld %n", &block, &fields_offset) != 1 || last_space == NULL || sscanf(last_space, "%d", &length) != 1 || length < 0 || length > LEASE_MAX_RESULT_SIZE) {
+                return false;
+            }
+            if(worker->length - pos - consumed < (size_t)length) {
+                *newline = '\n';
+                break;
+            }
+            if(!handle_result(coord, worker, block, args + fields_offset, newline + 1, length, now)) {
+                return false;
+            }
+            consumed += length;
+
+        } else if(strcmp(command, "COMPLETE") == 0) {
+            long block, targets;
+            if(sscanf(args, "%ld %ld", &block, &targets) != 2) {
+                return false;
+            }
+            handle_complete(coord, worker, block, targets);
+        } else {
+            return false;
+        }
+
+        pos += consumed;
+
+    }
+
+    memmove(worker->buffer, worker->buffer + pos, worker->length - pos);
+    worker->length -= pos;
+    return true;
+
+}
+
+// Read whatever a worker has sent. Returns false once the worker is gone or has to be dropped.
+static bool read_worker(struct Coordinator *coord, struct Worker *worker) {
+
+    while(true) {
+
+        if(worker->length == worker->capacity) {
+            size_t capacity = worker->capacity * 2;
+            if(capacity > LEASE_MAX_RESULT_SIZE + LEASE_LINE_SIZE * 2) {
+                return false;
+            }
+            char *grown = realloc(worker->buffer, capacity);
+            if(grown == NULL) {
+                return false;
+            }
+            worker->buffer = grown;
+            worker->capacity = capacity;
+        }
+
+        ssize_t bytes_read = read(worker->fd, worker->buffer + worker->length, worker->capacity - worker->length);
+        if(bytes_read == 0) {
+            return false;
+        }
+        if(bytes_read == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        worker->length += bytes_read;
+        if(!handle_messages(coord, worker)) {
+            return false;
+        }
+
+    }
+
+}
+
+static void accept_workers(struct Coordinator *coord) {
+
+    int fd;
+    while((fd = accept4(coord->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+
+        struct Worker *worker = calloc(1, sizeof(struct Worker));
+        if(coord->num_workers >= MAX_WORKERS || worker == NULL || (worker->buffer = malloc(LEASE_LINE_SIZE * 4)) == NULL) {
+            fprintf(stderr, "turning away a worker: too many connected\n");
+            free(worker);
+            close(fd);
+            continue;
+        }
+        worker->fd = fd;
+        worker->id = ++coord->next_worker_id;
+        worker->capacity = LEASE_LINE_SIZE * 4;
+        worker->block = -1;
+
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = worker};
+        if(epoll_ctl(coord->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            perror("epoll_ctl");
+            free(worker->buffer);
+            free(worker);
+            close(fd);
+            continue;
+        }
+        coord->num_workers++;
+        printf("worker %d connected\n", worker->id);
+
+    }
+
+    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("accept4");
+    }
+
+}
+
+/* Listen on a Unix socket. A socket file left behind by a coordinator that is no longer running is replaced, but one
+ * that still accepts connections is not. */
+static int listen_unix(const char *path) {
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+
+        bool stale = false;
+        if(errno == EADDRINUSE) {
+            int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+            stale = probe != -1 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == -1 && errno == ECONNREFUSED;
+            if(probe != -1) {
+                close(probe);
+            }
+            if(!stale) {
+                fprintf(stderr, "another coordinator is already listening on %s\n", path);
+                close(fd);
+                return -1;
+            }
+        }
+
+        if(!stale || unlink(path) == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            fprintf(stderr, "failed to bind %s: %s\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+
+    }
+
+    if(listen(fd, SOMAXCONN) == -1) {
+        perror("listen");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
+
+}
+
+// Put blocks whose lease ran out back in the pool; a worker that still holds one learns about it on its next message
+static void expire_leases(struct Coordinator *coord, uint64_t now) {
+    for(long i = 0; i < coord->num_blocks; i++) {
+        if(coord->blocks[i].state == BLOCK_LEASED && coord->blocks[i].expires_ms <= now) {
+            printf("lease on block %ld held by worker %d expired\n", i, coord->blocks[i].holder->id);
+            release_block(coord, coord->blocks[i].holder);
+        }
+    }
+}
+
+int run_coordinator(const struct Config *config, struct Database *db) {
+
+    struct Coordinator coord = {.config = config, .db = db, .num_blocks = config->lease_blocks};
+    if(format_port_list(config->ports, config->num_ports, coord.ports, sizeof(coord.ports))) {
+        fprintf(stderr, "too many target ports for a coordinated scan\n");
+        return 1;
+    }
+
+    sqlite3_busy_timeout(db->db, COORDINATOR_BUSY_TIMEOUT_MS);
+
+    // Split the same permutation that a single full scan walks through
+    struct AddressGenerator addr_gen;
+    init_addrgen(&addr_gen, NULL, config->ports, config->num_ports);
+    coord.period = addr_gen.mask + 1;
+    coord.block_steps = (coord.period + coord.num_blocks - 1) / coord.num_blocks;
+
+    coord.blocks = calloc(coord.num_blocks, sizeof(struct Block));
+    if(coord.blocks == NULL) {
+        fprintf(stderr, "failed to allocate blocks\n");
+        return 1;
+    }
+    if(resume_scan(&coord)) {
+        free(coord.blocks);
+        return 1;
+    }
+
+    coord.listen_fd = listen_unix(config->coordinator_path);
+    coord.epoll_fd = epoll_create1(0);
+    if(coord.listen_fd == -1 || coord.epoll_fd == -1) {
+        free(coord.blocks);
+        return 1;
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(coord.epoll_fd, EPOLL_CTL_ADD, coord.listen_fd, &event);
+    printf("waiting for workers on %s\n", config->coordinator_path);
+    fflush(stdout);
+
+    // Keep serving until every block is done and every worker has been told so
+    struct epoll_event events[64];
+    time_t last_progress_time = time(NULL);
+    while(coord.completed < coord.num_blocks || coord.num_workers > 0) {
+
+        int num_events = epoll_wait(coord.epoll_fd, events, 64, 1000);
+        if(num_events == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+
+        for(int i = 0; i < num_events; i++) {
+            struct Worker *worker = events[i].data.ptr;
+            if(worker == NULL) {
+                accept_workers(&coord);
+            } else if(!read_worker(&coord, worker)) {
+                drop_worker(&coord, worker);
+            }
+        }
+
+        expire_leases(&coord, monotonic_ms());
+
+        if(time(NULL) - last_progress_time >= COORDINATOR_PROGRESS_INTERVAL_S) {
+            last_progress_time = time(NULL);
+            printf("progress: %ld of %ld blocks done, %d workers, %ld servers stored\n", coord.completed, coord.num_blocks, coord.num_workers, coord.servers);
+            fflush(stdout);
+        }
+
+    }
+
+    bool finished = coord.completed == coord.num_blocks;
+    if(finished) {
+        char query[128];
+        snprintf(query, sizeof(query), "UPDATE coordinated_scans SET finished = %ld WHERE generation = %d", (long)time(NULL), db->generation);
+        exec_query(db->db, query);
+        printf("coordinated scan finished; servers stored: %ld\n", coord.servers);
+        print_favicon_store(&db->favicons);
+    }
+
+    close(coord.listen_fd);
+    unlink(config->coordinator_path);
+    close(coord.epoll_fd);
+    free(coord.blocks);
+    return finished ? 0 : 1;
+
+}
@@ -0,0 +1,32 @@
+#ifndef __COORDINATOR_H
+#define __COORDINATOR_H
+
+#include "config.h"
+#include "db.h"
+
+/* Protocol between a coordinator and its workers over a Unix stream socket. Every message is one line; a RESULT line
+ * is followed by the raw response bytes and then the favicon, if the worker kept it. The worker speaks first and waits for the answer to each request:
+ *
+ *   HELLO <ports>                 -> OK <lease seconds> | ERROR <reason>
+ *   LEASE                         -> BLOCK <id> <first step> <steps> | WAIT <seconds> | DONE
+ *   RENEW <id>                    -> OK | LOST
+ *   RESULT <id> <address> <port> <edition> <rtt or -1> <favicon hash or -> <favicon length> <length>   (no answer)
+ *   COMPLETE <id> <targets>       -> OK | LOST
+ *
+ * <ports> is the comma-separated target port list, which has to match the coordinator's so that both agree on the
+ * permutation. The favicon hash is 16 hex digits, and <length> covers both the
+ * response and the favicon. A worker that got LOST no longer holds the block, and its results for it are dropped. */
+
+// Longest protocol line, excluding the payload of a RESULT
+#define LEASE_LINE_SIZE 256
+
+// Largest response accepted in a RESULT
+#define LEASE_MAX_RESULT_SIZE (1 << 20)
+
+// Seconds a worker is told to wait before asking again when every remaining block is leased
+#define LEASE_POLL_S 5
+
+int format_port_list(const uint16_t *ports, int num_ports, char *buf, size_t size);
+int run_coordinator(const struct Config *config, struct Database *db);
+
+#endif
@@ -0,0 +1,108 @@
+#define _GNU_SOURCE
+#include "cpu-locality.h"
+#include <sys/socket.h>
+#include <dirent.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+// Find the NUMA node of a CPU from the nodeN link in its sysfs directory; -1 on kernels without NUMA support
+static int node_of_cpu(int cpu) {
+
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if(dir == NULL) {
+        return -1;
+    }
+
+    int node = -1;
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL) {
+        if(sscanf(entry->d_name, "node%d", &node) == 1) {
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+
+}
+
+/* Bind the scanner to one CPU. This has to happen before the large tables are allocated: the kernel places pages on
+ * the node of the CPU that first touches them, so everything the event loop allocates afterwards is node-local. */
+int pin_to_cpu(struct CpuLocality *locality, int cpu) {
+
+    memset(locality, 0, sizeof(*locality));
+    locality->cpu = -1;
+    if(cpu < 0) {
+        return 0;
+    }
+    if(cpu >= MAX_CPUS) {
+        fprintf(stderr, "CPU %d is out of range\n", cpu);
+        return 1;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(sched_setaffinity(0, sizeof(set), &set) == -1) {
+        fprintf(stderr, "failed to pin to CPU %d: ", cpu);
+        perror(NULL);
+        return 1;
+    }
+
+    locality->nodes = malloc(MAX_CPUS * sizeof(short));
+    if(locality->nodes == NULL) {
+        fprintf(stderr, "failed to allocate CPU node map\n");
+        return 1;
+    }
+    for(int i = 0; i < MAX_CPUS; i++) {
+        locality->nodes[i] = node_of_cpu(i);
+    }
+
+    locality->cpu = cpu;
+    locality->node = locality->nodes[cpu];
+    printf("pinned to CPU %d (NUMA node %d)\n", cpu, locality->node);
+    return 0;
+
+}
+
+// Classify where a connection's packets are being received, once its handshake has completed
+void record_incoming_cpu(struct CpuLocality *locality, int socket_fd) {
+
+    if(locality->cpu == -1) {
+        return;
+    }
+
+    int cpu = -1;
+    socklen_t length = sizeof(cpu);
+    if(getsockopt(socket_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) == -1 || cpu < 0 || cpu >= MAX_CPUS) {
+        return;
+    }
+    if(cpu == locality->cpu) {
+        locality->same_cpu++;
+    } else if(locality->nodes[cpu] == locality->node) {
+        locality->same_node++;
+    } else {
+        locality->remote_node++;
+    }
+
+}
+
+void print_cpu_locality(const struct CpuLocality *locality) {
+    if(locality->cpu == -1) {
+        return;
+    }
+    long total = locality->same_cpu + locality->same_node + locality->remote_node;
+    printf("receive locality on CPU %d: %ld connections received on this CPU, %ld on another CPU of node %d, %ld on another node",
+        locality->cpu, locality->same_cpu, locality->same_node, locality->node, locality->remote_node);
+    if(total > 0) {
+        printf(" (%.1f%% cross-node)", 100.0 * locality->remote_node / total);
+    }
+    printf("\n");
+}
+
+void free_cpu_locality(struct CpuLocality *locality) {
+    free(locality->nodes);
+}
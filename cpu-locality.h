@@ -0,0 +1,26 @@
+#ifndef __CPU_LOCALITY_H
+#define __CPU_LOCALITY_H
+
+#include <stdbool.h>
+
+// Highest CPU number looked up in the CPU to NUMA node map
+#define MAX_CPUS 1024
+
+/* Where the packets of connections were received, relative to the CPU the scanner is pinned to. The kernel records the
+ * CPU that processed a socket's most recent packet, which is where the NIC's receive queue for that flow raises its
+ * interrupts (or where RPS/RFS moved the work to). */
+struct CpuLocality {
+    int cpu;  // -1 when the scanner isn't pinned
+    int node;
+    short *nodes; // NUMA node of each CPU, -1 if unknown
+    long same_cpu;
+    long same_node;
+    long remote_node;
+};
+
+int pin_to_cpu(struct CpuLocality *locality, int cpu);
+void record_incoming_cpu(struct CpuLocality *locality, int socket_fd);
+void print_cpu_locality(const struct CpuLocality *locality);
+void free_cpu_locality(struct CpuLocality *locality);
+
+#endif
@@ -0,0 +1,193 @@
+#include "db.h"
+#include <stdio.h>
+#include <time.h>
+
+// Add a column to the servers table if it is missing, so that databases from older versions keep working
+static int ensure_column(sqlite3 *db, const char *name, const char *definition) {
+
+    sqlite3_stmt *stmt;
+    if(sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_table_info('servers') WHERE name = ?", -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "failed to inspect table: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    int exists = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+    if(exists) {
+        return 0;
+    }
+
+    char query[256];
+    snprintf(query, sizeof(query), "ALTER TABLE servers ADD COLUMN %s %s", name, definition);
+    char *err_msg;
+    if(sqlite3_exec(db, query, NULL, NULL, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "failed to add column %s: %s\n", name, err_msg);
+        sqlite3_free(err_msg);
+        return 1;
+    }
+
+    return 0;
+
+}
+
+int setup_db(struct Database *db) {
+    
+    // set up sqlite3 database
+    int result = sqlite3_open("scan.db", &db->db);
+    if(result != SQLITE_OK) {
+        fprintf(stderr, "failed to open database: %s\n", sqlite3_errstr(result));
+        sqlite3_close(db->db);
+        return 1;
+    }
+
+    // create table
+    const char *create_table_query = "CREATE TABLE IF NOT EXISTS servers (address TEXT NOT NULL, timestamp INTEGER NOT NULL, response TEXT NOT NULL)";
+    char *err_msg;
+    result = sqlite3_exec(db->db, create_table_query, NULL, NULL, &err_msg);
+    if(result != SQLITE_OK) {
+        fprintf(stderr, "failed to create table: %s\n", err_msg);
+        sqlite3_close(db->db);
+        return 1;
+    }
+
+    if(ensure_column(db->db, "edition", "TEXT NOT NULL DEFAULT 'java'") || ensure_column(db->db, "rtt", "INTEGER") || ensure_column(db->db, "port", "INTEGER NOT NULL DEFAULT 25565") || ensure_column(db->db, "generation", "INTEGER NOT NULL DEFAULT 0") || ensure_column(db->db, "favicon_hash", "INTEGER") || ensure_column(db->db, "favicon", "INTEGER REFERENCES favicons (id)")) {
+        sqlite3_close(db->db);
+        return 1;
+    }
+
+    // Each run writes a new generation, so that a rescan can be told apart from the results it started from
+    sqlite3_stmt *stmt;
+    if(sqlite3_prepare_v2(db->db, "SELECT COALESCE(MAX(generation), 0) + 1 FROM servers", -1, &stmt, NULL) != SQLITE_OK || sqlite3_step(stmt) != SQLITE_ROW) {
+        fprintf(stderr, "failed to read scan generation: %s\n", sqlite3_errmsg(db->db));
+        sqlite3_finalize(stmt);
+        sqlite3_close(db->db);
+        return 1;
+    }
+    db->generation = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    // Watched servers get one small row per probe instead of a copy of the whole response. To keep rows compact, IPv4
+    // addresses are stored as integers in host byte order and IPv6 addresses as 16-byte blobs.
+    const char *create_samples_query =
+        "CREATE TABLE IF NOT EXISTS samples (address INTEGER NOT NULL, port INTEGER NOT NULL, timestamp INTEGER NOT NULL, online INTEGER, max INTEGER, rtt INTEGER);"
+        "CREATE INDEX IF NOT EXISTS samples_server ON samples (address, port, timestamp)";
+    result = sqlite3_exec(db->db, create_samples_query, NULL, NULL, &err_msg);
+    if(result != SQLITE_OK) {
+        fprintf(stderr, "failed to create table: %s\n", err_msg);
+        sqlite3_close(db->db);
+        return 1;
+    }
+
+    if(open_favicon_store(&db->favicons, db->db)) {
+        sqlite3_close(db->db);
+        return 1;
+    }
+
+    // prepare insert statement
+    const char *insert_query = "INSERT INTO servers (address, timestamp, response, edition, rtt, port, generation, favicon_hash, favicon) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)";
+    result = sqlite3_prepare_v2(db->db, insert_query, -1, &db->insert_stmt, NULL);
+    if(result != SQLITE_OK) {
+        fprintf(stderr, "failed to prepare statement: %s\n", sqlite3_errmsg(db->db));
+        close_favicon_store(&db->favicons);
+        sqlite3_close(db->db);
+        return 1;
+    }
+
+    const char *sample_query = "INSERT INTO samples (address, port, timestamp, online, max, rtt) VALUES (?, ?, ?, ?, ?, ?)";
+    result = sqlite3_prepare_v2(db->db, sample_query, -1, &db->sample_stmt, NULL);
+    if(result != SQLITE_OK) {
+        fprintf(stderr, "failed to prepare statement: %s\n", sqlite3_errmsg(db->db));
+        sqlite3_finalize(db->insert_stmt);
+        close_favicon_store(&db->favicons);
+        sqlite3_close(db->db);
+        return 1;
+    }
+
+    return 0;
+    
+}
+
+int insert_server(struct Database *db, const struct ServerRecord *record) {
+
+    char addr_str[MAX_ADDRESS_LENGTH];
+    format_address(&record->addr, addr_str);
+
+    // FIXME: Check bind calls for errors
+    sqlite3_stmt *stmt = db->insert_stmt;
+    sqlite3_bind_text(stmt, 1, addr_str,  -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt, 2, time(NULL));
+    sqlite3_bind_text(stmt, 3, record->response, record->response_length, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 4, record->edition, -1, SQLITE_STATIC);
+    if(record->rtt_ms >= 0) {
+        sqlite3_bind_int(stmt, 5, record->rtt_ms);
+    } else {
+        sqlite3_bind_null(stmt, 5);
+    }
+    sqlite3_bind_int(stmt, 6, record->port);
+    sqlite3_bind_int(stmt, 7, db->generation);
+
+    // The hash is stored as sqlite's signed 64-bit integer, so it can be compared but not ordered. Favicons that are
+    // already stored, or that came with the response, are referenced by id.
+    sqlite3_int64 favicon = 0;
+    if(record->has_favicon) {
+        sqlite3_bind_int64(stmt, 8, (sqlite3_int64)record->favicon_hash);
+        favicon = find_favicon(&db->favicons, record->favicon_hash, record->favicon, record->favicon_length);
+    } else {
+        sqlite3_bind_null(stmt, 8);
+    }
+    if(favicon != 0) {
+        sqlite3_bind_int64(stmt, 9, favicon);
+    } else {
+        sqlite3_bind_null(stmt, 9);
+    }
+    int result = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if(result != SQLITE_DONE) {
+        fprintf(stderr, "failed to insert result for %s:%d: %s\n", addr_str, record->port, sqlite3_errstr(result));
+        return 1;
+    }
+
+    return 0;
+
+}
+
+// Bind an integer, or NULL for negative values
+static void bind_optional(sqlite3_stmt *stmt, int index, int value) {
+    if(value >= 0) {
+        sqlite3_bind_int(stmt, index, value);
+    } else {
+        sqlite3_bind_null(stmt, index);
+    }
+}
+
+int insert_sample(struct Database *db, const struct WatchSample *sample) {
+
+    sqlite3_stmt *stmt = db->sample_stmt;
+    if(is_ipv4(&sample->addr)) {
+        sqlite3_bind_int64(stmt, 1, ntohl(ipv4_of(&sample->addr)));
+    } else {
+        sqlite3_bind_blob(stmt, 1, sample->addr.s6_addr, 16, SQLITE_TRANSIENT);
+    }
+    sqlite3_bind_int(stmt, 2, sample->port);
+    sqlite3_bind_int64(stmt, 3, time(NULL));
+    bind_optional(stmt, 4, sample->online);
+    bind_optional(stmt, 5, sample->max_players);
+    bind_optional(stmt, 6, sample->rtt_ms);
+    int result = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if(result != SQLITE_DONE) {
+        fprintf(stderr, "failed to insert sample: %s\n", sqlite3_errstr(result));
+        return 1;
+    }
+
+    return 0;
+
+}
+
+void close_db(struct Database *db) {
+    sqlite3_finalize(db->insert_stmt);
+    sqlite3_finalize(db->sample_stmt);
+    close_favicon_store(&db->favicons);
+    sqlite3_close(db->db);
+}
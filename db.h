@@ -0,0 +1,46 @@
+#ifndef __DB_H
+#define __DB_H
+
+#include "sqlite/sqlite3.h"
+#include "address.h"
+#include "favicon-store.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+struct Database {
+    sqlite3 *db;
+    sqlite3_stmt *insert_stmt;
+    sqlite3_stmt *sample_stmt;
+    struct FaviconStore favicons;
+    int generation; // stored with every row written by this run
+};
+
+// A single server response to be stored
+struct ServerRecord {
+    struct in6_addr addr;
+    uint16_t port;
+    const char *edition;
+    const char *response;
+    int response_length;
+    int rtt_ms; // application-level ping RTT, or -1 if not measured
+    bool has_favicon;
+    uint64_t favicon_hash; // XXH64 of the favicon string, which is never part of the response
+    const char *favicon; // contents of the favicon string, or NULL if it wasn't kept
+    int favicon_length;
+};
+
+// One observation of a watched server; counts are -1 when unknown, and every field is -1 if the probe failed
+struct WatchSample {
+    struct in6_addr addr;
+    uint16_t port;
+    int online;
+    int max_players;
+    int rtt_ms;
+};
+
+int setup_db(struct Database *db);
+int insert_server(struct Database *db, const struct ServerRecord *record);
+int insert_sample(struct Database *db, const struct WatchSample *sample);
+void close_db(struct Database *db);
+
+#endif
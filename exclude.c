@@ -0,0 +1,462 @@
+#define _GNU_SOURCE
+#include "exclude.h"
+#include "address.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+
+// Set from the SIGHUP handler, acted on by the event loop through poll_exclude_reload()
+static volatile sig_atomic_t reload_requested = 0;
+static struct ExcludeList *reload_target = NULL;
+
+// Split a 128-bit address into host-order (high, low) halves
+static void split_address6(const struct in6_addr *addr, uint64_t *hi, uint64_t *lo) {
+    *hi = 0;
+    *lo = 0;
+    for(int i = 0; i < 8; i++) {
+        *hi = *hi << 8 | addr->s6_addr[i];
+        *lo = *lo << 8 | addr->s6_addr[i + 8];
+    }
+}
+
+// Ranges collected while parsing a text list
+struct RangeBuilder {
+    struct ExcludeRange4 *ranges4;
+    uint32_t num_ranges4;
+    uint32_t capacity4;
+    struct ExcludeRange6 *ranges6;
+    uint32_t num_ranges6;
+    uint32_t capacity6;
+};
+
+static int add_range4(struct RangeBuilder *builder, uint32_t first, uint32_t last) {
+    if(builder->num_ranges4 == builder->capacity4) {
+        uint32_t capacity = builder->capacity4 == 0 ? 64 : builder->capacity4 * 2;
+        struct ExcludeRange4 *grown = realloc(builder->ranges4, capacity * sizeof(struct ExcludeRange4));
+        if(grown == NULL) {
+            return 1;
+        }
+        builder->ranges4 = grown;
+        builder->capacity4 = capacity;
+    }
+    builder->ranges4[builder->num_ranges4++] = (struct ExcludeRange4){first, last};
+    return 0;
+}
+
+static int add_range6(struct RangeBuilder *builder, const struct ExcludeRange6 *range) {
+    if(builder->num_ranges6 == builder->capacity6) {
+        uint32_t capacity = builder->capacity6 == 0 ? 16 : builder->capacity6 * 2;
+        struct ExcludeRange6 *grown = realloc(builder->ranges6, capacity * sizeof(struct ExcludeRange6));
+        if(grown == NULL) {
+            return 1;
+        }
+        builder->ranges6 = grown;
+        builder->capacity6 = capacity;
+    }
+    builder->ranges6[builder->num_ranges6++] = *range;
+    return 0;
+}
+
+static int compare_ranges4(const void *a, const void *b) {
+    const struct ExcludeRange4 *ra = a, *rb = b;
+    return ra->first < rb->first ? -1 : ra->first > rb->first;
+}
+
+static bool before6(uint64_t hi_a, uint64_t lo_a, uint64_t hi_b, uint64_t lo_b) {
+    return hi_a < hi_b || (hi_a == hi_b && lo_a < lo_b);
+}
+
+static int compare_ranges6(const void *a, const void *b) {
+    const struct ExcludeRange6 *ra = a, *rb = b;
+    if(before6(ra->first_hi, ra->first_lo, rb->first_hi, rb->first_lo)) {
+        return -1;
+    }
+    return before6(rb->first_hi, rb->first_lo, ra->first_hi, ra->first_lo);
+}
+
+// Sort the ranges and merge overlapping or adjacent ones, so that lookups can binary search
+static void merge_ranges(struct RangeBuilder *builder) {
+
+    qsort(builder->ranges4, builder->num_ranges4, sizeof(struct ExcludeRange4), compare_ranges4);
+    uint32_t merged = 0;
+    for(uint32_t i = 0; i < builder->num_ranges4; i++) {
+        struct ExcludeRange4 range = builder->ranges4[i];
+        struct ExcludeRange4 *last = merged > 0 ? &builder->ranges4[merged - 1] : NULL;
+        if(last != NULL && (last->last == UINT32_MAX || range.first <= last->last + 1)) {
+            if(range.last > last->last) {
+                last->last = range.last;
+            }
+            continue;
+        }
+        builder->ranges4[merged++] = range;
+    }
+    builder->num_ranges4 = merged;
+
+    qsort(builder->ranges6, builder->num_ranges6, sizeof(struct ExcludeRange6), compare_ranges6);
+    merged = 0;
+    for(uint32_t i = 0; i < builder->num_ranges6; i++) {
+        struct ExcludeRange6 range = builder->ranges6[i];
+        struct ExcludeRange6 *last = merged > 0 ? &builder->ranges6[merged - 1] : NULL;
+        if(last != NULL) {
+            uint64_t next_lo = last->last_lo + 1;
+            uint64_t next_hi = last->last_hi + (next_lo == 0);
+            bool at_end = last->last_hi == UINT64_MAX && last->last_lo == UINT64_MAX;
+            if(at_end || !before6(next_hi, next_lo, range.first_hi, range.first_lo)) {
+                if(before6(last->last_hi, last->last_lo, range.last_hi, range.last_lo)) {
+                    last->last_hi = range.last_hi;
+                    last->last_lo = range.last_lo;
+                }
+                continue;
+            }
+        }
+        builder->ranges6[merged++] = range;
+    }
+    builder->num_ranges6 = merged;
+
+}
+
+// Parse one "addr/len" (or bare address) line of a text list; returns 1 if it is invalid and -1 if allocation failed
+static int parse_subnet(struct RangeBuilder *builder, char *line) {
+
+    int prefix_len = -1;
+    char *slash = strchr(line, '/');
+    if(slash != NULL) {
+        char *end;
+        prefix_len = strtol(slash + 1, &end, 10);
+        if(end == slash + 1 || *end != '\0') {
+            return 1;
+        }
+        *slash = '\0';
+    }
+
+    struct in6_addr addr;
+    if(!parse_address(line, &addr)) {
+        return 1;
+    }
+
+    if(is_ipv4(&addr)) {
+        if(prefix_len == -1) {
+            prefix_len = 32;
+        }
+        if(prefix_len < 0 || prefix_len > 32) {
+            return 1;
+        }
+        uint32_t host_mask = prefix_len == 0 ? UINT32_MAX : ((uint32_t)1 << (32 - prefix_len)) - 1;
+        uint32_t first = ntohl(ipv4_of(&addr)) & ~host_mask;
+        return add_range4(builder, first, first | host_mask) ? -1 : 0;
+    }
+
+    if(prefix_len == -1) {
+        prefix_len = 128;
+    }
+    if(prefix_len < 0 || prefix_len > 128) {
+        return 1;
+    }
+    uint64_t hi, lo;
+    split_address6(&addr, &hi, &lo);
+    uint64_t host_hi = prefix_len >= 64 ? 0 : prefix_len == 0 ? UINT64_MAX : ((uint64_t)1 << (64 - prefix_len)) - 1;
+    uint64_t host_lo = prefix_len <= 64 ? UINT64_MAX : prefix_len == 128 ? 0 : ((uint64_t)1 << (128 - prefix_len)) - 1;
+    struct ExcludeRange6 range = {hi & ~host_hi, lo & ~host_lo, hi | host_hi, lo | host_lo};
+    return add_range6(builder, &range) ? -1 : 0;
+
+}
+
+// Parse a text list of subnets, one per line with '#' comments, into sorted and merged ranges
+static int parse_exclude_text(const char *path, struct RangeBuilder *builder) {
+
+    FILE *fp = fopen(path, "r");
+    if(fp == NULL) {
+        fprintf(stderr, "failed to read %s: ", path);
+        perror(NULL);
+        return 1;
+    }
+
+    memset(builder, 0, sizeof(*builder));
+    char line[128];
+    int line_number = 0;
+    while(fgets(line, sizeof(line), fp)) {
+
+        line_number++;
+        line[strcspn(line, "#\r\n")] = '\0';
+
+        char token[128];
+        if(sscanf(line, "%127s", token) != 1) {
+            continue;
+        }
+
+        int result = parse_subnet(builder, token);
+        if(result == -1) {
+            fprintf(stderr, "failed to allocate blocklist\n");
+            free(builder->ranges4);
+            free(builder->ranges6);
+            fclose(fp);
+            return 1;
+        }
+        if(result) {
+            fprintf(stderr, "%s:%d: ignoring invalid subnet\n", path, line_number);
+        }
+
+    }
+
+    fclose(fp);
+    merge_ranges(builder);
+    return 0;
+
+}
+
+static void free_table(struct ExcludeTable *table) {
+    if(table->mapping != NULL) {
+        munmap(table->mapping, table->mapping_length);
+    } else {
+        free((void *)table->ranges4);
+        free((void *)table->ranges6);
+    }
+    free(table);
+}
+
+// Whether each range is in order and starts after the one before it ends, as the binary search in the lookups assumes
+static bool ranges_sorted(const struct ExcludeTable *table) {
+    for(uint32_t i = 0; i < table->num_ranges4; i++) {
+        const struct ExcludeRange4 *range = &table->ranges4[i];
+        if(range->first > range->last || (i > 0 && range->first <= table->ranges4[i - 1].last)) {
+            return false;
+        }
+    }
+    for(uint32_t i = 0; i < table->num_ranges6; i++) {
+        const struct ExcludeRange6 *range = &table->ranges6[i];
+        if(before6(range->last_hi, range->last_lo, range->first_hi, range->first_lo)) {
+            return false;
+        }
+        if(i > 0 && !before6(table->ranges6[i - 1].last_hi, table->ranges6[i - 1].last_lo, range->first_hi, range->first_lo)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Map a compiled blocklist; the ranges are used in place, so loading takes no time whatever the list's size. They are
+ * checked once, since a stale or corrupt file would otherwise silently let excluded addresses through. */
+static struct ExcludeTable *map_compiled_table(const char *path, int fd, size_t length) {
+
+    void *mapping = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(mapping == MAP_FAILED) {
+        fprintf(stderr, "failed to map %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    const struct BlocklistHeader *header = mapping;
+    size_t expected = sizeof(struct BlocklistHeader) + (size_t)header->num_ranges4 * sizeof(struct ExcludeRange4) + (size_t)header->num_ranges6 * sizeof(struct ExcludeRange6);
+    struct ExcludeTable *table = malloc(sizeof(struct ExcludeTable));
+    if(expected != length || table == NULL) {
+        fprintf(stderr, table == NULL ? "failed to allocate blocklist\n" : "%s is truncated or corrupt\n", path);
+        munmap(mapping, length);
+        free(table);
+        return NULL;
+    }
+
+    table->ranges4 = (const struct ExcludeRange4 *)(header + 1);
+    table->num_ranges4 = header->num_ranges4;
+    table->ranges6 = (const struct ExcludeRange6 *)(table->ranges4 + table->num_ranges4);
+    table->num_ranges6 = header->num_ranges6;
+    table->mapping = mapping;
+    table->mapping_length = length;
+    if(!ranges_sorted(table)) {
+        fprintf(stderr, "%s has ranges out of order; recompile it with compile-blocklist\n", path);
+        free_table(table);
+        return NULL;
+    }
+    return table;
+
+}
+
+// Load a blocklist, either compiled (recognized by its magic) or as a text list
+static struct ExcludeTable *load_table(const char *path) {
+
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) {
+        fprintf(stderr, "failed to read %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    char magic[sizeof(BLOCKLIST_MAGIC) - 1];
+    bool compiled = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct BlocklistHeader) && read(fd, magic, sizeof(magic)) == sizeof(magic) && memcmp(magic, BLOCKLIST_MAGIC, sizeof(magic)) == 0;
+    if(compiled) {
+        struct ExcludeTable *table = map_compiled_table(path, fd, st.st_size);
+        close(fd);
+        return table;
+    }
+    close(fd);
+
+    struct RangeBuilder builder;
+    struct ExcludeTable *table = malloc(sizeof(struct ExcludeTable));
+    if(table == NULL || parse_exclude_text(path, &builder)) {
+        free(table);
+        return NULL;
+    }
+
+    table->ranges4 = builder.ranges4;
+    table->num_ranges4 = builder.num_ranges4;
+    table->ranges6 = builder.ranges6;
+    table->num_ranges6 = builder.num_ranges6;
+    table->mapping = NULL;
+    table->mapping_length = 0;
+    return table;
+
+}
+
+int load_exclude_list(struct ExcludeList *exclude, const char *path) {
+    exclude->path = path;
+    exclude->table = load_table(path);
+    return exclude->table == NULL;
+}
+
+/* Load the blocklist file again and swap it in. Lookups only ever see the old table or the new one, and the old one
+ * is kept if the new file can't be loaded. */
+int reload_exclude_list(struct ExcludeList *exclude) {
+
+    struct ExcludeTable *table = load_table(exclude->path);
+    if(table == NULL) {
+        fprintf(stderr, "keeping the previous blocklist\n");
+        return 1;
+    }
+
+    struct ExcludeTable *old = exclude->table;
+    exclude->table = table;
+    free_table(old);
+    printf("reloaded %s: %u IPv4 and %u IPv6 ranges\n", exclude->path, table->num_ranges4, table->num_ranges6);
+    return 0;
+
+}
+
+static void handle_sighup(int sig) {
+    (void)sig;
+    reload_requested = 1;
+}
+
+// Reload `exclude` whenever the process receives SIGHUP
+void enable_exclude_reload(struct ExcludeList *exclude) {
+    reload_target = exclude;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_sighup;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    if(sigaction(SIGHUP, &action, NULL) == -1) {
+        perror("sigaction");
+    }
+}
+
+// Called from the event loops; performs a reload requested by SIGHUP outside of signal context
+void poll_exclude_reload(void) {
+    if(reload_requested && reload_target != NULL) {
+        reload_requested = 0;
+        reload_exclude_list(reload_target);
+    }
+}
+
+/* Compile a text list into the binary format. The output is written to a temporary file and renamed into place, so a
+ * running scanner reloading on SIGHUP never sees a partially written list. */
+int compile_exclude_list(const char *text_path, const char *out_path) {
+
+    struct RangeBuilder builder;
+    if(parse_exclude_text(text_path, &builder)) {
+        return 1;
+    }
+
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", out_path);
+    FILE *fp = fopen(tmp_path, "wb");
+    if(fp == NULL) {
+        fprintf(stderr, "failed to create %s: %s\n", tmp_path, strerror(errno));
+        free(builder.ranges4);
+        free(builder.ranges6);
+        return 1;
+    }
+
+    struct BlocklistHeader header;
+    memcpy(header.magic, BLOCKLIST_MAGIC, sizeof(header.magic));
+    header.num_ranges4 = builder.num_ranges4;
+    header.num_ranges6 = builder.num_ranges6;
+    bool written = fwrite(&header, sizeof(header), 1, fp) == 1
+        && fwrite(builder.ranges4, sizeof(struct ExcludeRange4), builder.num_ranges4, fp) == builder.num_ranges4
+        && fwrite(builder.ranges6, sizeof(struct ExcludeRange6), builder.num_ranges6, fp) == builder.num_ranges6;
+    written = fclose(fp) == 0 && written;
+    free(builder.ranges4);
+    free(builder.ranges6);
+
+    if(!written || rename(tmp_path, out_path) == -1) {
+        fprintf(stderr, "failed to write %s: %s\n", out_path, strerror(errno));
+        unlink(tmp_path);
+        return 1;
+    }
+
+    printf("compiled %s: %u IPv4 and %u IPv6 ranges\n", out_path, header.num_ranges4, header.num_ranges6);
+    return 0;
+
+}
+
+// Number of IPv4 addresses the blocklist covers; the ranges are merged, so they never overlap
+uint64_t count_excluded_ipv4(const struct ExcludeList *exclude) {
+    uint64_t count = 0;
+    for(uint32_t i = 0; i < exclude->table->num_ranges4; i++) {
+        count += (uint64_t)exclude->table->ranges4[i].last - exclude->table->ranges4[i].first + 1;
+    }
+    return count;
+}
+
+int should_exclude6(const struct ExcludeList *exclude, const struct in6_addr *addr) {
+
+    const struct ExcludeTable *table = exclude->table;
+    uint64_t hi, lo;
+    split_address6(addr, &hi, &lo);
+
+    // Find the last range starting at or before the address
+    uint32_t lo_idx = 0, hi_idx = table->num_ranges6;
+    while(lo_idx < hi_idx) {
+        uint32_t mid = lo_idx + (hi_idx - lo_idx) / 2;
+        const struct ExcludeRange6 *range = &table->ranges6[mid];
+        if(before6(hi, lo, range->first_hi, range->first_lo)) {
+            hi_idx = mid;
+        } else {
+            lo_idx = mid + 1;
+        }
+    }
+    if(lo_idx == 0) {
+        return 0;
+    }
+    const struct ExcludeRange6 *range = &table->ranges6[lo_idx - 1];
+    return !before6(range->last_hi, range->last_lo, hi, lo);
+
+}
+
+bool should_exclude_address(const struct ExcludeList *exclude, const struct in6_addr *addr) {
+    if(is_ipv4(addr)) {
+        return should_exclude(exclude, ntohl(ipv4_of(addr)));
+    }
+    return should_exclude6(exclude, addr);
+}
+
+int should_exclude(const struct ExcludeList *exclude, uint32_t addr) {
+
+    const struct ExcludeTable *table = exclude->table;
+
+    // Find the last range starting at or before the address
+    uint32_t lo = 0, hi = table->num_ranges4;
+    while(lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if(addr < table->ranges4[mid].first) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo > 0 && addr <= table->ranges4[lo - 1].last;
+
+}
\ No newline at end of file
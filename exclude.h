@@ -0,0 +1,60 @@
+#ifndef __EXCLUDE_H
+#define __EXCLUDE_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// First bytes of a compiled blocklist file
+#define BLOCKLIST_MAGIC "MSBLOCK1"
+
+// Inclusive range of excluded IPv4 addresses, in host byte order
+struct ExcludeRange4 {
+    uint32_t first;
+    uint32_t last;
+};
+
+// Inclusive range of excluded IPv6 addresses, as host-order (high, low) 64-bit halves
+struct ExcludeRange6 {
+    uint64_t first_hi;
+    uint64_t first_lo;
+    uint64_t last_hi;
+    uint64_t last_lo;
+};
+
+/* A compiled blocklist is this header followed by num_ranges4 ExcludeRange4 and num_ranges6 ExcludeRange6 records,
+ * each array sorted and free of overlaps. Values are in the byte order of the machine that compiled it. */
+struct BlocklistHeader {
+    char magic[8];
+    uint32_t num_ranges4;
+    uint32_t num_ranges6;
+};
+
+// One loaded version of the blocklist; either points into a mapped compiled file or owns its ranges
+struct ExcludeTable {
+    const struct ExcludeRange4 *ranges4;
+    uint32_t num_ranges4;
+    const struct ExcludeRange6 *ranges6;
+    uint32_t num_ranges6;
+    void *mapping;
+    size_t mapping_length;
+};
+
+// Subnets that must never be scanned, applied to every target source. The table is replaced as a whole on reload.
+struct ExcludeList {
+    const char *path;
+    struct ExcludeTable *table;
+};
+
+int load_exclude_list(struct ExcludeList *exclude, const char *path);
+int reload_exclude_list(struct ExcludeList *exclude);
+void enable_exclude_reload(struct ExcludeList *exclude);
+void poll_exclude_reload(void);
+int compile_exclude_list(const char *text_path, const char *out_path);
+uint64_t count_excluded_ipv4(const struct ExcludeList *exclude);
+int should_exclude(const struct ExcludeList *exclude, uint32_t addr);
+int should_exclude6(const struct ExcludeList *exclude, const struct in6_addr *addr);
+bool should_exclude_address(const struct ExcludeList *exclude, const struct in6_addr *addr);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,151 @@
+#include "favicon-store.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+// Linear probing from the low bits of the hash, which XXH64 has already mixed well
+static struct FaviconEntry *find_entry(struct FaviconEntry *entries, size_t capacity, uint64_t hash) {
+    size_t slot = hash & (capacity - 1);
+    while(entries[slot].id != 0 && entries[slot].hash != hash) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    return &entries[slot];
+}
+
+static int add_entry(struct FaviconStore *store, uint64_t hash, sqlite3_int64 id) {
+
+    if((store->count + 1) * 2 > store->capacity) {
+        size_t capacity = store->capacity * 2;
+        struct FaviconEntry *entries = calloc(capacity, sizeof(struct FaviconEntry));
+        if(entries == NULL) {
+            fprintf(stderr, "failed to grow favicon set\n");
+            return 1;
+        }
+        for(size_t i = 0; i < store->capacity; i++) {
+            if(store->entries[i].id != 0) {
+                *find_entry(entries, capacity, store->entries[i].hash) = store->entries[i];
+            }
+        }
+        free(store->entries);
+        store->entries = entries;
+        store->capacity = capacity;
+    }
+
+    struct FaviconEntry *entry = find_entry(store->entries, store->capacity, hash);
+    entry->hash = hash;
+    entry->id = id;
+    store->count++;
+    return 0;
+
+}
+
+// Fill the hash set from the favicons table
+static int load_favicons(struct FaviconStore *store, sqlite3 *db) {
+
+    sqlite3_stmt *stmt;
+    if(sqlite3_prepare_v2(db, "SELECT id, hash FROM favicons", -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "failed to read favicons: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+
+    int result;
+    while((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if(add_entry(store, (uint64_t)sqlite3_column_int64(stmt, 1), sqlite3_column_int64(stmt, 0))) {
+            sqlite3_finalize(stmt);
+            return 1;
+        }
+    }
+    sqlite3_finalize(stmt);
+    if(result != SQLITE_DONE) {
+        fprintf(stderr, "failed to read favicons: %s\n", sqlite3_errstr(result));
+        return 1;
+    }
+    return 0;
+
+}
+
+int open_favicon_store(struct FaviconStore *store, sqlite3 *db) {
+
+    store->capacity = FAVICON_SET_SIZE;
+    store->count = 0;
+    store->insert_stmt = NULL;
+    store->stored = 0;
+    store->reused = 0;
+    store->entries = calloc(store->capacity, sizeof(struct FaviconEntry));
+    if(store->entries == NULL) {
+        fprintf(stderr, "failed to allocate favicon set\n");
+        return 1;
+    }
+
+    char *err_msg;
+    if(sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS favicons (id INTEGER PRIMARY KEY, hash INTEGER NOT NULL UNIQUE, data TEXT NOT NULL)", NULL, NULL, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "failed to create table: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        close_favicon_store(store);
+        return 1;
+    }
+
+    if(load_favicons(store, db)) {
+        close_favicon_store(store);
+        return 1;
+    }
+
+    if(sqlite3_prepare_v2(db, "INSERT INTO favicons (hash, data) VALUES (?, ?)", -1, &store->insert_stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "failed to prepare statement: %s\n", sqlite3_errmsg(db));
+        close_favicon_store(store);
+        return 1;
+    }
+
+    return 0;
+
+}
+
+/* Forget the favicons added since the last commit, after the transaction that wrote them has been rolled back, by
+ * starting over from what the table holds now. */
+int reload_favicon_store(struct FaviconStore *store, sqlite3 *db) {
+    for(size_t i = 0; i < store->capacity; i++) {
+        store->entries[i].id = 0;
+    }
+    store->count = 0;
+    return load_favicons(store, db);
+}
+
+/* The id of the favicon with this hash. A favicon that isn't stored yet is added if its contents are given (data is
+ * the contents of the JSON string, with its escapes decoded); otherwise, or if it can't be written, this returns 0. */
+sqlite3_int64 find_favicon(struct FaviconStore *store, uint64_t hash, const char *data, int length) {
+
+    struct FaviconEntry *entry = find_entry(store->entries, store->capacity, hash);
+    if(entry->id != 0) {
+        store->reused++;
+        return entry->id;
+    }
+    if(data == NULL) {
+        return 0;
+    }
+
+    // The hash is stored as sqlite's signed 64-bit integer, as in the servers table
+    sqlite3_stmt *stmt = store->insert_stmt;
+    sqlite3_bind_int64(stmt, 1, (sqlite3_int64)hash);
+    sqlite3_bind_text(stmt, 2, data, length, SQLITE_TRANSIENT);
+    int result = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if(result != SQLITE_DONE) {
+        fprintf(stderr, "failed to store favicon: %s\n", sqlite3_errstr(result));
+        return 0;
+    }
+
+    sqlite3_int64 id = sqlite3_last_insert_rowid(sqlite3_db_handle(stmt));
+    store->stored++;
+    add_entry(store, hash, id);
+    return id;
+
+}
+
+void print_favicon_store(const struct FaviconStore *store) {
+    printf("favicons: %ld stored, %ld references to favicons already stored, %lu known\n", store->stored, store->reused, (unsigned long)store->count);
+}
+
+void close_favicon_store(struct FaviconStore *store) {
+    sqlite3_finalize(store->insert_stmt);
+    free(store->entries);
+    store->entries = NULL;
+}
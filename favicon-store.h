@@ -0,0 +1,36 @@
+#ifndef __FAVICON_STORE_H
+#define __FAVICON_STORE_H
+
+#include "sqlite/sqlite3.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Slots in the favicon hash set to begin with; it doubles whenever it gets half full
+#define FAVICON_SET_SIZE 4096
+
+struct FaviconEntry {
+    uint64_t hash;
+    sqlite3_int64 id; // 0 for an empty slot
+};
+
+/* Each distinct favicon is stored once in the favicons table, keyed by the XXH64 of its string, and servers refer to
+ * it by id. Thousands of servers share the default icons of hosting panels and server software, so this keeps them
+ * from being written again for every server on every rescan. The hashes already in the table are loaded into an
+ * in-memory hash set when the database is opened, so looking a favicon up never touches the disk. Two favicons with
+ * the same 64-bit hash are taken to be the same. */
+struct FaviconStore {
+    struct FaviconEntry *entries;
+    size_t capacity;
+    size_t count;
+    sqlite3_stmt *insert_stmt;
+    long stored; // favicons added by this run
+    long reused; // references to favicons that were already stored
+};
+
+int open_favicon_store(struct FaviconStore *store, sqlite3 *db);
+int reload_favicon_store(struct FaviconStore *store, sqlite3 *db);
+sqlite3_int64 find_favicon(struct FaviconStore *store, uint64_t hash, const char *data, int length);
+void print_favicon_store(const struct FaviconStore *store);
+void close_favicon_store(struct FaviconStore *store);
+
+#endif
@@ -0,0 +1,86 @@
+#include "handshake.h"
+#include <string.h>
+#include <stdio.h>
+
+// For full documentation of ping protocol see https://wiki.vg/Server_List_Ping
+
+const unsigned char pong_request[10] = {
+    0x09, // packet length
+    0x01, // packet ID (1 = ping)
+    0x6d, 0x69, 0x6e, 0x65, 0x73, 0x63, 0x61, 0x6e // payload, echoed in the pong ('minescan')
+};
+
+const unsigned char status_request[] = {
+    0x01, // packet length
+    0x00  // packet ID (0 = request status)
+};
+
+static int write_varint(unsigned char *out, uint32_t value) {
+    int length = 0;
+    do {
+        unsigned char byte = value & 0x7f;
+        value >>= 7;
+        out[length++] = byte | (value != 0 ? 0x80 : 0);
+    } while(value != 0);
+    return length;
+}
+
+int init_handshake(struct HandshakeTemplate *tmpl, int protocol, const char *hostname, bool ping) {
+
+    // Negative protocol versions are sent as their two's complement, -1 conventionally meaning "just pinging"
+    tmpl->protocol_length = write_varint(tmpl->protocol, (uint32_t)protocol);
+    tmpl->ping = ping;
+
+    if(hostname == NULL) {
+        tmpl->hostname_length = 0;
+        return 0;
+    }
+
+    tmpl->hostname_length = strlen(hostname);
+    if(tmpl->hostname_length == 0 || tmpl->hostname_length > MAX_HOSTNAME_LENGTH) {
+        fprintf(stderr, "hostname must be between 1 and %d characters\n", MAX_HOSTNAME_LENGTH);
+        return 1;
+    }
+    memcpy(tmpl->hostname, hostname, tmpl->hostname_length);
+    return 0;
+
+}
+
+/* Write the handshake, status request and (if enabled) ping packet for one target into `out`, which must hold at
+ * least MAX_HANDSHAKE_SIZE bytes. Returns the payload length. */
+int render_handshake(const struct HandshakeTemplate *tmpl, const struct in6_addr *addr, uint16_t port, unsigned char *out) {
+
+    char addr_str[MAX_ADDRESS_LENGTH];
+    const char *hostname = tmpl->hostname;
+    int hostname_length = tmpl->hostname_length;
+    if(hostname_length == 0) {
+        format_address(addr, addr_str);
+        hostname = addr_str;
+        hostname_length = strlen(addr_str);
+    }
+
+    // The hostname is at most 40 bytes, so the packet length and string length varints are always one byte each
+    int body_length = 1 + tmpl->protocol_length + 1 + hostname_length + 2 + 1;
+    int pos = 0;
+    out[pos++] = body_length; // packet length
+    out[pos++] = 0x00; // packet ID (0 = handshake)
+    memcpy(out + pos, tmpl->protocol, tmpl->protocol_length); // protocol version number
+    pos += tmpl->protocol_length;
+    out[pos++] = hostname_length; // hostname
+    memcpy(out + pos, hostname, hostname_length);
+    pos += hostname_length;
+    out[pos++] = port >> 8; // port
+    out[pos++] = port & 0xff;
+    out[pos++] = 0x01; // next state (1 = querying server status)
+
+    memcpy(out + pos, status_request, sizeof(status_request));
+    pos += sizeof(status_request);
+
+    if(tmpl->ping) {
+        memcpy(out + pos, pong_request, sizeof(pong_request));
+        pos += sizeof(pong_request);
+    }
+
+    return pos;
+
+}
@@ -0,0 +1,30 @@
+#ifndef __HANDSHAKE_H
+#define __HANDSHAKE_H
+
+#include "address.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Longest server address we will put in a handshake; keeps rendered payloads small enough to live inline in each socket
+#define MAX_HOSTNAME_LENGTH 40
+
+// Upper bound on a rendered handshake, status request and optional ping packet
+#define MAX_HANDSHAKE_SIZE 72
+
+// Ping packet pipelined after the status request when measuring RTT; the pong echoes it exactly
+extern const unsigned char pong_request[10];
+
+/* Precomputed parts of the handshake. Everything that doesn't depend on the target is encoded once, so rendering a
+ * payload for a connection is just a few copies into its buffer. */
+struct HandshakeTemplate {
+    unsigned char protocol[5];
+    int protocol_length;
+    char hostname[MAX_HOSTNAME_LENGTH + 1];
+    int hostname_length; // zero to use each target's address instead
+    bool ping;
+};
+
+int init_handshake(struct HandshakeTemplate *tmpl, int protocol, const char *hostname, bool ping);
+int render_handshake(const struct HandshakeTemplate *tmpl, const struct in6_addr *addr, uint16_t port, unsigned char *out);
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef __HASH_H
+#define __HASH_H
+
+#include <stdint.h>
+
+// Finalizer from MurmurHash3; cheap bijective mixing of 32-bit values such as addresses
+static inline uint32_t mix32(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x85ebca6b;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35;
+    x ^= x >> 16;
+    return x;
+}
+
+#endif
@@ -0,0 +1,408 @@
+#include "json-filter.h"
+#include <stdint.h>
+#include <string.h>
+
+// Parts of the packet body, which is a VarInt packet ID and a VarInt-prefixed JSON string
+enum FilterStage {
+    FILTER_PACKET_ID,
+    FILTER_STRING_LENGTH,
+    FILTER_JSON
+};
+
+static const char favicon_name[] = "favicon";
+
+// Whether responses can come out shorter than they went in
+bool drops_fields(const struct FieldRules *rules) {
+    return !rules->keep_favicon || rules->num_dropped > 0;
+}
+
+void init_json_filter(struct JsonFilter *filter, const struct FieldRules *rules) {
+    filter->rules = rules;
+    filter->stage = FILTER_PACKET_ID;
+    filter->depth = 0;
+    filter->in_string = false;
+    filter->escaped = false;
+    filter->expect_name = false;
+    filter->in_name = false;
+    filter->dropping = false;
+    filter->hashing = false;
+    filter->in_favicon = false;
+    filter->has_favicon = false;
+    filter->output_length = 0;
+    filter->favicon_from = -1;
+    filter->favicon_to = -1;
+    filter->favicon_value = -1;
+    filter->favicon_length = -1;
+    filter->favicon_first = false;
+    filter->members_kept = 0;
+    filter->pending_length = 0;
+    filter->name_start = 0;
+    init_content_hash(&filter->favicon);
+    filter->favicon_escape.held_length = 0;
+}
+
+// The value of the four hex digits at in, or -1 if they aren't all hex digits
+static long parse_hex4(const char *in) {
+    long value = 0;
+    for(int i = 0; i < 4; i++) {
+        char c = in[i];
+        int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if(digit == -1) {
+            return -1;
+        }
+        value = value << 4 | digit;
+    }
+    return value;
+}
+
+static int encode_utf8(uint32_t code, char *out) {
+    if(code < 0x80) {
+        out[0] = code;
+        return 1;
+    }
+    if(code < 0x800) {
+        out[0] = 0xC0 | code >> 6;
+        out[1] = 0x80 | (code & 0x3F);
+        return 2;
+    }
+    if(code < 0x10000) {
+        out[0] = 0xE0 | code >> 12;
+        out[1] = 0x80 | (code >> 6 & 0x3F);
+        out[2] = 0x80 | (code & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | code >> 18;
+    out[1] = 0x80 | (code >> 12 & 0x3F);
+    out[2] = 0x80 | (code >> 6 & 0x3F);
+    out[3] = 0x80 | (code & 0x3F);
+    return 4;
+}
+
+static int unescape_byte(struct JsonUnescape *escape, char c, char *out);
+
+/* Give up on decoding the held escape: the first keep bytes are written out as they are, and the rest are decoded
+ * again from scratch. */
+static int release_held(struct JsonUnescape *escape, int keep, char *out) {
+    char rest[MAX_ESCAPE_LENGTH];
+    int rest_length = escape->held_length - keep;
+    memcpy(out, escape->held, keep);
+    memcpy(rest, escape->held + keep, rest_length);
+    escape->held_length = 0;
+    int written = keep;
+    for(int i = 0; i < rest_length; i++) {
+        written += unescape_byte(escape, rest[i], out + written);
+    }
+    return written;
+}
+
+/* Decode the next byte of a string's contents into out, returning the number of bytes written. Never writes more
+ * than it has been given, so a string can be decoded in place. Malformed escapes and lone surrogates are left as
+ * they were written. */
+static int unescape_byte(struct JsonUnescape *escape, char c, char *out) {
+
+    if(escape->held_length == 0 && c != '\\') {
+        out[0] = c;
+        return 1;
+    }
+    escape->held[escape->held_length++] = c;
+
+    switch(escape->held_length) {
+        case 2: {
+            if(c == 'u') {
+                return 0;
+            }
+            static const char escaped[] = "\"\\/bfnrt";
+            static const char decoded[] = "\"\\/\b\f\n\r\t";
+            const char *found = c != '\0' ? strchr(escaped, c) : NULL;
+            if(found == NULL) {
+                return release_held(escape, 2, out);
+            }
+            escape->held_length = 0;
+            out[0] = decoded[found - escaped];
+            return 1;
+        }
+        case 6: {
+            long code = parse_hex4(escape->held + 2);
+            if(code == -1 || (code >= 0xDC00 && code <= 0xDFFF)) {
+                return release_held(escape, 6, out);
+            }
+            if(code >= 0xD800 && code <= 0xDBFF) {
+                return 0; // the low surrogate should follow
+            }
+            escape->held_length = 0;
+            return encode_utf8(code, out);
+        }
+        case 7:
+        case 8:
+            if(c != (escape->held_length == 7 ? '\\' : 'u')) {
+                return release_held(escape, 6, out);
+            }
+            return 0;
+        case MAX_ESCAPE_LENGTH: {
+            long low = parse_hex4(escape->held + 8);
+            if(low < 0xDC00 || low > 0xDFFF) {
+                return release_held(escape, 6, out);
+            }
+            long high = parse_hex4(escape->held + 2);
+            escape->held_length = 0;
+            return encode_utf8(0x10000 + ((high - 0xD800) << 10 | (low - 0xDC00)), out);
+        }
+        default:
+            return 0;
+    }
+
+}
+
+// Write out whatever is still held back when the string ends
+static int finish_unescape(struct JsonUnescape *escape, char *out) {
+    int length = escape->held_length;
+    memcpy(out, escape->held, length);
+    escape->held_length = 0;
+    return length;
+}
+
+// Decode the escapes in a string's contents in place, returning its new length
+static int unescape_json(char *data, int length) {
+    struct JsonUnescape escape = {.held_length = 0};
+    int written = 0;
+    for(int i = 0; i < length; i++) {
+        written += unescape_byte(&escape, data[i], data + written);
+    }
+    return written + finish_unescape(&escape, data + written);
+}
+
+// Write out the held-back start of a member that stays; the first member kept loses its separator
+static int flush_pending(struct JsonFilter *filter, char *out) {
+    const char *start = filter->pending;
+    int length = filter->pending_length;
+    if(filter->members_kept == 0 && length > 0 && start[0] == ',') {
+        start++;
+        length--;
+    }
+    memcpy(out, start, length);
+    filter->pending_length = 0;
+    filter->members_kept++;
+    return length;
+}
+
+// Keep a member without looking at its name, when there is no more room to hold it back
+static int keep_member(struct JsonFilter *filter, char *out) {
+    filter->expect_name = false;
+    filter->in_name = false;
+    filter->dropping = false;
+    filter->hashing = false;
+    return flush_pending(filter, out);
+}
+
+/* The name of a member has been read up to its closing quote: decide whether the member stays. at is where out is in
+ * the whole output. */
+static int name_complete(struct JsonFilter *filter, char *out, int at) {
+
+    const char *name = filter->pending + filter->name_start;
+    size_t length = filter->pending_length - 1 - filter->name_start;
+    filter->in_name = false;
+    filter->hashing = length == sizeof(favicon_name) - 1 && memcmp(name, favicon_name, length) == 0;
+    filter->dropping = filter->hashing && !filter->rules->keep_favicon;
+    for(int i = 0; i < filter->rules->num_dropped && !filter->dropping; i++) {
+        const char *dropped = filter->rules->dropped[i];
+        filter->dropping = strlen(dropped) == length && memcmp(name, dropped, length) == 0;
+    }
+
+    if(filter->dropping) {
+        filter->pending_length = 0;
+        return 0;
+    }
+    if(filter->hashing && filter->favicon_from == -1) {
+        filter->favicon_from = at;
+        filter->favicon_first = filter->members_kept == 0;
+    }
+    return flush_pending(filter, out);
+
+}
+
+// A top-level member has ended, at the given point in the output
+static void end_member(struct JsonFilter *filter, int at) {
+    if(filter->hashing && !filter->dropping && filter->favicon_to == -1) {
+        filter->favicon_to = at;
+    }
+    filter->dropping = false;
+    filter->hashing = false;
+}
+
+/* Filter the next chunk of the packet body into out, returning the number of bytes written. out needs room for
+ * length + pending_length bytes. */
+int filter_json(struct JsonFilter *filter, const char *in, int length, char *out) {
+
+    int written = 0;
+    char decoded[256]; // favicon bytes waiting to be hashed
+    int decoded_length = 0;
+    for(int i = 0; i < length; i++) {
+
+        char c = in[i];
+        if(filter->stage != FILTER_JSON) {
+
+            // VarInts end with the first byte whose top bit is clear
+            if(!(c & 0x80)) {
+                filter->stage++;
+            }
+            continue;
+
+        }
+
+        if(filter->in_string) {
+
+            bool closing = false;
+            if(filter->escaped) {
+                filter->escaped = false;
+            } else if(c == '\\') {
+                filter->escaped = true;
+            } else if(c == '"') {
+                filter->in_string = false;
+                closing = true;
+            }
+
+            if(filter->in_name) {
+                filter->pending[filter->pending_length++] = c;
+                if(closing) {
+                    written += name_complete(filter, out + written, filter->output_length + written);
+                } else if(filter->pending_length == FILTER_PENDING_SIZE) {
+                    written += keep_member(filter, out + written);
+                }
+                continue;
+            }
+
+            if(closing && filter->in_favicon) {
+                if(!filter->dropping && filter->favicon_length == -1) {
+                    filter->favicon_length = filter->output_length + written - filter->favicon_value;
+                }
+                decoded_length += finish_unescape(&filter->favicon_escape, decoded + decoded_length);
+                update_content_hash(&filter->favicon, decoded, decoded_length);
+                decoded_length = 0;
+                filter->in_favicon = false;
+                filter->has_favicon = true;
+            } else if(filter->in_favicon) {
+                decoded_length += unescape_byte(&filter->favicon_escape, c, decoded + decoded_length);
+                if(decoded_length > (int)sizeof(decoded) - MAX_ESCAPE_LENGTH) {
+                    update_content_hash(&filter->favicon, decoded, decoded_length);
+                    decoded_length = 0;
+                }
+            }
+            if(!filter->dropping) {
+                out[written++] = c;
+            }
+            continue;
+
+        }
+
+        // Between members of the top-level object, hold everything back until the next member's name has been read
+        if(filter->depth == 1 && filter->expect_name) {
+            if(c == '}') {
+                written += flush_pending(filter, out + written);
+                filter->expect_name = false;
+                filter->depth = 0;
+                out[written++] = c;
+                continue;
+            }
+            filter->pending[filter->pending_length++] = c;
+            if(c == '"') {
+                filter->in_string = true;
+                filter->in_name = true;
+                filter->expect_name = false;
+                filter->name_start = filter->pending_length;
+            }
+            if(filter->pending_length == FILTER_PENDING_SIZE) {
+                written += keep_member(filter, out + written);
+            }
+            continue;
+        }
+
+        switch(c) {
+            case '"':
+                filter->in_string = true;
+                if(filter->hashing && filter->depth == 1) {
+                    filter->in_favicon = true;
+                    if(!filter->dropping && filter->favicon_length == -1) {
+                        filter->favicon_value = filter->output_length + written + 1;
+                    }
+                }
+                break;
+            case '{':
+            case '[':
+                filter->depth++;
+                filter->expect_name = filter->depth == 1 && c == '{';
+                break;
+            case '}':
+            case ']':
+                if(filter->depth > 0 && --filter->depth == 0) {
+                    end_member(filter, filter->output_length + written);
+                }
+                break;
+            case ',':
+                if(filter->depth == 1) {
+                    end_member(filter, filter->output_length + written);
+                    filter->expect_name = true;
+                    filter->pending[0] = c;
+                    filter->pending_length = 1;
+                    continue;
+                }
+                break;
+        }
+        if(!filter->dropping) {
+            out[written++] = c;
+        }
+
+    }
+
+    update_content_hash(&filter->favicon, decoded, decoded_length);
+    filter->output_length += written;
+    return written;
+
+}
+
+// The hash of the favicon string with its escapes decoded, if the response had one
+bool favicon_hash(const struct JsonFilter *filter, uint64_t *hash) {
+    if(!filter->has_favicon) {
+        return false;
+    }
+    *hash = finish_content_hash(&filter->favicon);
+    return true;
+}
+
+static void reverse(char *start, int length) {
+    for(char *end = start + length - 1; start < end; start++, end--) {
+        char c = *start;
+        *start = *end;
+        *end = c;
+    }
+}
+
+/* Move a kept favicon member behind the rest of the filtered response, in place. Returns the length of the response
+ * without the member, and points favicon at the contents of its string, decoded in place; if there is no favicon string
+ * to split off, the response is left as it is. */
+int split_favicon(const struct JsonFilter *filter, char *json, int length, const char **favicon, int *favicon_length) {
+
+    *favicon = NULL;
+    *favicon_length = 0;
+    if(filter->favicon_from == -1 || filter->favicon_to == -1 || filter->favicon_length == -1 || filter->favicon_to > length) {
+        return length;
+    }
+
+    // Without a separator in front of it, the member takes the one behind it along instead
+    int from = filter->favicon_from;
+    int to = filter->favicon_to;
+    if(filter->favicon_first && to < length && json[to] == ',') {
+        to++;
+    }
+
+    // Swap the member and everything after it by reversing both and then the two together
+    reverse(json + from, to - from);
+    reverse(json + to, length - to);
+    reverse(json + from, length - from);
+
+    int response_length = length - (to - from);
+    char *value = json + response_length + (filter->favicon_value - from);
+    *favicon = value;
+    *favicon_length = unescape_json(value, filter->favicon_length);
+    return response_length;
+
+}
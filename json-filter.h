@@ -0,0 +1,73 @@
+#ifndef __JSON_FILTER_H
+#define __JSON_FILTER_H
+
+#include "content-hash.h"
+#include <stdbool.h>
+
+// Most top-level fields that can be dropped from status responses besides the favicon
+#define MAX_DROPPED_FIELDS 8
+
+// Longest field name that can be matched, excluding the terminator; fields with longer names are always kept
+#define MAX_FIELD_NAME 31
+
+// Bytes of a member held back while its name is read: the separator, some whitespace, and the quoted name
+#define FILTER_PENDING_SIZE (MAX_FIELD_NAME + 16)
+
+// Which top-level fields of a status response to keep
+struct FieldRules {
+    char dropped[MAX_DROPPED_FIELDS][MAX_FIELD_NAME + 1];
+    int num_dropped;
+    bool keep_favicon;
+};
+
+// Longest escape sequence held back while it is decoded: a surrogate pair written as two \uXXXX escapes
+#define MAX_ESCAPE_LENGTH 12
+
+// State for decoding the escapes in a JSON string a byte at a time, since a chunk can end in the middle of one
+struct JsonUnescape {
+    char held[MAX_ESCAPE_LENGTH];
+    int held_length;
+};
+
+/* Filters the body of a status response packet as it is read, so that fields nobody wants never take up buffer or
+ * database space. The packet ID and string length in front of the JSON are skipped, top-level members whose names are
+ * in the rules are removed along with their separators, and the favicon is hashed on the way past, whether it is kept
+ * or not. Nothing else is parsed: nested values are skipped by tracking strings and brackets, and malformed JSON just
+ * passes through. A member's separator and name are held back until it is known whether it stays, so filtering a
+ * chunk can write up to pending_length bytes more than the chunk holds. A favicon that is kept is located in the
+ * output, so that it can be split off into the favicon store once the whole response is in. The favicon is hashed and
+ * stored with its escapes decoded, since servers disagree on how to write it: Gson, for one, escapes every '=' in the
+ * base64 as \u003d. */
+struct JsonFilter {
+    const struct FieldRules *rules;
+    unsigned char stage;
+    int depth;
+    bool in_string;
+    bool escaped;
+    bool expect_name; // the next string at the top level names a member
+    bool in_name;
+    bool dropping; // the current top-level member is being removed
+    bool hashing; // the current top-level member is the favicon
+    bool in_favicon; // inside the favicon string
+    bool has_favicon;
+    int output_length; // written by earlier calls
+    int favicon_from; // the kept favicon member, including a separator in front of it; -1 if there is none
+    int favicon_to;
+    int favicon_value; // start of the favicon string's contents
+    int favicon_length;
+    bool favicon_first; // no separator was written in front of the favicon member
+    int members_kept;
+    char pending[FILTER_PENDING_SIZE];
+    int pending_length;
+    int name_start;
+    struct ContentHash favicon;
+    struct JsonUnescape favicon_escape;
+};
+
+bool drops_fields(const struct FieldRules *rules);
+void init_json_filter(struct JsonFilter *filter, const struct FieldRules *rules);
+int filter_json(struct JsonFilter *filter, const char *in, int length, char *out);
+bool favicon_hash(const struct JsonFilter *filter, uint64_t *hash);
+int split_favicon(const struct JsonFilter *filter, char *json, int length, const char **favicon, int *favicon_length);
+
+#endif
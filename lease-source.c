@@ -0,0 +1,281 @@
+#define _GNU_SOURCE
+#include "lease-source.h"
+#include "coordinator.h"
+#include "timer-wheel.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+
+// Seconds a worker waits for the coordinator to answer before giving up on it
+#define LEASE_REPLY_TIMEOUT_S 30
+
+/* Targets leased from a coordinator, one block of the permutation at a time. A block is reported complete only after
+ * every target drawn from it has been reported back by the scanner, retries included, so that the coordinator has all
+ * of its results by then. The lease is renewed a few times per lease period while the block is in progress. */
+struct LeaseSource {
+    struct TargetSource base;
+    struct AddressGenerator *addr_gen;
+    int fd;
+    char reply[LEASE_LINE_SIZE];
+    long block; // -1 when holding no lease
+    bool lost;  // the coordinator took the block back; finish its probes but don't report it
+    long issued;
+    long reported;
+    long blocks_completed;
+    int lease_s;
+    uint64_t renew_at_ms;
+    uint64_t retry_at_ms;
+};
+
+static void disconnect(struct LeaseSource *lease) {
+    if(lease->fd != -1) {
+        close(lease->fd);
+        lease->fd = -1;
+    }
+}
+
+static bool send_all(struct LeaseSource *lease, const char *data, size_t length) {
+    while(length > 0) {
+        ssize_t sent = send(lease->fd, data, length, MSG_NOSIGNAL);
+        if(sent == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "lost connection to coordinator: %s\n", strerror(errno));
+            disconnect(lease);
+            return false;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+// Send a request and wait for the one-line answer, which is left in lease->reply without its newline
+static bool request(struct LeaseSource *lease, const char *line) {
+
+    if(lease->fd == -1 || !send_all(lease, line, strlen(line))) {
+        return false;
+    }
+
+    // Answers only ever come in reply to a request, so nothing is read past the newline
+    size_t length = 0;
+    while(length < sizeof(lease->reply) - 1) {
+        ssize_t bytes_read = recv(lease->fd, lease->reply + length, 1, 0);
+        if(bytes_read == 1 && lease->reply[length] == '\n') {
+            lease->reply[length] = '\0';
+            return true;
+        }
+        if(bytes_read == 1) {
+            length++;
+        } else if(bytes_read == -1 && errno == EINTR) {
+            continue;
+        } else {
+            fprintf(stderr, "lost connection to coordinator%s%s\n", bytes_read == -1 ? ": " : "", bytes_read == -1 ? strerror(errno) : "");
+            disconnect(lease);
+            return false;
+        }
+    }
+
+    fprintf(stderr, "invalid answer from coordinator\n");
+    disconnect(lease);
+    return false;
+
+}
+
+static void renew_lease(struct LeaseSource *lease, uint64_t now) {
+
+    if(lease->block == -1 || lease->lost || now < lease->renew_at_ms) {
+        return;
+    }
+    lease->renew_at_ms = now + (uint64_t)lease->lease_s * 1000 / 3;
+
+    char line[LEASE_LINE_SIZE];
+    snprintf(line, sizeof(line), "RENEW %ld\n", lease->block);
+    if(request(lease, line) && strcmp(lease->reply, "OK") != 0) {
+        printf("lease on block %ld was lost; abandoning it\n", lease->block);
+        lease->lost = true;
+        lease->addr_gen->finished = true;
+    }
+
+}
+
+// Ask for the next block; false if there is none to work on right now
+static bool take_lease(struct LeaseSource *lease, uint64_t now) {
+
+    if(now < lease->retry_at_ms || !request(lease, "LEASE\n")) {
+        return false;
+    }
+
+    long block;
+    unsigned long first, steps;
+    int wait_s;
+    if(sscanf(lease->reply, "BLOCK %ld %lu %lu", &block, &first, &steps) == 3) {
+        seek_addrgen(lease->addr_gen, first, steps);
+        lease->block = block;
+        lease->lost = false;
+        lease->issued = 0;
+        lease->reported = 0;
+        lease->renew_at_ms = now + (uint64_t)lease->lease_s * 1000 / 3;
+        printf("leased block %ld (%lu steps from %lu)\n", block, steps, first);
+        return true;
+    }
+    if(sscanf(lease->reply, "WAIT %d", &wait_s) == 1) {
+        lease->retry_at_ms = now + (uint64_t)wait_s * 1000;
+        return false;
+    }
+    if(strcmp(lease->reply, "DONE") != 0) {
+        fprintf(stderr, "unexpected answer from coordinator: %s\n", lease->reply);
+    }
+    disconnect(lease);
+    return false;
+
+}
+
+static void complete_lease(struct LeaseSource *lease) {
+
+    if(!lease->lost) {
+        char line[LEASE_LINE_SIZE];
+        snprintf(line, sizeof(line), "COMPLETE %ld %ld\n", lease->block, lease->issued);
+        if(request(lease, line)) {
+            if(strcmp(lease->reply, "OK") == 0) {
+                lease->blocks_completed++;
+                printf("completed block %ld: %ld targets\n", lease->block, lease->issued);
+            } else {
+                printf("block %ld was lost before it could be completed\n", lease->block);
+            }
+        }
+    }
+    lease->block = -1;
+
+}
+
+static int lease_next_batch(struct TargetSource *source, struct Target *targets, int max) {
+
+    struct LeaseSource *lease = (struct LeaseSource *)source;
+    uint64_t now = monotonic_ms();
+    while(lease->fd != -1) {
+
+        if(lease->block == -1 && !take_lease(lease, now)) {
+            break;
+        }
+
+        renew_lease(lease, now);
+        int count = 0;
+        while(count < max && next_target(lease->addr_gen, &targets[count])) {
+            count++;
+        }
+        lease->issued += count;
+        if(count > 0) {
+            return count;
+        }
+
+        // The block is drawn; wait for its last probes before asking for another
+        if(lease->reported < lease->issued) {
+            return 0;
+        }
+        complete_lease(lease);
+
+    }
+
+    // Without a coordinator there is nothing more to lease, but the probes already started still run to the end
+    source->finished = lease->fd == -1 && lease->reported == lease->issued;
+    return 0;
+
+}
+
+static void lease_report(struct TargetSource *source, struct Target target, bool found) {
+    (void)target;
+    (void)found;
+    struct LeaseSource *lease = (struct LeaseSource *)source;
+    lease->reported++;
+    renew_lease(lease, monotonic_ms());
+}
+
+static void lease_destroy(struct TargetSource *source) {
+    struct LeaseSource *lease = (struct LeaseSource *)source;
+    printf("blocks completed for the coordinator: %ld\n", lease->blocks_completed);
+    disconnect(lease);
+    free(lease);
+}
+
+// Send a stored server to the coordinator, which keeps it with the block until the block is complete
+void forward_lease_result(struct TargetSource *source, const struct ServerRecord *record) {
+
+    struct LeaseSource *lease = (struct LeaseSource *)source;
+    if(lease->fd == -1 || lease->block == -1 || lease->lost) {
+        return;
+    }
+
+    char addr_str[MAX_ADDRESS_LENGTH];
+    format_address(&record->addr, addr_str);
+    char favicon[17] = "-";
+    if(record->has_favicon) {
+        snprintf(favicon, sizeof(favicon), "%016llx", (unsigned long long)record->favicon_hash);
+    }
+    char line[LEASE_LINE_SIZE];
+    int favicon_length = record->favicon != NULL ? record->favicon_length : 0;
+    int length = snprintf(line, sizeof(line), "RESULT %ld %s %d %s %d %s %d %d\n", lease->block, addr_str, record->port, record->edition, record->rtt_ms, favicon, favicon_length, record->response_length + favicon_length);
+    if(send_all(lease, line, length) && send_all(lease, record->response, record->response_length)) {
+        send_all(lease, record->favicon, favicon_length);
+    }
+
+}
+
+/* Connect to a coordinator as a worker. The target ports have to match the coordinator's, since they determine the
+ * permutation whose blocks it leases out. */
+struct TargetSource *open_lease_source(const char *path, struct AddressGenerator *addr_gen, const uint16_t *ports, int num_ports) {
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    struct LeaseSource *lease = calloc(1, sizeof(struct LeaseSource));
+    if(lease == NULL) {
+        fprintf(stderr, "failed to allocate target source\n");
+        return NULL;
+    }
+    lease->addr_gen = addr_gen;
+    lease->block = -1;
+    lease->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(lease->fd == -1 || connect(lease->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "failed to connect to coordinator at %s: %s\n", path, strerror(errno));
+        disconnect(lease);
+        free(lease);
+        return NULL;
+    }
+
+    struct timeval timeout = {.tv_sec = LEASE_REPLY_TIMEOUT_S};
+    setsockopt(lease->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char line[LEASE_LINE_SIZE];
+    strcpy(line, "HELLO ");
+    if(format_port_list(ports, num_ports, line + 6, sizeof(line) - 7)) {
+        fprintf(stderr, "too many target ports for a coordinated scan\n");
+        disconnect(lease);
+        free(lease);
+        return NULL;
+    }
+    strcat(line, "\n");
+    if(!request(lease, line) || sscanf(lease->reply, "OK %d", &lease->lease_s) != 1 || lease->lease_s < 1) {
+        fprintf(stderr, "coordinator refused this worker%s%s\n", lease->fd != -1 ? ": " : "", lease->fd != -1 ? lease->reply : "");
+        disconnect(lease);
+        free(lease);
+        return NULL;
+    }
+
+    lease->base.next_batch = lease_next_batch;
+    lease->base.report = lease_report;
+    lease->base.destroy = lease_destroy;
+    lease->base.finished = false;
+    printf("working for the coordinator at %s\n", path);
+    return &lease->base;
+
+}
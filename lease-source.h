@@ -0,0 +1,10 @@
+#ifndef __LEASE_SOURCE_H
+#define __LEASE_SOURCE_H
+
+#include "target-source.h"
+#include "db.h"
+
+struct TargetSource *open_lease_source(const char *path, struct AddressGenerator *addr_gen, const uint16_t *ports, int num_ports);
+void forward_lease_result(struct TargetSource *source, const struct ServerRecord *record);
+
+#endif
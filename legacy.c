@@ -0,0 +1,160 @@
+#include "legacy.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+// For full documentation of the pre-1.7 ping see https://wiki.vg/Server_List_Ping#1.6
+
+#define SECTION_SIGN 0xa7
+
+struct Output {
+    char *buf;
+    int size;
+    int length;
+};
+
+static void put_char(struct Output *out, char c) {
+    if(out->length < out->size) {
+        out->buf[out->length] = c;
+    }
+    out->length++;
+}
+
+static void put_str(struct Output *out, const char *str) {
+    while(*str) {
+        put_char(out, *str++);
+    }
+}
+
+// Append a code point as UTF-8, escaped for use inside a JSON string
+static void put_codepoint(struct Output *out, uint32_t cp) {
+    if(cp == '"' || cp == '\\') {
+        put_char(out, '\\');
+        put_char(out, cp);
+    } else if(cp < 0x20) {
+        char escape[8];
+        snprintf(escape, sizeof(escape), "\\u%04x", cp);
+        put_str(out, escape);
+    } else if(cp < 0x80) {
+        put_char(out, cp);
+    } else if(cp < 0x800) {
+        put_char(out, 0xc0 | cp >> 6);
+        put_char(out, 0x80 | (cp & 0x3f));
+    } else if(cp < 0x10000) {
+        put_char(out, 0xe0 | cp >> 12);
+        put_char(out, 0x80 | (cp >> 6 & 0x3f));
+        put_char(out, 0x80 | (cp & 0x3f));
+    } else {
+        put_char(out, 0xf0 | cp >> 18);
+        put_char(out, 0x80 | (cp >> 12 & 0x3f));
+        put_char(out, 0x80 | (cp >> 6 & 0x3f));
+        put_char(out, 0x80 | (cp & 0x3f));
+    }
+}
+
+static void put_field(struct Output *out, const uint32_t *cps, int start, int end) {
+    for(int i = start; i < end; i++) {
+        put_codepoint(out, cps[i]);
+    }
+}
+
+// Parse a field consisting only of ASCII digits
+static bool field_to_int(const uint32_t *cps, int start, int end, long *value) {
+    if(start == end || end - start > 9) {
+        return false;
+    }
+    *value = 0;
+    for(int i = start; i < end; i++) {
+        if(cps[i] < '0' || cps[i] > '9') {
+            return false;
+        }
+        *value = *value * 10 + (cps[i] - '0');
+    }
+    return true;
+}
+
+/* Given the first three bytes of a response, return the total length of the kick packet, or -1 if this is not one. */
+int legacy_response_length(const unsigned char *header) {
+    if(header[0] != 0xff) {
+        return -1;
+    }
+    int length = 3 + 2 * (header[1] << 8 | header[2]);
+    return length <= LEGACY_MAX_RESPONSE_SIZE ? length : -1;
+}
+
+/* Decode a legacy kick packet (0xFF, UTF-16BE string) and convert it to the JSON layout used by modern servers.
+ * Returns the length of the JSON written to `out`, or -1 if the response is malformed or doesn't fit. */
+int parse_legacy_response(const unsigned char *buf, int length, char *out, int out_size) {
+
+    if(length < 3 || legacy_response_length(buf) != length) {
+        return -1;
+    }
+
+    // Decode UTF-16BE into code points, combining surrogate pairs
+    uint32_t cps[LEGACY_MAX_RESPONSE_SIZE / 2];
+    int num_cps = 0;
+    for(int i = 3; i + 1 < length; i += 2) {
+        uint32_t unit = buf[i] << 8 | buf[i + 1];
+        if(unit >= 0xd800 && unit < 0xdc00 && i + 3 < length) {
+            uint32_t low = buf[i + 2] << 8 | buf[i + 3];
+            if(low >= 0xdc00 && low < 0xe000) {
+                unit = 0x10000 + ((unit - 0xd800) << 10) + (low - 0xdc00);
+                i += 2;
+            }
+        }
+        cps[num_cps++] = unit;
+    }
+
+    // 1.4-1.6 servers send "§1\0protocol\0version\0motd\0online\0max"; older ones send "motd§online§max"
+    int bounds[8];
+    int num_fields = 0;
+    bool new_format = num_cps >= 3 && cps[0] == SECTION_SIGN && cps[1] == '1' && cps[2] == 0;
+    uint32_t separator = new_format ? 0 : SECTION_SIGN;
+
+    bounds[num_fields++] = 0;
+    for(int i = 0; i < num_cps && num_fields < 7; i++) {
+        if(cps[i] == separator) {
+            bounds[num_fields++] = i + 1;
+        }
+    }
+    bounds[num_fields] = num_cps + 1;
+
+    struct Output output = {.buf = out, .size = out_size, .length = 0};
+    long protocol, online, max;
+    if(new_format) {
+
+        if(num_fields != 6 || !field_to_int(cps, bounds[1], bounds[2] - 1, &protocol) || !field_to_int(cps, bounds[4], bounds[5] - 1, &online) || !field_to_int(cps, bounds[5], bounds[6] - 1, &max)) {
+            return -1;
+        }
+
+        char numbers[96];
+        put_str(&output, "{\"version\":{\"name\":\"");
+        put_field(&output, cps, bounds[2], bounds[3] - 1);
+        snprintf(numbers, sizeof(numbers), "\",\"protocol\":%ld},", protocol);
+        put_str(&output, numbers);
+        snprintf(numbers, sizeof(numbers), "\"players\":{\"max\":%ld,\"online\":%ld},", max, online);
+        put_str(&output, numbers);
+        put_str(&output, "\"description\":{\"text\":\"");
+        put_field(&output, cps, bounds[3], bounds[4] - 1);
+        put_str(&output, "\"}}");
+
+    } else {
+
+        // The MOTD itself can't contain a section sign in this format, so there must be exactly three fields
+        if(num_fields != 3 || !field_to_int(cps, bounds[1], bounds[2] - 1, &online) || !field_to_int(cps, bounds[2], bounds[3] - 1, &max)) {
+            return -1;
+        }
+
+        char numbers[96];
+        snprintf(numbers, sizeof(numbers), "{\"players\":{\"max\":%ld,\"online\":%ld},", max, online);
+        put_str(&output, numbers);
+        put_str(&output, "\"description\":{\"text\":\"");
+        put_field(&output, cps, bounds[0], bounds[1] - 1);
+        put_str(&output, "\"}}");
+
+    }
+
+    return output.length <= out_size ? output.length : -1;
+
+}
@@ -0,0 +1,10 @@
+#ifndef __LEGACY_H
+#define __LEGACY_H
+
+// Largest legacy kick packet we accept, in bytes (including the 3-byte header)
+#define LEGACY_MAX_RESPONSE_SIZE 4096
+
+int legacy_response_length(const unsigned char *header);
+int parse_legacy_response(const unsigned char *buf, int length, char *out, int out_size);
+
+#endif
@@ -1,37 +1,104 @@
-#include "sqlite/sqlite3.h"
+#define _GNU_SOURCE
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
 #include "addr-gen.h"
+#include "target-source.h"
+#include "watchlist.h"
+#include "config.h"
+#include "db.h"
+#include "bedrock.h"
+#include "legacy.h"
+#include "addr-queue.h"
+#include "timer-wheel.h"
+#include "handshake.h"
+#include "address.h"
+#include "unreachable.h"
+#include "rtt-table.h"
+#include "prefix-limiter.h"
+#include "retry-queue.h"
+#include "coordinator.h"
+#include "lease-source.h"
+#include "cpu-locality.h"
+#include "arena.h"
+#include "memory-budget.h"
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
 #include <time.h>
+#include <math.h>
+
+// Which ping a connection is performing; hosts that don't answer the modern ping usably are retried with the legacy one
+enum Stage {
+    STAGE_MODERN,
+    STAGE_LEGACY
+};
+
+enum ReadStatus {
+    READ_MORE,
+    READ_COMPLETE,
+    READ_FAILED
+};
 
 struct SocketState {
+    struct TimerEntry timer; // must be first, expired timers are cast back to their SocketState
     int fd;
-    in_addr_t addr;
+    struct in6_addr addr;
+    uint16_t port;
+    enum Stage stage;
+    const unsigned char *payload;
+    int payload_length;
     int payload_bytes_sent;
-    char *packet_buf;
+    unsigned char payload_buf[MAX_HANDSHAKE_SIZE];
+    char *packet_buf; // the filtered response, or the raw legacy response
     int packet_bytes_read;
     int packet_length;
+    int packet_capacity;
+    int response_length;
+    struct JsonFilter filter;
+    bool status_complete;
+    bool connected;
+    bool retry; // second probe of a target after a transient failure
+    bool definite_failure; // refused or reported unreachable, so not worth a retry
+    uint64_t started_ms;
+    uint64_t payload_sent_ms;
+    unsigned char pong_buf[10];
+    int pong_bytes_read;
 };
 
-// For full documentation of ping protocol see https://wiki.vg/Server_List_Ping
-const unsigned char ping_payload[] = {
-    
-    0x15, // packet length
-    0x00, // packet ID (0 = handshake)
-    0xff, 0xff, 0xff, 0xff, 0x0f, // protocol version number (-1 = ping),
-    0x0b, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x2e, 0x63, 0x6f, 0x6d, // hostname (we just use 'example.com')
-    0xdd, 0x36, // port (25565)
-    0x01, // next state (1 = querying server status)
-    
-    0x01, // packet length
-    0x00  // packet ID (0 = request status)
+struct Scanner {
+    struct Config *config;
+    struct Database *db;
+    struct HandshakeTemplate handshake;
+    int epoll_fd;
+    int num_tracked_fds;
+    struct TimerWheel timers;
+    struct AddrQueue legacy_queue;
+    int legacy_servers_found;
+    struct TargetSource *source;
+    bool watching; // store compact samples instead of full responses
+    long probes_failed;
+    struct UnreachableCache unreachable;
+    struct RttTable rtt;
+    struct PrefixLimiter limiter;
+    struct AddrQueue deferred; // fresh targets held back by the limiter
+    struct RetryQueue retries;
+    struct SampleStats *sample; // tallies of the servers found, with --sample
+    struct CpuLocality *locality;
+    struct Arena states; // SocketStates
+    struct BufferArenas buffers; // response buffers
+    struct MemoryBudget budget;
+};
 
+// Pre-1.7 servers answer this with a kick packet containing the server info
+const unsigned char legacy_ping_payload[] = {
+    0xfe, // packet ID (server list ping)
+    0x01  // payload (always 1, asks 1.4+ servers for the extended response)
 };
 
 // Maximum number of epoll events that we try to process simultaneously
@@ -40,99 +107,164 @@ const unsigned char ping_payload[] = {
 // Limit on response size from server
 #define MAX_RESPONSE_SIZE 65536
 
-// Number of sockets to open at a time
-#define MAX_SOCKETS 10000
+// Response buffers start this small when fields are being filtered out, and grow as the filtered response needs
+#define FIRST_RESPONSE_BUFFER 1024
+
+// Most response bytes taken from a socket in one read(); the rest stay queued in the kernel until the next event
+#define READ_CHUNK_SIZE 16384
+
+// Kernel send buffer requested for lean sockets; we only ever send a few dozen bytes
+#define LEAN_SNDBUF_SIZE 4096
+
+// Number of different source (address, port) pairs tried before giving up on a target
+#define SOURCE_MAX_ATTEMPTS 4
+
+// Seconds between progress summaries when running as a monitor
+#define WATCH_SUMMARY_INTERVAL_S 60
+
+// Number of hosts that can wait for a legacy ping retry at once
+#define LEGACY_QUEUE_SIZE 65536
+
+// Number of targets that can wait for a retry at once, and how long they wait
+#define RETRY_QUEUE_SIZE 65536
+#define RETRY_DELAY_MS 3000
 
-// Client port used for outgoing connections
-#define CLIENT_PORT 12345
+// Number of fresh targets that can wait for their prefix to fall below its caps; the source isn't read while it's full
+#define DEFERRED_QUEUE_SIZE 4096
 
 int servers_found = 0;
 int addresses_searched = 0;
 
-int setup_db(sqlite3 **db, sqlite3_stmt **stmt) {
-    
-    // set up sqlite3 database
-    int result = sqlite3_open("scan.db", db);
-    if(result != SQLITE_OK) {
-        fprintf(stderr, "failed to open database: %s\n", sqlite3_errstr(result));
-        sqlite3_close(*db);
+// Apply per-socket options from the configured socket profile before connecting
+int apply_socket_profile(int socket_fd, struct Config *config) {
+
+    if(config->syn_retries > 0 && setsockopt(socket_fd, IPPROTO_TCP, TCP_SYNCNT, &config->syn_retries, sizeof(config->syn_retries)) == -1) {
+        perror("setsockopt(TCP_SYNCNT)");
         return 1;
     }
 
-    // create table
-    const char *create_table_query = "CREATE TABLE IF NOT EXISTS servers (address TEXT NOT NULL, timestamp INTEGER NOT NULL, response TEXT NOT NULL)";
-    char *err_msg;
-    result = sqlite3_exec(*db, create_table_query, NULL, NULL, &err_msg);
-    if(result != SQLITE_OK) {
-        fprintf(stderr, "failed to create table: %s\n", err_msg);
-        sqlite3_close(*db);
+    if(config->user_timeout_ms > 0 && setsockopt(socket_fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &config->user_timeout_ms, sizeof(config->user_timeout_ms)) == -1) {
+        perror("setsockopt(TCP_USER_TIMEOUT)");
+        return 1;
+    }
+
+    if(!config->lean) {
+        return 0;
+    }
+
+    // Abort the connection with RST on close() so that no TIME_WAIT state is left behind for finished probes
+    struct linger linger = {.l_onoff = 1, .l_linger = 0};
+    if(setsockopt(socket_fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger)) == -1) {
+        perror("setsockopt(SO_LINGER)");
         return 1;
     }
 
-    // prepare insert statement
-    const char *insert_query = "INSERT INTO servers (address, timestamp, response) VALUES (?, ?, ?)";
-    result = sqlite3_prepare_v2(*db, insert_query, -1, stmt, NULL);
-    if(result != SQLITE_OK) {
-        fprintf(stderr, "failed to prepare statement: %s\n", sqlite3_errmsg(*db));
+    // Shrink kernel buffers; this must happen before connect() so the advertised window matches
+    int rcvbuf = MAX_RESPONSE_SIZE, sndbuf = LEAN_SNDBUF_SIZE;
+    if(setsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == -1 || setsockopt(socket_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) == -1) {
+        perror("setsockopt(SO_RCVBUF/SO_SNDBUF)");
+        return 1;
     }
 
     return 0;
-    
+
 }
 
-int connect_socket(int client_port, in_addr_t addr) {
-    
-    int socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
-    if(socket_fd == -1) {
-        perror("socket");
-        return -1;
-    }
+int connect_socket(struct Config *config, struct Target target) {
 
-    // To avoid ephemeral port exhaustion, reuse the same client port for all outgoing connections (this works because each connection is to a different IP)
-    int optval = 1;
-    if(setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) == -1) {
-        perror("setsockopt");
-        close(socket_fd);
-        return -1;
-    }
+    struct SourcePool *pool = &config->source_pool;
 
-    struct sockaddr_in client_addr;
-    client_addr.sin_family = AF_INET;
-    client_addr.sin_port = htons(client_port);
-    client_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    if(bind(socket_fd, (struct sockaddr *)&client_addr, sizeof(client_addr)) == -1) {
-        perror("bind");
-        close(socket_fd);
-        return -1;
-    }
+    // After SOURCE_MAX_ATTEMPTS collisions, one last attempt is made with a kernel-chosen ephemeral port
+    for(int attempt = 0; attempt <= SOURCE_MAX_ATTEMPTS; attempt++) {
 
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(25565);
-    server_addr.sin_addr.s_addr = addr;
-    if(connect(socket_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1 && errno != EINPROGRESS) {
-        if(errno != ENETUNREACH) {
-            char buf[32];
-            inet_ntop(AF_INET, &addr, buf, 32);
-            fprintf(stderr, "(address %s) ", buf);
-            perror("connect");
+        int family = address_family(&target.addr);
+        int socket_fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if(socket_fd == -1) {
+            perror("socket");
+            return -1;
         }
-        close(socket_fd);
-        return -1;
+
+        // To avoid ephemeral port exhaustion, reuse the same client ports for all outgoing connections (this works because each connection is to a different IP)
+        int optval = 1;
+        if(setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) == -1) {
+            perror("setsockopt");
+            close(socket_fd);
+            return -1;
+        }
+
+        if(apply_socket_profile(socket_fd, config)) {
+            close(socket_fd);
+            return -1;
+        }
+
+        if(config->skip_unreachable && enable_error_queue(socket_fd, family)) {
+            close(socket_fd);
+            return -1;
+        }
+
+        struct sockaddr_in6 source;
+        pick_source(pool, &target.addr, attempt, &source);
+        struct sockaddr_storage client_addr;
+        socklen_t client_length = to_sockaddr(&source.sin6_addr, attempt == SOURCE_MAX_ATTEMPTS ? 0 : ntohs(source.sin6_port), &client_addr);
+        if(bind(socket_fd, (struct sockaddr *)&client_addr, client_length) == -1) {
+            close(socket_fd);
+            if(errno == EADDRINUSE) {
+                pool->collisions++;
+                continue;
+            }
+            perror("bind");
+            return -1;
+        }
+
+        struct sockaddr_storage server_addr;
+        socklen_t server_length = to_sockaddr(&target.addr, target.port, &server_addr);
+        if(connect(socket_fd, (struct sockaddr *)&server_addr, server_length) == -1 && errno != EINPROGRESS) {
+
+            // The 4-tuple is still held by an earlier connection (e.g. in TIME_WAIT), try another source
+            if(errno == EADDRNOTAVAIL) {
+                pool->collisions++;
+                close(socket_fd);
+                continue;
+            }
+
+            // Unreachable targets are expected; the caller records them by errno
+            int connect_errno = errno;
+            if(classify_connect_errno(connect_errno) == PROBE_ERROR_OTHER) {
+                char buf[MAX_ADDRESS_LENGTH];
+                format_address(&target.addr, buf);
+                fprintf(stderr, "(address %s:%d) ", buf, target.port);
+                perror("connect");
+            }
+            close(socket_fd);
+            errno = connect_errno;
+            return -1;
+
+        }
+
+        return socket_fd;
+
     }
 
-    return socket_fd;
+    return -1;
 
 }
 
-int add_socket(int epoll_fd, int client_port, in_addr_t addr, int *num_tracked_fds) {
+int add_socket(struct Scanner *scanner, struct Target target, enum Stage stage, bool retry) {
 
-    int socket_fd = connect_socket(client_port, addr);
+    bool skip_unreachable = scanner->config->skip_unreachable;
+    if(skip_unreachable && is_unreachable(&scanner->unreachable, &target.addr)) {
+        return 1;
+    }
+
+    int socket_fd = connect_socket(scanner->config, target);
     if(socket_fd == -1) {
+        if(skip_unreachable) {
+            record_probe_error(&scanner->unreachable, &target.addr, classify_connect_errno(errno));
+        }
         return 1;
     }
 
-    struct SocketState *state = malloc(sizeof(struct SocketState));
+    struct SocketState *state = arena_alloc(&scanner->states);
     if(state == NULL) {
         fprintf(stderr, "failed to allocate socket state\n");
         close(socket_fd);
@@ -140,224 +272,907 @@ int add_socket(int epoll_fd, int client_port, in_addr_t addr, int *num_tracked_f
     }
 
     state->fd = socket_fd;
-    state->addr = addr;
+    state->addr = target.addr;
+    state->port = target.port;
+    state->stage = stage;
     state->packet_buf = NULL;
     state->packet_bytes_read = 0;
     state->packet_length = 0;
+    state->packet_capacity = 0;
+    state->response_length = 0;
+    init_json_filter(&state->filter, &scanner->config->fields);
     state->payload_bytes_sent = 0;
+    state->status_complete = false;
+    state->connected = false;
+    state->retry = retry;
+    state->definite_failure = false;
+    state->started_ms = monotonic_ms();
+    state->pong_bytes_read = 0;
+
+    if(stage == STAGE_MODERN) {
+        state->payload = state->payload_buf;
+        state->payload_length = render_handshake(&scanner->handshake, &target.addr, target.port, state->payload_buf);
+    } else {
+        state->payload = legacy_ping_payload;
+        state->payload_length = sizeof(legacy_ping_payload);
+    }
 
     struct epoll_event event;
     event.events = EPOLLIN | EPOLLOUT;
     event.data.ptr = state;
-    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) == -1) {
+    if(epoll_ctl(scanner->epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) == -1) {
         perror("epoll_ctl");
         close(socket_fd);
-        free(state);
+        arena_free(state);
         return 1;
     }
 
-    (*num_tracked_fds)++;
-    addresses_searched++;
+    // The first deadline covers the TCP handshake, or the whole exchange when deadlines aren't adaptive
+    int timeout_ms = scanner->config->timeout_ms;
+    if(scanner->config->adaptive_timeout) {
+        timeout_ms = rtt_connect_timeout(&scanner->rtt, &target.addr, timeout_ms);
+    }
+    schedule_timer(&scanner->timers, &state->timer, state->started_ms + timeout_ms);
+
+    scanner->num_tracked_fds++;
+    prefix_probe_started(&scanner->limiter, &target.addr, state->started_ms);
+    if(stage == STAGE_MODERN && !retry) {
+        addresses_searched++;
+    }
     return 0;
 
 }
 
-void parse_packet(struct SocketState *state, sqlite3_stmt *stmt) {
+// Record a watched server's player counts from its status response
+void store_sample(struct Scanner *scanner, struct SocketState *state, const char *response, int length, int rtt_ms) {
+    struct WatchSample sample = {.addr = state->addr, .port = state->port, .rtt_ms = rtt_ms};
+    if(!parse_player_counts(response, length, &sample.online, &sample.max_players)) {
+        sample.online = -1;
+        sample.max_players = -1;
+    }
+    insert_sample(scanner->db, &sample);
+}
+
+/* Tell the target source how a probe ended, once any legacy retry is over. Failed probes of watched servers are
+ * stored too, so that gaps in a server's samples can be told apart from downtime. */
+void report_result(struct Scanner *scanner, struct Target target, bool found) {
 
-    char addr_str[32];
-    inet_ntop(AF_INET, &state->addr, addr_str, 32);
+    if(!found) {
+        scanner->probes_failed++;
+        if(scanner->watching) {
+            struct WatchSample sample = {.addr = target.addr, .port = target.port, .online = -1, .max_players = -1, .rtt_ms = -1};
+            insert_sample(scanner->db, &sample);
+        }
+    }
+
+    if(scanner->source->report != NULL) {
+        scanner->source->report(scanner->source, target, found);
+    }
+
+}
+
+/* Start probing a fresh target, or hold it in the deferred queue while its prefix is at its caps. Callers make sure
+ * the queue has room. */
+void start_probe(struct Scanner *scanner, struct Target target, uint64_t now) {
+    if(!prefix_has_room(&scanner->limiter, &target.addr, now)) {
+        push_target(&scanner->deferred, target);
+        return;
+    }
+    if(add_socket(scanner, target, STAGE_MODERN, false)) {
+        report_result(scanner, target, false);
+    }
+}
+
+bool parse_packet(struct Scanner *scanner, struct SocketState *state, int rtt_ms) {
+
+    // A favicon that was kept goes to the favicon store instead of being stored with the response
+    const char *favicon;
+    int favicon_length;
+    int response_length = split_favicon(&state->filter, state->packet_buf, state->response_length, &favicon, &favicon_length);
 
     // find opening brace
     int start_pos = 0;
-    while(start_pos < state->packet_length && state->packet_buf[start_pos] != '{') {
+    while(start_pos < response_length && state->packet_buf[start_pos] != '{') {
         start_pos++;
     }
 
-    int length = state->packet_length - start_pos;
+    int length = response_length - start_pos;
     if(length == 0) {
-        return;
+        return false;
     }
 
     servers_found++;
-    printf("found a server on %s; servers found: %d, addresses searched: %d\n", addr_str, servers_found, addresses_searched);
+    if(scanner->sample != NULL) {
+        record_sampled_server(scanner->sample, state->packet_buf + start_pos, length);
+    }
+    if(scanner->watching) {
+        store_sample(scanner, state, state->packet_buf + start_pos, length, rtt_ms);
+        return true;
+    }
+
+    char addr_str[MAX_ADDRESS_LENGTH];
+    format_address(&state->addr, addr_str);
+
+    if(rtt_ms >= 0) {
+        printf("found a server on %s:%d (%d ms); servers found: %d, addresses searched: %d\n", addr_str, state->port, rtt_ms, servers_found, addresses_searched);
+    } else {
+        printf("found a server on %s:%d; servers found: %d, addresses searched: %d\n", addr_str, state->port, servers_found, addresses_searched);
+    }
+
+    struct ServerRecord record = {
+        .addr = state->addr,
+        .port = state->port,
+        .edition = "java",
+        .response = state->packet_buf + start_pos,
+        .response_length = length,
+        .rtt_ms = rtt_ms,
+        .favicon = favicon,
+        .favicon_length = favicon_length
+    };
+    record.has_favicon = favicon_hash(&state->filter, &record.favicon_hash);
+    // A worker's results are stored by its coordinator, once the block they belong to is finished
+    if(scanner->config->worker_path != NULL) {
+        forward_lease_result(scanner->source, &record);
+    } else {
+        insert_server(scanner->db, &record);
+    }
+    return true;
+
+}
+
+bool parse_legacy_packet(struct Scanner *scanner, struct SocketState *state) {
+
+    char json[LEGACY_MAX_RESPONSE_SIZE * 4];
+    int length = parse_legacy_response((unsigned char *)state->packet_buf, state->packet_length, json, sizeof(json));
+    if(length == -1) {
+        return false;
+    }
+
+    servers_found++;
+    scanner->legacy_servers_found++;
+    if(scanner->sample != NULL) {
+        record_sampled_server(scanner->sample, json, length);
+    }
+    if(scanner->watching) {
+        store_sample(scanner, state, json, length, -1);
+        return true;
+    }
+
+    char addr_str[MAX_ADDRESS_LENGTH];
+    format_address(&state->addr, addr_str);
+
+    printf("found a legacy server on %s:%d; servers found: %d, addresses searched: %d\n", addr_str, state->port, servers_found, addresses_searched);
+
+    struct ServerRecord record = {
+        .addr = state->addr,
+        .port = state->port,
+        .edition = "legacy",
+        .response = json,
+        .response_length = length,
+        .rtt_ms = -1
+    };
+    // A worker's results are stored by its coordinator, once the block they belong to is finished
+    if(scanner->config->worker_path != NULL) {
+        forward_lease_result(scanner->source, &record);
+    } else {
+        insert_server(scanner->db, &record);
+    }
+    return true;
+
+}
+
+/* Make room for more of the filtered response: the first buffer is small when fields are being dropped, since most
+ * of a response is usually its favicon, and each one after that is the next size class up, until the whole packet
+ * fits. Over the memory budget, or out of memory altogether, the probe fails (and may be retried) instead. */
+bool grow_response_buffer(struct Scanner *scanner, struct SocketState *state) {
+
+    int capacity = state->packet_capacity * 4;
+    if(state->packet_buf == NULL) {
+        capacity = drops_fields(&scanner->config->fields) ? FIRST_RESPONSE_BUFFER : state->packet_length;
+    }
+    if(capacity > state->packet_length) {
+        capacity = state->packet_length;
+    }
+
+    char *grown;
+    if(!buffer_fits(&scanner->budget, capacity) || (grown = alloc_buffer(&scanner->buffers, capacity)) == NULL) {
+        return false;
+    }
+    if(state->packet_buf != NULL) {
+        memcpy(grown, state->packet_buf, state->response_length);
+        arena_free(state->packet_buf);
+    }
+    state->packet_buf = grown;
+    state->packet_capacity = capacity;
+    return true;
+
+}
+
+// Pass bytes of the packet body through the filter into the response buffer
+bool append_response(struct Scanner *scanner, struct SocketState *state, const char *data, int length) {
+
+    while(length > 0) {
+
+        // The filter can write out a member it was holding back on top of what it is given
+        int room = state->packet_capacity - state->response_length - state->filter.pending_length;
+        if(room <= 0) {
+            if(!grow_response_buffer(scanner, state)) {
+                return false;
+            }
+            continue;
+        }
+
+        int chunk_length = length < room ? length : room;
+        state->response_length += filter_json(&state->filter, data, chunk_length, state->packet_buf + state->response_length);
+        data += chunk_length;
+        length -= chunk_length;
+
+    }
+    return true;
+
+}
+
+enum ReadStatus read_response(struct Scanner *scanner, struct SocketState *state) {
+
+    if(state->packet_length == 0) {
+
+        // We assume that we will never need more than one read() call to read the entire packet length field
+        unsigned char packetlen_buf[5];
+        int bytes_read = read(state->fd, packetlen_buf, 5);
+        if(bytes_read != 5) {
+            return READ_FAILED;
+        }
+
+        // Packet length is encoded as a variable length integer where the MSB indicates whether there are more bits.
+        unsigned long packet_length = 0;
+        int pos = 0;
+        while(1) {
+
+            // VarInts are never longer than 5 bytes
+            if(pos == 5) {
+                return READ_FAILED;
+            }
+
+            unsigned char byte = packetlen_buf[pos];
+            packet_length |= (unsigned long)(byte & 0x7f) << (pos * 7);
+            pos++;
+
+            if((byte & 0x80) == 0) {
+                break;
+            }
+
+        }
+
+        // Reject packets of abnormal length
+        if(packet_length == 0 || packet_length > MAX_RESPONSE_SIZE || packet_length < (unsigned long)(5 - pos)) {
+            return READ_FAILED;
+        }
+        state->packet_length = packet_length;
+
+        // The earlier read() call probably read some bytes of the packet body along with the packet length field
+        state->packet_bytes_read += 5 - pos;
+        if(!append_response(scanner, state, (char *)packetlen_buf + pos, 5 - pos)) {
+            return READ_FAILED;
+        }
+
+    }
+
+    int remaining_bytes = state->packet_length - state->packet_bytes_read;
+    if(remaining_bytes == 0) {
+        return READ_COMPLETE;
+    }
+
+    char chunk[READ_CHUNK_SIZE];
+    int bytes_read = read(state->fd, chunk, remaining_bytes < READ_CHUNK_SIZE ? remaining_bytes : READ_CHUNK_SIZE);
+    if(bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return READ_MORE;
+    }
+    if(bytes_read <= 0) {
+        return READ_FAILED;
+    }
+    state->packet_bytes_read += bytes_read;
+    if(!append_response(scanner, state, chunk, bytes_read)) {
+        return READ_FAILED;
+    }
+
+    return state->packet_bytes_read == state->packet_length ? READ_COMPLETE : READ_MORE;
+
+}
+
+// Read the pong that answers pong_request; it must echo the payload exactly
+enum ReadStatus read_pong(struct SocketState *state) {
+
+    int bytes_read = read(state->fd, state->pong_buf + state->pong_bytes_read, sizeof(pong_request) - state->pong_bytes_read);
+    if(bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return READ_MORE;
+    }
+    if(bytes_read <= 0) {
+        return READ_FAILED;
+    }
+    state->pong_bytes_read += bytes_read;
+
+    if(state->pong_bytes_read < (int)sizeof(pong_request)) {
+        return READ_MORE;
+    }
+    return memcmp(state->pong_buf, pong_request, sizeof(pong_request)) == 0 ? READ_COMPLETE : READ_FAILED;
+
+}
+
+enum ReadStatus read_legacy_response(struct Scanner *scanner, struct SocketState *state) {
+
+    // Read the 3-byte header first to learn the length, then the UTF-16 string
+    if(state->packet_buf == NULL) {
+        if(!buffer_fits(&scanner->budget, LEGACY_MAX_RESPONSE_SIZE) || (state->packet_buf = alloc_buffer(&scanner->buffers, LEGACY_MAX_RESPONSE_SIZE)) == NULL) {
+            return READ_FAILED;
+        }
+        state->packet_length = 3;
+    }
+
+    int remaining_bytes = state->packet_length - state->packet_bytes_read;
+    int bytes_read = read(state->fd, state->packet_buf + state->packet_bytes_read, remaining_bytes);
+    if(bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return READ_MORE;
+    }
+    if(bytes_read <= 0) {
+        return READ_FAILED;
+    }
+    state->packet_bytes_read += bytes_read;
+
+    if(state->packet_bytes_read == 3 && state->packet_length == 3) {
+        state->packet_length = legacy_response_length((unsigned char *)state->packet_buf);
+        if(state->packet_length == -1) {
+            return READ_FAILED;
+        }
+    }
+
+    return state->packet_bytes_read == state->packet_length ? READ_COMPLETE : READ_MORE;
+
+}
+
+// Print process and kernel socket memory usage, used to verify that memory stays flat under load
+void print_memory_stats(int num_tracked_fds) {
+
+    long rss_pages = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if(fp != NULL) {
+        if(fscanf(fp, "%*s %ld", &rss_pages) != 1) {
+            rss_pages = 0;
+        }
+        fclose(fp);
+    }
 
-    // FIXME: Check bind calls for errors
-    sqlite3_bind_text(stmt, 1, addr_str,  -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int(stmt, 2, time(NULL));
-    sqlite3_bind_text(stmt, 3, state->packet_buf + start_pos, length, SQLITE_TRANSIENT);
-    int result = sqlite3_step(stmt);
-    if(result != SQLITE_DONE) {
-        fprintf(stderr, "failed to insert result for %s: %s\n", addr_str, sqlite3_errstr(result));
+    // "TCP: inuse N orphan N tw N alloc N mem N", where mem is in pages
+    long inuse = 0, orphan = 0, tw = 0, alloc = 0, mem_pages = 0;
+    fp = fopen("/proc/net/sockstat", "r");
+    if(fp != NULL) {
+        char line[256];
+        while(fgets(line, sizeof(line), fp)) {
+            if(sscanf(line, "TCP: inuse %ld orphan %ld tw %ld alloc %ld mem %ld", &inuse, &orphan, &tw, &alloc, &mem_pages) == 5) {
+                break;
+            }
+        }
+        fclose(fp);
     }
 
-    sqlite3_reset(stmt);
+    long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    printf("sockets: %d, addresses searched: %d, rss: %ld KiB, kernel tcp: inuse %ld, tw %ld, orphan %ld, mem %ld KiB\n", num_tracked_fds, addresses_searched, rss_pages * page_kb, inuse, tw, orphan, mem_pages * page_kb);
 
 }
 
-void close_socket(struct SocketState *state, int *num_tracked_fds) {
+// Report how the connection state and buffer arenas ended up backed
+void print_arena_usage(struct Scanner *scanner) {
+    long hugetlb = scanner->states.hugetlb_chunks, thp = scanner->states.thp_chunks, small = scanner->states.small_chunks;
+    long mapped = scanner->states.chunks_mapped;
+    for(int i = 0; i < BUFFER_CLASSES; i++) {
+        hugetlb += scanner->buffers.classes[i].hugetlb_chunks;
+        thp += scanner->buffers.classes[i].thp_chunks;
+        small += scanner->buffers.classes[i].small_chunks;
+        mapped += scanner->buffers.classes[i].chunks_mapped;
+    }
+    printf("arenas: %ld chunks of 2 MiB mapped (%ld hugetlb, %ld transparent huge page, %ld regular), %ld MiB still mapped\n", hugetlb + thp + small, hugetlb, thp, small, mapped * 2);
+}
+
+// Raise the open file limit so that the configured number of sockets can actually be opened, lowering the socket count if it can't be
+void raise_fd_limit(int *max_sockets) {
+
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        perror("getrlimit");
+        return;
+    }
+
+    rlim_t wanted = *max_sockets + 64;
+    if(limit.rlim_cur >= wanted) {
+        return;
+    }
+
+    limit.rlim_cur = wanted < limit.rlim_max ? wanted : limit.rlim_max;
+    if(setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        perror("setrlimit");
+    }
+
+    if(limit.rlim_cur < wanted) {
+        fprintf(stderr, "warning: open file limit is %ld, reducing max sockets from %d\n", (long)limit.rlim_cur, *max_sockets);
+        *max_sockets = limit.rlim_cur > 64 ? limit.rlim_cur - 64 : 1;
+    }
+
+}
+
+void close_socket(struct Scanner *scanner, struct SocketState *state) {
+    cancel_timer(&state->timer);
     close(state->fd);
-    (*num_tracked_fds)--;
-    free(state->packet_buf);
-    free(state);
+    scanner->num_tracked_fds--;
+    scanner->budget.connections++;
+    prefix_probe_finished(&scanner->limiter, &state->addr);
+    arena_free(state->packet_buf);
+    arena_free(state);
+}
+
+/* Whether a failed probe looks like packet loss rather than an answer: the target stayed silent, or dropped the
+ * connection before sending anything. Each target is retried at most once. */
+bool is_transient_failure(struct Scanner *scanner, struct SocketState *state) {
+    if(!scanner->config->retry || state->retry || state->stage != STAGE_MODERN || state->definite_failure || state->packet_bytes_read > 0) {
+        return false;
+    }
+
+    // A handshake that never completed looks just like a dead host, so it is only retried when targets are expected to be live
+    return state->connected || scanner->config->retry_silent;
+}
+
+/* Close a connection. Hosts that accepted the connection but gave no usable answer to the modern ping are queued for
+ * the legacy ping, which is sent from the same event loop as new targets. A failure that looks like packet loss gets
+ * the modern ping again first, and only falls back to the legacy ping if the retry fails too. */
+void finish_socket(struct Scanner *scanner, struct SocketState *state, bool usable) {
+
+    // A status response that arrived without its pong is still stored, just without an RTT
+    if(!usable && state->status_complete) {
+        usable = parse_packet(scanner, state, -1);
+    }
+
+    if(state->payload_bytes_sent > 0 && scanner->config->skip_unreachable) {
+        record_reachable(&scanner->unreachable, &state->addr);
+    }
+
+    struct Target target = {.addr = state->addr, .port = state->port};
+    bool retrying = false;
+    if(!usable && is_transient_failure(scanner, state)) {
+        retrying = schedule_retry(&scanner->retries, target, monotonic_ms());
+    }
+    if(!retrying && !usable && state->stage == STAGE_MODERN && state->payload_bytes_sent > 0 && scanner->config->legacy) {
+        retrying = push_target(&scanner->legacy_queue, target);
+    }
+    if(usable && state->retry) {
+        scanner->retries.hits++;
+    }
+    if(!retrying) {
+        report_result(scanner, target, usable);
+    }
+    close_socket(scanner, state);
+}
+
+/* Whether the handshake needed a retransmission, going by the kernel's count or, if that can't be read, by a connect
+ * time past the initial retransmission timeout */
+bool handshake_retransmitted(int fd, int rtt_ms) {
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+    if(getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) == 0 && length >= offsetof(struct tcp_info, tcpi_total_retrans) + sizeof(info.tcpi_total_retrans)) {
+        return info.tcpi_total_retrans > 0;
+    }
+    return rtt_ms >= TCP_INITIAL_RTO_MS;
+}
+
+// The handshake completed: sample the connect time and give the rest of the exchange its own deadline
+void socket_connected(struct Scanner *scanner, struct SocketState *state) {
+
+    state->connected = true;
+    record_incoming_cpu(scanner->locality, state->fd);
+    if(!scanner->config->adaptive_timeout) {
+        return;
+    }
+
+    uint64_t now = monotonic_ms();
+    int rtt_ms = now - state->started_ms;
+
+    // Karn's rule: after a retransmitted SYN there is no telling which one was answered, so the time is no sample
+    if(!handshake_retransmitted(state->fd, rtt_ms)) {
+        record_rtt(&scanner->rtt, &state->addr, rtt_ms);
+    }
+    cancel_timer(&state->timer);
+    schedule_timer(&scanner->timers, &state->timer, now + rtt_read_timeout(&scanner->rtt, &state->addr, rtt_ms, scanner->config->timeout_ms));
+
 }
 
-int main(void) {
+void handle_event(struct Scanner *scanner, struct SocketState *state, uint32_t events) {
+
+    // If an error occurred, note any ICMP unreachable behind it and remove the socket
+    if(events & EPOLLERR) {
+        enum ProbeError error = classify_socket_error(state->fd);
+        if(scanner->config->skip_unreachable) {
+            record_probe_error(&scanner->unreachable, &state->addr, error);
+        }
+
+        // Refusals and unreachables are answers; only silence and resets are worth a retry
+        state->definite_failure = error != PROBE_ERROR_OTHER;
+        finish_socket(scanner, state, false);
+        return;
+    }
+
+    // If socket is writable, check if there is data to be written
+    if(events & EPOLLOUT) {
+        if(!state->connected) {
+            socket_connected(scanner, state);
+        }
+        if(state->payload_bytes_sent < state->payload_length) {
+            int bytes_written = write(state->fd, state->payload + state->payload_bytes_sent, state->payload_length - state->payload_bytes_sent);
+            if(bytes_written == -1) {
+                if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                    finish_socket(scanner, state, false);
+                }
+                return;
+            }
+            state->payload_bytes_sent += bytes_written;
+            if(state->payload_bytes_sent == state->payload_length) {
+                state->payload_sent_ms = monotonic_ms();
+            }
+        }
+    }
+
+    // Read data if socket is readable
+    if(events & EPOLLIN) {
+
+        enum ReadStatus status;
+        if(state->status_complete) {
+            status = read_pong(state);
+        } else {
+            status = state->stage == STAGE_MODERN ? read_response(scanner, state) : read_legacy_response(scanner, state);
+
+            // With RTT measurement on, the pong is pipelined behind the status response and may already be readable
+            if(status == READ_COMPLETE && state->stage == STAGE_MODERN && scanner->config->rtt) {
+                state->status_complete = true;
+                status = read_pong(state);
+            }
+        }
+
+        if(status == READ_FAILED) {
+            finish_socket(scanner, state, false);
+            return;
+        }
+
+        if(status == READ_COMPLETE) {
+            bool usable;
+            if(state->status_complete) {
+                usable = parse_packet(scanner, state, monotonic_ms() - state->payload_sent_ms);
+                state->status_complete = false;
+            } else {
+                usable = state->stage == STAGE_MODERN ? parse_packet(scanner, state, -1) : parse_legacy_packet(scanner, state);
+            }
+            finish_socket(scanner, state, usable);
+            return;
+        }
+
+    }
+
+    // If the server closed the connection, remove the socket
+    if(events & EPOLLHUP) {
+        finish_socket(scanner, state, false);
+    }
+
+}
+
+int main(int argc, char **argv) {
+
+    struct Config config;
+    if(parse_args(&config, argc, argv)) {
+        return 1;
+    }
+
+    // Pin before anything sizeable is allocated, so that it all lands on the pinned CPU's node
+    struct CpuLocality locality;
+    if(pin_to_cpu(&locality, config.cpu)) {
+        return 1;
+    }
+
+    raise_fd_limit(&config.max_sockets);
 
     // print info about compiled settings
-    printf("EPOLL_MAX_EVENTS=%d, MAX_RESPONSE_SIZE=%d, MAX_SOCKETS=%d, CLIENT_PORT=%d\n", EPOLL_MAX_EVENTS, MAX_RESPONSE_SIZE, MAX_SOCKETS, CLIENT_PORT);
+    printf("EPOLL_MAX_EVENTS=%d, MAX_RESPONSE_SIZE=%d, max sockets=%d%s\n", EPOLL_MAX_EVENTS, MAX_RESPONSE_SIZE, config.max_sockets, config.lean ? " (lean profile)" : "");
+    printf("target ports: %d, source addresses: %d IPv4 + %d IPv6, source ports: %d-%d (%s)\n", config.num_ports, config.source_pool.num_addrs4, config.source_pool.num_addrs6, config.source_pool.port_min, config.source_pool.port_max, config.source_pool.by_hash ? "hashed" : "round-robin");
 
-    sqlite3 *db;
-    sqlite3_stmt *stmt;
-    if(setup_db(&db, &stmt)) {
+    struct Database db;
+    if(setup_db(&db)) {
         return 1;
     }
 
+    // A coordinator doesn't scan anything itself; it hands out blocks to workers and stores what they find
+    if(config.coordinator_path != NULL) {
+        int result = run_coordinator(&config, &db);
+        close_db(&db);
+        return result;
+    }
+    if(config.worker_path == NULL) {
+        printf("writing results as scan generation %d\n", db.generation);
+    }
+
     // Create epoll
     int epoll_fd = epoll_create1(0);
     if(epoll_fd == -1) {
         perror("epoll_create1");
-        sqlite3_close(db);
+        close_db(&db);
         return 1;
     }
 
     struct epoll_event *events = malloc(EPOLL_MAX_EVENTS * sizeof(struct epoll_event));
 
     // Keep track of how many sockets are currently watched
-    int num_tracked_fds = 0;
+    struct Scanner scanner;
+    scanner.config = &config;
+    scanner.db = &db;
+    scanner.epoll_fd = epoll_fd;
+    scanner.num_tracked_fds = 0;
+    scanner.locality = &locality;
+    init_arena(&scanner.states, sizeof(struct SocketState), config.huge_pages);
+    init_buffer_arenas(&scanner.buffers, config.huge_pages);
+
+    if(init_handshake(&scanner.handshake, config.protocol, config.hostname, config.rtt)) {
+        return 1;
+    }
+
+    scanner.legacy_servers_found = 0;
+    init_timer_wheel(&scanner.timers, monotonic_ms());
+    if(init_unreachable_cache(&scanner.unreachable) || init_rtt_table(&scanner.rtt)) {
+        return 1;
+    }
+    if(init_prefix_limiter(&scanner.limiter, config.prefix_max_sockets, config.prefix_rate) || init_addr_queue(&scanner.deferred, DEFERRED_QUEUE_SIZE)) {
+        return 1;
+    }
+    if(init_retry_queue(&scanner.retries, RETRY_QUEUE_SIZE, RETRY_DELAY_MS, monotonic_ms())) {
+        return 1;
+    }
+    if(init_addr_queue(&scanner.legacy_queue, LEGACY_QUEUE_SIZE)) {
+        return 1;
+    }
+    time_t last_stats_time = 0;
+    time_t last_summary_time = time(NULL);
+
+    struct ExcludeList exclude;
+    if(load_exclude_list(&exclude, config.exclude_path)) {
+        return 1;
+    }
+    enable_exclude_reload(&exclude);
 
     struct AddressGenerator addr_gen;
-    if(init_addrgen(&addr_gen)) {
+    if(init_addrgen(&addr_gen, &exclude, config.ports, config.num_ports)) {
         return 1;
     }
 
-    do {
+    // Rank ports by how many servers earlier scans found on them and scan them one pass at a time, best first
+    struct PortPriority port_priority = {0};
+    if(config.learn_ports) {
 
-        // Open new sockets as necessary
-        for(int i = num_tracked_fds; i < MAX_SOCKETS; i++) {
-            in_addr_t addr = next_address(&addr_gen);
-            if(addr == 0) {
-                break;
-            }
-            if(add_socket(epoll_fd, CLIENT_PORT, addr, &num_tracked_fds)) {
-                continue;
-            }
+        const uint16_t *candidates = config.ports_given ? config.ports : NULL;
+        if(learn_port_priority(&port_priority, db.db, config.bedrock, candidates, config.ports_given ? config.num_ports : 0, config.learn_per_prefix)) {
+            return 1;
+        }
+        if(port_priority.num_ports == 0) {
+            fprintf(stderr, "no earlier results in scan.db to learn ports from; pass --ports as well\n");
+            return 1;
         }
 
-        // Wait for events to arrive
-        int num_events = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, -1);
-        if(num_events == -1) {
-            perror("epoll_wait");
-            sqlite3_close(db);
+        int passes = port_priority.num_ports;
+        if(config.top_ports > 0 && config.top_ports < passes) {
+            passes = config.top_ports;
+        }
+        set_port_priority(&addr_gen, &port_priority, passes);
+
+        printf("learned port order (%d passes, %d /16s with their own ranking):", passes, port_priority.num_prefixes);
+        for(int i = 0; i < port_priority.num_ports && i < 10; i++) {
+            printf(" %d", port_priority.ports[i]);
+        }
+        printf("%s\n", port_priority.num_ports > 10 ? " ..." : "");
+
+    }
+
+    // With --sample, the targets come from the start of the usual permutation and the results are tallied for estimates
+    struct SampleStats sample_stats;
+    scanner.sample = NULL;
+    if(config.sample_fraction > 0) {
+        uint64_t population = (((uint64_t)1 << 32) - count_excluded_ipv4(&exclude)) * config.num_ports;
+        if(init_sample_stats(&sample_stats, population)) {
             return 1;
         }
+        scanner.sample = &sample_stats;
+    }
 
-        for(int i = 0; i < num_events; i++) {
+    struct TargetSource *source;
+    if(config.cidr_path != NULL) {
+        source = open_cidr_source(config.cidr_path, &exclude, config.ports, config.num_ports);
+    } else if(config.ip_path != NULL) {
+        source = open_ip_file_source(config.ip_path, &exclude, config.ports, config.num_ports);
+    } else if(config.rescan) {
+        source = open_rescan_source(&db, &exclude, config.bedrock, config.ports_given ? config.ports : NULL, config.num_ports, config.seen_within, config.older_than);
+    } else if(config.watch_path != NULL) {
+        source = open_watchlist(config.watch_path, &exclude, config.ports[0], config.watch_interval);
+    } else if(config.from_stdin) {
+        source = open_stream_source(STDIN_FILENO, &exclude, config.ports, config.num_ports);
+    } else if(config.worker_path != NULL) {
+        source = open_lease_source(config.worker_path, &addr_gen, config.ports, config.num_ports);
+    } else if(scanner.sample != NULL) {
+        source = open_sample_source(&addr_gen, &sample_stats, ceil(sample_stats.population * config.sample_fraction));
+    } else if(config.density) {
+        source = open_density_source(&db, &exclude, &addr_gen, config.ports, config.num_ports, config.density_prefix, config.explore_fraction);
+    } else {
+        source = open_generator_source(&addr_gen);
+    }
+    if(source == NULL) {
+        return 1;
+    }
+
+    scanner.source = source;
+    scanner.watching = config.watch_path != NULL;
+    scanner.probes_failed = 0;
+
+    if(config.bedrock) {
+        int result = run_bedrock_scan(&config, source, &db, epoll_fd);
+        close_target_source(source);
+        close(epoll_fd);
+        close_db(&db);
+        return result;
+    }
 
-            struct epoll_event *event = &events[i];
-            struct SocketState *state = event->data.ptr;
+    init_memory_budget(&scanner.budget, (size_t)config.memory_limit_mib << 20, &scanner.states, &scanner.buffers);
 
-            // If an error occurred or the server closed the connection, remove the socket
-            if(event->events & EPOLLERR) {
-                close_socket(state, &num_tracked_fds);
+    struct Target batch[TARGET_BATCH_SIZE];
+    bool sourcing = true;
+    uint64_t scan_start = monotonic_ms();
+    do {
+
+        poll_exclude_reload();
+
+        // Near the memory budget, no new connections are opened until enough responses have drained
+        int open_limit = scanner.num_tracked_fds + connection_allowance(&scanner.budget, scanner.num_tracked_fds, config.max_sockets - scanner.num_tracked_fds);
+
+        // Give each deferred target one chance per round to start, in the order they were deferred
+        uint64_t now_ms = monotonic_ms();
+        for(int pending = scanner.deferred.count; pending > 0 && scanner.num_tracked_fds < open_limit; pending--) {
+            struct Target target;
+            pop_target(&scanner.deferred, &target);
+
+            // The blocklist may have been reloaded since the target was deferred
+            if(should_exclude_address(&exclude, &target.addr)) {
+                report_result(&scanner, target, false);
                 continue;
             }
+            start_probe(&scanner, target, now_ms);
+        }
 
-            // If socket is writable, check if there is data to be written
-            if(event->events & EPOLLOUT) {
-                if(state->payload_bytes_sent < sizeof(ping_payload)) {
-                    int bytes_written = write(state->fd, ping_payload + state->payload_bytes_sent, sizeof(ping_payload) - state->payload_bytes_sent);
-                    if(bytes_written == -1) {
-                        if(errno != EAGAIN && errno != EWOULDBLOCK) {
-                            close_socket(state, &num_tracked_fds);
-                        }
-                        continue;
-                    }
-                    state->payload_bytes_sent += bytes_written;
+        // Open new sockets as necessary, giving legacy retries priority over fresh addresses
+        while(scanner.num_tracked_fds < open_limit) {
+            struct Target target;
+            if(pop_target(&scanner.legacy_queue, &target)) {
+                // The blocklist may have been reloaded since the host was queued
+                if(should_exclude_address(&exclude, &target.addr) || add_socket(&scanner, target, STAGE_LEGACY, false)) {
+                    report_result(&scanner, target, false);
                 }
+                continue;
             }
 
-            // Read data if socket is readable
-            if(event->events & EPOLLIN) {
-
-                if(state->packet_buf == NULL) {
-
-                    // We assume that we will never need more than one read() call to read the entire packet length field
-                    unsigned char packetlen_buf[5];
-                    int bytes_read = read(state->fd, packetlen_buf, 5);
-                    if(bytes_read != 5) {
-                        close_socket(state, &num_tracked_fds);
-                        continue;
-                    }
-
-                    // Packet length is encoded as a variable length integer where the MSB indicates whether there are more bits.
-                    unsigned long packet_length = 0;
-                    int pos = 0;
-                    while(1) {
-
-                        unsigned char byte = packetlen_buf[pos];
-                        packet_length |= (byte & 0x7f) << (pos * 7);
-                        pos++;
-
-                        if((byte & 0x80) == 0) {
-                            break;
-                        }
-
-                        // VarInts are never longer than 5 bytes
-                        if(pos > 5) {
-                            close_socket(state, &num_tracked_fds);
-                            continue;
-                        }
-
-                    }
-
-                    // Reject packets of abnormal length
-                    if(packet_length == 0 || packet_length > MAX_RESPONSE_SIZE) {
-                        close_socket(state, &num_tracked_fds);
-                        continue;
-                    }
-
-                    state->packet_length = packet_length;
-                    state->packet_buf = malloc(packet_length);
-                    if(state->packet_buf == NULL) {
-                        fprintf(stderr, "failed to allocate response buffer\n");
-                        return 1; // OOM
-                    }
-
-                    // The earlier read() call probably read some bytes of the packet body along with the packet length field, copy these to the packet buffer
-                    for(int i = pos; i < 5; i++) {
-                        state->packet_buf[i - pos] = packetlen_buf[i];
-                    }
-                    state->packet_bytes_read += 5 - pos;
-
+            // Then retries whose delay is over, as long as their prefix has room and they haven't been blocklisted since
+            const struct Target *retry = due_retry(&scanner.retries, now_ms);
+            if(retry != NULL && prefix_has_room(&scanner.limiter, &retry->addr, now_ms)) {
+                struct Target target = *retry;
+                pop_retry(&scanner.retries);
+                if(should_exclude_address(&exclude, &target.addr) || add_socket(&scanner, target, STAGE_MODERN, true)) {
+                    report_result(&scanner, target, false);
                 }
+                continue;
+            }
 
-                int remaining_bytes = state->packet_length - state->packet_bytes_read;
-                int bytes_read = read(state->fd, state->packet_buf + state->packet_bytes_read, remaining_bytes);
-                if(bytes_read == -1) {
-                    close_socket(state, &num_tracked_fds);
-                    continue;
-                }
-                state->packet_bytes_read += bytes_read;
+            if(source->finished || budget_exhausted(&config, addresses_searched, monotonic_ms() - scan_start)) {
+                sourcing = false;
+                break;
+            }
 
-                if(state->packet_bytes_read == state->packet_length) {
-                    parse_packet(state, stmt);
-                    close_socket(state, &num_tracked_fds);
-                    continue;
-                }
+            // Pull no more targets than there are free sockets or room to defer them, and no more than the probe budget
+            // allows once the deferred ones are counted
+            int wanted = open_limit - scanner.num_tracked_fds;
+            if(wanted > TARGET_BATCH_SIZE) {
+                wanted = TARGET_BATCH_SIZE;
+            }
+            if(wanted > scanner.deferred.capacity - scanner.deferred.count) {
+                wanted = scanner.deferred.capacity - scanner.deferred.count;
+            }
+            if(config.max_probes > 0 && config.max_probes - addresses_searched - scanner.deferred.count < wanted) {
+                wanted = config.max_probes - addresses_searched - scanner.deferred.count;
+            }
+            if(wanted <= 0) {
+                break;
+            }
 
+            // A streaming source with no input ready yields nothing; try again after the next round of events
+            int count = source->next_batch(source, batch, wanted);
+            if(count == 0) {
+                break;
             }
+            now_ms = monotonic_ms();
+            int already_deferred = scanner.deferred.count;
+            for(int i = 0; i < count; i++) {
+                start_probe(&scanner, batch[i], now_ms);
+            }
+            scanner.limiter.deferred += scanner.deferred.count - already_deferred;
+        }
 
-            if(event->events & EPOLLHUP) {
-                close_socket(state, &num_tracked_fds);
+        // Wait for events to arrive; wake up every timer tick to expire deadlines
+        int num_events = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, TIMER_RESOLUTION_MS);
+        if(num_events == -1) {
+            if(errno == EINTR) {
+                continue;
             }
+            perror("epoll_wait");
+            close_db(&db);
+            return 1;
+        }
+
+        if(scanner.watching && time(NULL) - last_summary_time >= WATCH_SUMMARY_INTERVAL_S) {
+            last_summary_time = time(NULL);
+            printf("samples: %d ok, %ld failed; sockets: %d\n", servers_found, scanner.probes_failed, scanner.num_tracked_fds);
+            fflush(stdout);
+        }
+
+        if(config.print_stats && time(NULL) != last_stats_time) {
+            last_stats_time = time(NULL);
+            print_memory_stats(scanner.num_tracked_fds);
+        }
 
+        for(int i = 0; i < num_events; i++) {
+            handle_event(&scanner, events[i].data.ptr, events[i].events);
         }
 
-    } while(num_tracked_fds > 0);
+        // Give up on connections that have run past their deadline
+        uint64_t now = monotonic_ms();
+        struct TimerEntry *expired;
+        while((expired = expire_timer(&scanner.timers, now)) != NULL) {
+            finish_socket(&scanner, (struct SocketState *)expired, false);
+        }
+
+    } while(sourcing || scanner.num_tracked_fds > 0 || scanner.legacy_queue.count > 0 || scanner.deferred.count > 0 || scanner.retries.count > 0);
+
+    printf("scan finished; servers found: %d (%d legacy), addresses searched: %d, source collisions: %ld, legacy retries dropped: %ld\n", servers_found, scanner.legacy_servers_found, addresses_searched, config.source_pool.collisions, scanner.legacy_queue.dropped);
+    if(config.retry) {
+        printf("retries: %ld scheduled, %ld found a server, %ld dropped\n", scanner.retries.scheduled, scanner.retries.hits, scanner.retries.dropped);
+    }
+    printf("prefix limits: %d sockets and %d new probes per second per prefix; deferrals: %ld\n", config.prefix_max_sockets, config.prefix_rate, scanner.limiter.deferred);
+    if(config.adaptive_timeout) {
+        printf("adaptive deadlines: %ld prefixes with an RTT estimate\n", scanner.rtt.num_estimated);
+    }
+    if(config.skip_unreachable) {
+        long *reports = scanner.unreachable.reports;
+        printf("unreachable reports: %ld network, %ld host, %ld prohibited; targets skipped in unreachable prefixes: %ld\n", reports[PROBE_ERROR_NET], reports[PROBE_ERROR_HOST], reports[PROBE_ERROR_ADMIN], scanner.unreachable.skipped);
+    }
+    print_cpu_locality(&locality);
+    print_arena_usage(&scanner);
+    print_memory_budget(&scanner.budget);
+    if(!scanner.watching) {
+        print_favicon_store(&db.favicons);
+    }
 
+    close_target_source(source);
+    if(scanner.sample != NULL) {
+        print_sample_report(scanner.sample);
+        free_sample_stats(scanner.sample);
+    }
+    free_addr_queue(&scanner.legacy_queue);
+    free_unreachable_cache(&scanner.unreachable);
+    free_rtt_table(&scanner.rtt);
+    free_prefix_limiter(&scanner.limiter);
+    free_addr_queue(&scanner.deferred);
+    free_retry_queue(&scanner.retries);
+    free_port_priority(&port_priority);
+    free_cpu_locality(&locality);
+    free_arena(&scanner.states);
+    free_buffer_arenas(&scanner.buffers);
+    free(events);
     close(epoll_fd);
-    sqlite3_finalize(stmt);
-    sqlite3_close(db);
+    close_db(&db);
 
     return 0;
 
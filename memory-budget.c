@@ -0,0 +1,134 @@
+#include "memory-budget.h"
+#include "sqlite/sqlite3.h"
+#include <malloc.h>
+#include <stdio.h>
+
+#define MIB ((size_t)1 << 20)
+
+void init_memory_budget(struct MemoryBudget *budget, size_t limit, const struct Arena *states, const struct BufferArenas *buffers) {
+
+    budget->limit = limit;
+    budget->states = states;
+    budget->buffers = buffers;
+    budget->heap = 0;
+    budget->peak = 0;
+    budget->connections = 0;
+    budget->buffer_bytes = 0;
+    budget->paused = false;
+    budget->pauses = 0;
+    budget->buffers_refused = 0;
+    if(limit == 0) {
+        return;
+    }
+
+    // sqlite's cache would otherwise grow with the database; past its share it recycles pages instead
+    sqlite3_soft_heap_limit64(limit / 100 * BUDGET_SQLITE_PERCENT);
+
+    size_t usage = measure_memory(budget);
+    printf("memory budget: %lu MiB, %lu MiB in use before scanning\n", (unsigned long)(limit / MIB), (unsigned long)(usage / MIB));
+    if(usage >= limit / 100 * BUDGET_PAUSE_PERCENT) {
+        fprintf(stderr, "warning: fixed tables nearly fill the memory budget; new connections will wait until none are open\n");
+    }
+
+}
+
+// Arenas are charged for the chunks they have mapped, since a chunk stays resident until all of its slots are free
+static size_t arena_usage(const struct Arena *arena) {
+    return arena->chunks_mapped * ARENA_CHUNK_SIZE;
+}
+
+// Bytes of the mapped buffer chunks that no buffer is using, which new buffers can come from before more is mapped
+static size_t spare_buffer_space(const struct MemoryBudget *budget) {
+    size_t spare = 0;
+    for(int i = 0; i < BUFFER_CLASSES; i++) {
+        const struct Arena *arena = &budget->buffers->classes[i];
+        spare += arena_usage(arena) - arena->slots_in_use * arena->slot_size;
+    }
+    return spare;
+}
+
+static size_t arenas_usage(const struct MemoryBudget *budget) {
+    size_t usage = arena_usage(budget->states);
+    for(int i = 0; i < BUFFER_CLASSES; i++) {
+        usage += arena_usage(&budget->buffers->classes[i]);
+    }
+    return usage;
+}
+
+static size_t buffer_per_connection(const struct MemoryBudget *budget) {
+    size_t bytes = (budget->buffer_bytes + (size_t)BUDGET_PRIOR_BUFFER * BUDGET_PRIOR_CONNECTIONS) / (budget->connections + BUDGET_PRIOR_CONNECTIONS);
+    return bytes > 0 ? bytes : 1;
+}
+
+// Total usage, refreshing the heap figure; this walks malloc's bookkeeping, so it is done once per event loop round
+size_t measure_memory(struct MemoryBudget *budget) {
+    struct mallinfo2 info = mallinfo2();
+    budget->heap = info.uordblks + info.hblkhd;
+    size_t usage = budget->heap + arenas_usage(budget);
+    if(usage > budget->peak) {
+        budget->peak = usage;
+    }
+    return usage;
+}
+
+/* How many new connections may be opened this round, at most max_new: as many as the projected usage leaves room for
+ * below the pause threshold. Once paused, admission resumes only below the lower threshold, so that it doesn't flap on
+ * every freed buffer. With nothing in flight there is nothing left to drain, so one connection is always let through
+ * rather than stalling the scan. */
+int connection_allowance(struct MemoryBudget *budget, int num_open, int max_new) {
+
+    if(budget->limit == 0) {
+        return max_new;
+    }
+
+    long buffers_in_use = 0;
+    for(int i = 0; i < BUFFER_CLASSES; i++) {
+        buffers_in_use += budget->buffers->classes[i].slots_in_use;
+    }
+    size_t per_connection = buffer_per_connection(budget);
+    size_t projected = measure_memory(budget);
+    size_t spare = spare_buffer_space(budget);
+    size_t wanted = num_open > buffers_in_use ? (num_open - buffers_in_use) * per_connection : 0;
+    if(wanted > spare) {
+        projected += wanted - spare;
+    }
+
+    size_t pause_at = budget->limit / 100 * BUDGET_PAUSE_PERCENT;
+    if(budget->paused && projected >= budget->limit / 100 * BUDGET_RESUME_PERCENT && num_open > 0) {
+        return 0;
+    }
+
+    size_t allowance = projected < pause_at ? (pause_at - projected) / per_connection : 0;
+    if(allowance == 0) {
+        if(!budget->paused) {
+            budget->pauses++;
+        }
+        budget->paused = true;
+        return num_open == 0 && max_new > 0 ? 1 : 0;
+    }
+    budget->paused = false;
+    return allowance < (size_t)max_new ? (int)allowance : max_new;
+
+}
+
+/* Whether a response buffer of this size can be allocated without going over the limit: it is free if its size class
+ * has a slot to spare, and otherwise costs a whole chunk. Refused buffers count towards the average too, since the
+ * estimate is of what connections ask for. */
+bool buffer_fits(struct MemoryBudget *budget, size_t size) {
+    budget->buffer_bytes += size;
+    const struct Arena *arena = buffer_class(budget->buffers, size);
+    size_t cost = arena != NULL && arena_has_free_slot(arena) ? 0 : ARENA_CHUNK_SIZE;
+    if(budget->limit == 0 || budget->heap + arenas_usage(budget) + cost <= budget->limit) {
+        return true;
+    }
+    budget->buffers_refused++;
+    return false;
+}
+
+void print_memory_budget(const struct MemoryBudget *budget) {
+    if(budget->limit == 0) {
+        return;
+    }
+    printf("memory budget: %lu MiB, peak usage %lu MiB; admission paused %ld times, %ld responses refused\n",
+        (unsigned long)(budget->limit / MIB), (unsigned long)(budget->peak / MIB), budget->pauses, budget->buffers_refused);
+}
@@ -0,0 +1,44 @@
+#ifndef __MEMORY_BUDGET_H
+#define __MEMORY_BUDGET_H
+
+#include "arena.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// New connections stop when usage reaches the first share of the budget, and start again below the second
+#define BUDGET_PAUSE_PERCENT 90
+#define BUDGET_RESUME_PERCENT 80
+
+// Until enough connections have been seen, each is assumed to need this much buffer space, as if this many had
+#define BUDGET_PRIOR_BUFFER 4096
+#define BUDGET_PRIOR_CONNECTIONS 256
+
+// Share of the budget that sqlite's page cache is allowed to grow to
+#define BUDGET_SQLITE_PERCENT 10
+
+/* Memory the scanner is allowed to use, and what it is currently using: the heap (tables, queues and sqlite, which all
+ * allocate through malloc) plus the slots in use in the connection state and response buffer arenas. Admission control
+ * keeps usage under the limit instead of letting a burst of large responses get the process killed. Open connections
+ * that have no response buffer yet are charged the average buffer space asked for per closed connection, since that
+ * is what they are likely to need. New connections pause near the limit and resume once responses have been read and
+ * their buffers freed, and a response buffer that would still cross the limit is refused, failing just that probe. */
+struct MemoryBudget {
+    size_t limit; // bytes, 0 for no budget
+    const struct Arena *states;
+    const struct BufferArenas *buffers;
+    size_t heap; // as of the last measure_memory()
+    size_t peak;
+    long connections;  // closed so far
+    size_t buffer_bytes; // requested so far
+    bool paused;
+    long pauses;
+    long buffers_refused;
+};
+
+void init_memory_budget(struct MemoryBudget *budget, size_t limit, const struct Arena *states, const struct BufferArenas *buffers);
+size_t measure_memory(struct MemoryBudget *budget);
+int connection_allowance(struct MemoryBudget *budget, int num_open, int max_new);
+bool buffer_fits(struct MemoryBudget *budget, size_t size);
+void print_memory_budget(const struct MemoryBudget *budget);
+
+#endif
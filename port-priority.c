@@ -0,0 +1,217 @@
+#include "port-priority.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+// A (prefix, port) pair seen in the database, with the number of servers found there
+struct PrefixPort {
+    uint16_t prefix;
+    uint16_t port;
+    int count;
+};
+
+static const long *sort_counts;
+static const int *sort_positions;
+
+// Sort ports by descending yield; ties keep the order the user gave
+static int compare_by_count(const void *a, const void *b) {
+    uint16_t pa = *(const uint16_t *)a, pb = *(const uint16_t *)b;
+    if(sort_counts[pa] != sort_counts[pb]) {
+        return sort_counts[pa] < sort_counts[pb] ? 1 : -1;
+    }
+    if(sort_positions[pa] != sort_positions[pb]) {
+        return sort_positions[pa] - sort_positions[pb];
+    }
+    return pa - pb;
+}
+
+static int compare_prefix_port(const void *a, const void *b) {
+    const struct PrefixPort *pa = a, *pb = b;
+    if(pa->prefix != pb->prefix) {
+        return pa->prefix < pb->prefix ? -1 : 1;
+    }
+    if(pa->count != pb->count) {
+        return pa->count < pb->count ? 1 : -1;
+    }
+    return pa->port < pb->port ? -1 : pa->port > pb->port;
+}
+
+static int compare_ranking(const void *key, const void *elem) {
+    uint16_t prefix = *(const uint16_t *)key;
+    const struct PrefixRanking *ranking = elem;
+    return prefix < ranking->prefix ? -1 : prefix > ranking->prefix;
+}
+
+/* Build a port ranking from the servers already in the database. With candidates, only those ports are ranked (unseen
+ * ones last); otherwise every port that has produced a server is. */
+int learn_port_priority(struct PortPriority *priority, sqlite3 *db, bool bedrock, const uint16_t *candidates, int num_candidates, bool per_prefix) {
+
+    memset(priority, 0, sizeof(*priority));
+
+    long *counts = calloc(65536, sizeof(long));
+    int *positions = calloc(65536, sizeof(int));
+    int pairs_capacity = 1024, num_pairs = 0;
+    struct PrefixPort *pairs = malloc(pairs_capacity * sizeof(struct PrefixPort));
+    if(counts == NULL || positions == NULL || pairs == NULL) {
+        fprintf(stderr, "failed to allocate port statistics\n");
+        goto fail;
+    }
+
+    // Positions are 1-based so that zero means "not a candidate"
+    for(int i = 0; i < num_candidates; i++) {
+        positions[candidates[i]] = i + 1;
+    }
+
+    sqlite3_stmt *stmt;
+    const char *query = "SELECT DISTINCT address, port FROM servers WHERE (edition = 'bedrock') = ?";
+    if(sqlite3_prepare_v2(db, query, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "failed to query previous results: %s\n", sqlite3_errmsg(db));
+        goto fail;
+    }
+    sqlite3_bind_int(stmt, 1, bedrock);
+
+    while(sqlite3_step(stmt) == SQLITE_ROW) {
+
+        struct in_addr addr;
+        const char *addr_str = (const char *)sqlite3_column_text(stmt, 0);
+        int port = sqlite3_column_int(stmt, 1);
+        if(addr_str == NULL || inet_pton(AF_INET, addr_str, &addr) != 1 || port < 1 || port > 65535) {
+            continue;
+        }
+        if(num_candidates > 0 && positions[port] == 0) {
+            continue;
+        }
+
+        counts[port]++;
+
+        if(per_prefix) {
+            if(num_pairs == pairs_capacity) {
+                pairs_capacity *= 2;
+                struct PrefixPort *grown = realloc(pairs, pairs_capacity * sizeof(struct PrefixPort));
+                if(grown == NULL) {
+                    fprintf(stderr, "failed to allocate port statistics\n");
+                    sqlite3_finalize(stmt);
+                    goto fail;
+                }
+                pairs = grown;
+            }
+            pairs[num_pairs].prefix = ntohl(addr.s_addr) >> 16;
+            pairs[num_pairs].port = port;
+            pairs[num_pairs].count = 1;
+            num_pairs++;
+        }
+
+    }
+    sqlite3_finalize(stmt);
+
+    // Global order: candidates (or every productive port) sorted by the number of servers found on them
+    priority->ports = malloc(65536 * sizeof(uint16_t));
+    if(priority->ports == NULL) {
+        fprintf(stderr, "failed to allocate port ranking\n");
+        goto fail;
+    }
+    if(num_candidates > 0) {
+        memcpy(priority->ports, candidates, num_candidates * sizeof(uint16_t));
+        priority->num_ports = num_candidates;
+    } else {
+        for(int port = 1; port < 65536; port++) {
+            if(counts[port] > 0) {
+                priority->ports[priority->num_ports++] = port;
+            }
+        }
+    }
+    sort_counts = counts;
+    sort_positions = positions;
+    qsort(priority->ports, priority->num_ports, sizeof(uint16_t), compare_by_count);
+
+    // Per-prefix order: collapse duplicate (prefix, port) pairs, then rank ports within each prefix
+    if(per_prefix && num_pairs > 0) {
+
+        qsort(pairs, num_pairs, sizeof(struct PrefixPort), compare_prefix_port);
+        int merged = 0;
+        for(int i = 0; i < num_pairs; i++) {
+            if(merged > 0 && pairs[merged - 1].prefix == pairs[i].prefix && pairs[merged - 1].port == pairs[i].port) {
+                pairs[merged - 1].count++;
+            } else {
+                pairs[merged++] = pairs[i];
+            }
+        }
+        qsort(pairs, merged, sizeof(struct PrefixPort), compare_prefix_port);
+
+        priority->prefix_ports = malloc(merged * sizeof(uint16_t));
+        priority->prefixes = malloc(merged * sizeof(struct PrefixRanking));
+        if(priority->prefix_ports == NULL || priority->prefixes == NULL) {
+            fprintf(stderr, "failed to allocate port ranking\n");
+            goto fail;
+        }
+
+        for(int i = 0; i < merged; i++) {
+            if(priority->num_prefixes == 0 || priority->prefixes[priority->num_prefixes - 1].prefix != pairs[i].prefix) {
+                struct PrefixRanking *ranking = &priority->prefixes[priority->num_prefixes++];
+                ranking->prefix = pairs[i].prefix;
+                ranking->offset = i;
+                ranking->count = 0;
+            }
+            priority->prefix_ports[i] = pairs[i].port;
+            priority->prefixes[priority->num_prefixes - 1].count++;
+        }
+
+    }
+
+    free(counts);
+    free(positions);
+    free(pairs);
+    return 0;
+
+fail:
+    free(counts);
+    free(positions);
+    free(pairs);
+    free_port_priority(priority);
+    return 1;
+
+}
+
+/* Return the port an address should be probed on in pass `rank`. */
+uint16_t port_for_rank(const struct PortPriority *priority, in_addr_t addr, int rank) {
+
+    uint16_t prefix = ntohl(addr) >> 16;
+    const struct PrefixRanking *ranking = NULL;
+    if(priority->num_prefixes > 0) {
+        ranking = bsearch(&prefix, priority->prefixes, priority->num_prefixes, sizeof(struct PrefixRanking), compare_ranking);
+    }
+
+    if(ranking == NULL) {
+        return priority->ports[rank];
+    }
+
+    if(rank < ranking->count) {
+        return priority->prefix_ports[ranking->offset + rank];
+    }
+
+    // Past the prefix's own ports, continue with the global order minus the ports already used for this prefix
+    const uint16_t *own = priority->prefix_ports + ranking->offset;
+    int remaining = rank - ranking->count;
+    for(int i = 0; i < priority->num_ports; i++) {
+        bool used = false;
+        for(int j = 0; j < ranking->count; j++) {
+            if(own[j] == priority->ports[i]) {
+                used = true;
+                break;
+            }
+        }
+        if(!used && remaining-- == 0) {
+            return priority->ports[i];
+        }
+    }
+
+    return priority->ports[rank];
+
+}
+
+void free_port_priority(struct PortPriority *priority) {
+    free(priority->ports);
+    free(priority->prefixes);
+    free(priority->prefix_ports);
+    memset(priority, 0, sizeof(*priority));
+}
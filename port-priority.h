@@ -0,0 +1,30 @@
+#ifndef __PORT_PRIORITY_H
+#define __PORT_PRIORITY_H
+
+#include "sqlite/sqlite3.h"
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Ports ranked for one /16, most productive first
+struct PrefixRanking {
+    uint16_t prefix;
+    int offset;
+    int count;
+};
+
+/* Port order learned from earlier results. Rank 0 is the port expected to yield the most servers; with per-prefix
+ * rankings a /16's own history is used before falling back to the global order. */
+struct PortPriority {
+    uint16_t *ports;
+    int num_ports;
+    struct PrefixRanking *prefixes;
+    int num_prefixes;
+    uint16_t *prefix_ports;
+};
+
+int learn_port_priority(struct PortPriority *priority, sqlite3 *db, bool bedrock, const uint16_t *candidates, int num_candidates, bool per_prefix);
+uint16_t port_for_rank(const struct PortPriority *priority, in_addr_t addr, int rank);
+void free_port_priority(struct PortPriority *priority);
+
+#endif
@@ -0,0 +1,57 @@
+#include "prefix-limiter.h"
+#include "address.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+int init_prefix_limiter(struct PrefixLimiter *limiter, int max_in_flight, int max_per_second) {
+    limiter->v4 = calloc(LIMITER_SLOTS4, sizeof(struct PrefixUsage));
+    limiter->v6 = calloc(LIMITER_SLOTS6, sizeof(struct PrefixUsage));
+    limiter->max_in_flight = max_in_flight;
+    limiter->max_per_second = max_per_second;
+    limiter->deferred = 0;
+    if(limiter->v4 == NULL || limiter->v6 == NULL) {
+        fprintf(stderr, "failed to allocate prefix limiter\n");
+        free_prefix_limiter(limiter);
+        return 1;
+    }
+    return 0;
+}
+
+void free_prefix_limiter(struct PrefixLimiter *limiter) {
+    free(limiter->v4);
+    free(limiter->v6);
+}
+
+static struct PrefixUsage *find_usage(const struct PrefixLimiter *limiter, const struct in6_addr *addr) {
+    if(is_ipv4(addr)) {
+        return &limiter->v4[ntohl(ipv4_of(addr)) >> 16];
+    }
+    uint32_t prefix;
+    memcpy(&prefix, addr->s6_addr, sizeof(prefix));
+    return &limiter->v6[mix32(prefix) % LIMITER_SLOTS6];
+}
+
+// Whether a probe to `addr` may start now without exceeding its prefix's caps
+bool prefix_has_room(const struct PrefixLimiter *limiter, const struct in6_addr *addr, uint64_t now_ms) {
+    const struct PrefixUsage *usage = find_usage(limiter, addr);
+    bool same_second = usage->second == (uint32_t)(now_ms / 1000);
+    return usage->in_flight < (uint32_t)limiter->max_in_flight && !(same_second && usage->started_this_second >= (uint32_t)limiter->max_per_second);
+}
+
+void prefix_probe_started(struct PrefixLimiter *limiter, const struct in6_addr *addr, uint64_t now_ms) {
+    struct PrefixUsage *usage = find_usage(limiter, addr);
+    uint32_t second = now_ms / 1000;
+    if(usage->second != second) {
+        usage->second = second;
+        usage->started_this_second = 0;
+    }
+    usage->started_this_second++;
+    usage->in_flight++;
+}
+
+void prefix_probe_finished(struct PrefixLimiter *limiter, const struct in6_addr *addr) {
+    struct PrefixUsage *usage = find_usage(limiter, addr);
+    if(usage->in_flight > 0) {
+        usage->in_flight--;
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef __PREFIX_LIMITER_H
+#define __PREFIX_LIMITER_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// IPv4 limits apply per /16; IPv6 /32s are hashed into a smaller table
+#define LIMITER_SLOTS4 65536
+#define LIMITER_SLOTS6 16384
+
+struct PrefixUsage {
+    uint32_t in_flight;
+    uint32_t started_this_second;
+    uint32_t second;
+};
+
+/* Per-prefix caps on concurrent probes and on probes started per second. Sources that walk a few networks in order,
+ * or a permutation that happens to cluster, would otherwise open bursts of connections into one provider, which is
+ * what intrusion detection systems look for before blocking the scanner outright. */
+struct PrefixLimiter {
+    struct PrefixUsage *v4;
+    struct PrefixUsage *v6;
+    int max_in_flight;
+    int max_per_second;
+    long deferred; // fresh targets that had to wait
+};
+
+int init_prefix_limiter(struct PrefixLimiter *limiter, int max_in_flight, int max_per_second);
+void free_prefix_limiter(struct PrefixLimiter *limiter);
+bool prefix_has_room(const struct PrefixLimiter *limiter, const struct in6_addr *addr, uint64_t now_ms);
+void prefix_probe_started(struct PrefixLimiter *limiter, const struct in6_addr *addr, uint64_t now_ms);
+void prefix_probe_finished(struct PrefixLimiter *limiter, const struct in6_addr *addr);
+
+#endif
@@ -0,0 +1,51 @@
+#include "retry-queue.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+int init_retry_queue(struct RetryQueue *queue, int capacity, int delay_ms, uint64_t now_ms) {
+    queue->items = malloc(capacity * sizeof(struct RetryEntry));
+    if(queue->items == NULL) {
+        fprintf(stderr, "failed to allocate retry queue\n");
+        return 1;
+    }
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    queue->epoch_ms = now_ms;
+    queue->delay_ms = delay_ms;
+    queue->scheduled = 0;
+    queue->dropped = 0;
+    queue->hits = 0;
+    return 0;
+}
+
+/* Queue a target to be probed again after the retry delay; when the queue is full the retry is dropped and counted. */
+bool schedule_retry(struct RetryQueue *queue, struct Target target, uint64_t now_ms) {
+    if(queue->count == queue->capacity) {
+        queue->dropped++;
+        return false;
+    }
+    struct RetryEntry *entry = &queue->items[(queue->head + queue->count) % queue->capacity];
+    entry->target = target;
+    entry->due_ms = now_ms - queue->epoch_ms + queue->delay_ms;
+    queue->count++;
+    queue->scheduled++;
+    return true;
+}
+
+/* The oldest queued target if its delay is over, or NULL. It stays queued until pop_retry(). */
+const struct Target *due_retry(const struct RetryQueue *queue, uint64_t now_ms) {
+    if(queue->count == 0 || queue->items[queue->head].due_ms > now_ms - queue->epoch_ms) {
+        return NULL;
+    }
+    return &queue->items[queue->head].target;
+}
+
+void pop_retry(struct RetryQueue *queue) {
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+}
+
+void free_retry_queue(struct RetryQueue *queue) {
+    free(queue->items);
+}
@@ -0,0 +1,33 @@
+#ifndef __RETRY_QUEUE_H
+#define __RETRY_QUEUE_H
+
+#include "addr-gen.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+struct RetryEntry {
+    struct Target target;
+    uint32_t due_ms; // relative to the queue's epoch
+};
+
+/* Fixed-capacity FIFO of targets to probe a second time after a transient failure. Every retry waits the same delay,
+ * so entries come due in the order they were queued and only the head ever needs checking. */
+struct RetryQueue {
+    struct RetryEntry *items;
+    int capacity;
+    int head;
+    int count;
+    uint64_t epoch_ms;
+    int delay_ms;
+    long scheduled;
+    long dropped;
+    long hits;
+};
+
+int init_retry_queue(struct RetryQueue *queue, int capacity, int delay_ms, uint64_t now_ms);
+bool schedule_retry(struct RetryQueue *queue, struct Target target, uint64_t now_ms);
+const struct Target *due_retry(const struct RetryQueue *queue, uint64_t now_ms);
+void pop_retry(struct RetryQueue *queue);
+void free_retry_queue(struct RetryQueue *queue);
+
+#endif
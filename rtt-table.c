@@ -0,0 +1,104 @@
+#include "rtt-table.h"
+#include "address.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+// Connect samples needed from a prefix before its estimate replaces the global timeout
+#define RTT_MIN_SAMPLES 3
+
+/* A connect deadline is this many retransmission timeouts (SRTT + 4 * RTTVAR), which leaves room for queueing delay and
+ * hosts slower than the rest of their prefix. It is never shorter than the kernel's initial SYN retransmission timeout
+ * plus one more RTO, so that a lost SYN or SYN-ACK is retransmitted and answered before the probe gives up; nothing
+ * retries a target that never connected. */
+#define RTT_CONNECT_FACTOR 2
+
+/* Once connected the host is known to exist, so reading the response gets a more generous deadline. It also covers
+ * the server's time to build its status response, which has nothing to do with the network. */
+#define RTT_READ_FACTOR 8
+#define RTT_MIN_READ_MS 2000
+
+int init_rtt_table(struct RttTable *table) {
+    table->v4 = calloc(RTT_SLOTS4, sizeof(struct RttEstimate));
+    table->v6 = calloc(RTT_SLOTS6, sizeof(struct RttEstimate));
+    table->num_estimated = 0;
+    if(table->v4 == NULL || table->v6 == NULL) {
+        fprintf(stderr, "failed to allocate RTT table\n");
+        free_rtt_table(table);
+        return 1;
+    }
+    return 0;
+}
+
+void free_rtt_table(struct RttTable *table) {
+    free(table->v4);
+    free(table->v6);
+}
+
+static struct RttEstimate *find_estimate(const struct RttTable *table, const struct in6_addr *addr) {
+    if(is_ipv4(addr)) {
+        return &table->v4[ntohl(ipv4_of(addr)) >> 16];
+    }
+    uint32_t prefix;
+    memcpy(&prefix, addr->s6_addr, sizeof(prefix));
+    return &table->v6[mix32(prefix) % RTT_SLOTS6];
+}
+
+// Fold a connect time into the prefix's estimate, using the same gains as TCP's retransmission timer
+void record_rtt(struct RttTable *table, const struct in6_addr *addr, int rtt_ms) {
+
+    struct RttEstimate *estimate = find_estimate(table, addr);
+    uint32_t rtt = rtt_ms < 0 ? 0 : rtt_ms;
+    if(estimate->samples == 0) {
+        estimate->srtt8 = rtt << 3;
+        estimate->rttvar4 = rtt << 1;
+    } else {
+        int64_t delta = (int64_t)rtt - (estimate->srtt8 >> 3);
+        estimate->srtt8 += delta;
+        estimate->rttvar4 += (delta < 0 ? -delta : delta) - (estimate->rttvar4 >> 2);
+    }
+
+    if(estimate->samples < UINT32_MAX) {
+        estimate->samples++;
+    }
+    if(estimate->samples == RTT_MIN_SAMPLES) {
+        table->num_estimated++;
+    }
+
+}
+
+static int clamp_timeout(uint64_t timeout_ms, uint64_t min_ms, int max_ms) {
+    if(timeout_ms < min_ms) {
+        timeout_ms = min_ms;
+    }
+    return timeout_ms > (uint64_t)max_ms ? max_ms : (int)timeout_ms;
+}
+
+// Retransmission timeout of a prefix, or 0 if it hasn't been sampled enough
+static uint64_t prefix_rto(const struct RttTable *table, const struct in6_addr *addr) {
+    const struct RttEstimate *estimate = find_estimate(table, addr);
+    if(estimate->samples < RTT_MIN_SAMPLES) {
+        return 0;
+    }
+    return (estimate->srtt8 >> 3) + estimate->rttvar4;
+}
+
+// Deadline for the TCP handshake of a new probe; `max_ms` is the global timeout, used as-is for unknown prefixes
+int rtt_connect_timeout(const struct RttTable *table, const struct in6_addr *addr, int max_ms) {
+    uint64_t rto = prefix_rto(table, addr);
+    if(rto == 0) {
+        return max_ms;
+    }
+    return clamp_timeout(rto * RTT_CONNECT_FACTOR, TCP_INITIAL_RTO_MS + rto, max_ms);
+}
+
+// Deadline for the rest of the exchange after connecting, from the larger of the prefix's RTO and this connection's RTT
+int rtt_read_timeout(const struct RttTable *table, const struct in6_addr *addr, int rtt_ms, int max_ms) {
+    uint64_t rto = prefix_rto(table, addr);
+    if(rto == 0) {
+        return max_ms;
+    }
+    if(rto < (uint64_t)rtt_ms) {
+        rto = rtt_ms;
+    }
+    return clamp_timeout(rto * RTT_READ_FACTOR, RTT_MIN_READ_MS, max_ms);
+}
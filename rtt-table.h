@@ -0,0 +1,36 @@
+#ifndef __RTT_TABLE_H
+#define __RTT_TABLE_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+// The kernel's initial SYN retransmission timeout
+#define TCP_INITIAL_RTO_MS 1000
+
+// IPv4 estimates are kept per /16; IPv6 /32s are hashed into a smaller table
+#define RTT_SLOTS4 65536
+#define RTT_SLOTS6 16384
+
+// Smoothed round-trip time and its variation, scaled by 8 and 4 as in RFC 6298 so that updates stay in integers
+struct RttEstimate {
+    uint32_t srtt8;
+    uint32_t rttvar4;
+    uint32_t samples;
+};
+
+/* Connect times measured during this scan, by prefix. Probes to a prefix with enough samples get deadlines derived from
+ * its estimate instead of the global --timeout, so unanswered SYNs to nearby networks are given up on quickly while
+ * distant ones still get the time they need. */
+struct RttTable {
+    struct RttEstimate *v4;
+    struct RttEstimate *v6;
+    long num_estimated;
+};
+
+int init_rtt_table(struct RttTable *table);
+void free_rtt_table(struct RttTable *table);
+void record_rtt(struct RttTable *table, const struct in6_addr *addr, int rtt_ms);
+int rtt_connect_timeout(const struct RttTable *table, const struct in6_addr *addr, int max_ms);
+int rtt_read_timeout(const struct RttTable *table, const struct in6_addr *addr, int rtt_ms, int max_ms);
+
+#endif
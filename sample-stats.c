@@ -0,0 +1,165 @@
+#include "sample-stats.h"
+#include "watchlist.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+// Normal quantile for the 95% confidence intervals
+#define SAMPLE_Z 1.96
+
+// Number of version names listed in the report before the rest are summed up
+#define SAMPLE_TOP_VERSIONS 15
+
+static const char *bucket_names[SAMPLE_PLAYER_BUCKETS] = {"0", "1-9", "10-99", "100-999", "1000+", "unknown"};
+
+int init_sample_stats(struct SampleStats *stats, uint64_t population) {
+    memset(stats, 0, sizeof(*stats));
+    stats->population = population;
+    stats->versions = malloc(SAMPLE_MAX_VERSIONS * sizeof(struct VersionCount));
+    if(stats->versions == NULL) {
+        fprintf(stderr, "failed to allocate sample statistics\n");
+        return 1;
+    }
+    return 0;
+}
+
+void free_sample_stats(struct SampleStats *stats) {
+    free(stats->versions);
+}
+
+// Copy the "name" string of the "version" object of a status response; returns false if there is none
+static bool parse_version_name(const char *json, int length, char *name, int size) {
+
+    const char *end = json + length;
+    const char *pos = NULL;
+    for(const char *p = json; p + 9 < end; p++) {
+        if(memcmp(p, "\"version\"", 9) == 0) {
+            pos = p + 9;
+            break;
+        }
+    }
+    for(; pos != NULL && pos + 6 < end && *pos != '}'; pos++) {
+        if(memcmp(pos, "\"name\"", 6) != 0) {
+            continue;
+        }
+        pos += 6;
+        while(pos < end && (*pos == ' ' || *pos == ':')) {
+            pos++;
+        }
+        if(pos == end || *pos != '"') {
+            return false;
+        }
+        int out = 0;
+        for(pos++; pos < end && *pos != '"' && out < size - 1; pos++) {
+            if(*pos == '\\' && pos + 1 < end) {
+                pos++;
+            }
+            name[out++] = *pos;
+        }
+        name[out] = '\0';
+        return true;
+    }
+    return false;
+
+}
+
+void record_sampled_server(struct SampleStats *stats, const char *json, int length) {
+
+    stats->servers++;
+
+    char name[SAMPLE_VERSION_LENGTH];
+    if(!parse_version_name(json, length, name, sizeof(name))) {
+        strcpy(name, "(none)");
+    }
+    int i = 0;
+    while(i < stats->num_versions && strcmp(stats->versions[i].name, name) != 0) {
+        i++;
+    }
+    if(i < stats->num_versions) {
+        stats->versions[i].count++;
+    } else if(stats->num_versions < SAMPLE_MAX_VERSIONS) {
+        strcpy(stats->versions[i].name, name);
+        stats->versions[i].count = 1;
+        stats->num_versions++;
+    } else {
+        stats->other_versions++;
+    }
+
+    int online, max_players, bucket = SAMPLE_PLAYER_BUCKETS - 1;
+    if(parse_player_counts(json, length, &online, &max_players) && online >= 0) {
+        bucket = online == 0 ? 0 : online < 10 ? 1 : online < 100 ? 2 : online < 1000 ? 3 : 4;
+    }
+    stats->player_buckets[bucket]++;
+
+}
+
+/* Wilson score interval for a proportion of `hits` out of `n`, which stays sensible for the small counts a sample
+ * produces (unlike the normal approximation, it never goes below zero). */
+static void wilson_interval(long hits, long n, double *low, double *high) {
+    if(n == 0) {
+        *low = 0;
+        *high = 1;
+        return;
+    }
+    double p = (double)hits / n, z2 = SAMPLE_Z * SAMPLE_Z;
+    double center = (p + z2 / (2 * n)) / (1 + z2 / n);
+    double margin = SAMPLE_Z * sqrt(p * (1 - p) / n + z2 / (4.0 * n * n)) / (1 + z2 / n);
+    *low = center - margin < 0 ? 0 : center - margin;
+    *high = center + margin > 1 ? 1 : center + margin;
+}
+
+// One row of a distribution: share among the sampled servers and the estimated number of such servers overall
+static void print_share(const struct SampleStats *stats, const char *name, long count) {
+    double low, high;
+    wilson_interval(count, stats->servers, &low, &high);
+    double estimate = (double)stats->population * count / stats->drawn;
+    printf("  %-24s %6.2f%% (95%% CI %.2f-%.2f%%), est. %.0f servers\n", name, 100.0 * count / stats->servers, 100 * low, 100 * high, estimate);
+}
+
+static int compare_versions(const void *a, const void *b) {
+    const struct VersionCount *va = a, *vb = b;
+    if(va->count != vb->count) {
+        return va->count < vb->count ? 1 : -1;
+    }
+    return strcmp(va->name, vb->name);
+}
+
+/* Extrapolate from the sample to the whole population. The sample is a prefix of the scan permutation, which makes it
+ * a uniform sample of the targets a full sweep would probe. */
+void print_sample_report(struct SampleStats *stats) {
+
+    if(stats->drawn == 0) {
+        printf("sample: no targets drawn\n");
+        return;
+    }
+
+    double low, high;
+    wilson_interval(stats->servers, stats->drawn, &low, &high);
+    printf("sample: %ld of %lu targets (%.3g%%), %ld servers found\n", stats->drawn, (unsigned long)stats->population, 100.0 * stats->drawn / stats->population, stats->servers);
+    printf("estimated servers in the full space: %.0f (95%% CI %.0f-%.0f)\n", (double)stats->population * stats->servers / stats->drawn, stats->population * low, stats->population * high);
+    if(stats->servers == 0) {
+        return;
+    }
+
+    printf("versions:\n");
+    qsort(stats->versions, stats->num_versions, sizeof(struct VersionCount), compare_versions);
+    long rest = stats->other_versions;
+    for(int i = 0; i < stats->num_versions; i++) {
+        if(i < SAMPLE_TOP_VERSIONS) {
+            print_share(stats, stats->versions[i].name, stats->versions[i].count);
+        } else {
+            rest += stats->versions[i].count;
+        }
+    }
+    if(rest > 0) {
+        print_share(stats, "(other)", rest);
+    }
+
+    printf("players online:\n");
+    for(int i = 0; i < SAMPLE_PLAYER_BUCKETS; i++) {
+        print_share(stats, bucket_names[i], stats->player_buckets[i]);
+    }
+
+}
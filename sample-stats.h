@@ -0,0 +1,37 @@
+#ifndef __SAMPLE_STATS_H
+#define __SAMPLE_STATS_H
+
+#include <stdint.h>
+
+// Most distinct version names tallied; servers reporting further names are counted as "other"
+#define SAMPLE_MAX_VERSIONS 1024
+
+// Longest version name kept, including the terminator
+#define SAMPLE_VERSION_LENGTH 48
+
+// Player count buckets: 0, 1-9, 10-99, 100-999, 1000+, and unknown
+#define SAMPLE_PLAYER_BUCKETS 6
+
+struct VersionCount {
+    char name[SAMPLE_VERSION_LENGTH];
+    long count;
+};
+
+/* Tallies for --sample: how many targets were drawn from the permutation, how many of them turned out to be servers,
+ * and what those servers reported. The population is the number of targets a full sweep would probe. */
+struct SampleStats {
+    uint64_t population;
+    long drawn;
+    long servers;
+    struct VersionCount *versions;
+    int num_versions;
+    long other_versions;
+    long player_buckets[SAMPLE_PLAYER_BUCKETS];
+};
+
+int init_sample_stats(struct SampleStats *stats, uint64_t population);
+void record_sampled_server(struct SampleStats *stats, const char *json, int length);
+void print_sample_report(struct SampleStats *stats);
+void free_sample_stats(struct SampleStats *stats);
+
+#endif
@@ -0,0 +1,113 @@
+#include "source-pool.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+void init_source_pool(struct SourcePool *pool, uint16_t default_port) {
+    pool->num_addrs4 = 0;
+    pool->num_addrs6 = 0;
+    pool->port_min = default_port;
+    pool->port_max = default_port;
+    pool->by_hash = false;
+    pool->counter = 0;
+    pool->collisions = 0;
+}
+
+int add_source_addr(struct SourcePool *pool, const char *str) {
+
+    struct in6_addr addr;
+    if(!parse_address(str, &addr)) {
+        fprintf(stderr, "invalid source address: %s\n", str);
+        return 1;
+    }
+
+    int *num_addrs = is_ipv4(&addr) ? &pool->num_addrs4 : &pool->num_addrs6;
+    if(*num_addrs == MAX_SOURCE_ADDRS) {
+        fprintf(stderr, "too many source addresses (max %d per family)\n", MAX_SOURCE_ADDRS);
+        return 1;
+    }
+
+    (is_ipv4(&addr) ? pool->addrs4 : pool->addrs6)[(*num_addrs)++] = addr;
+    return 0;
+
+}
+
+/* Parse a port, or a range of ports such as "40000-40099", at the start of str and point end past it. Only digits are
+ * accepted on either side of the dash, without signs or whitespace. Returns 1 if there is no valid port or range
+ * there, which includes ports outside 1-65535 and ranges that run backwards. */
+int parse_port_range(const char *str, const char **end, int *lo, int *hi) {
+
+    if(!isdigit((unsigned char)*str)) {
+        return 1;
+    }
+    char *after;
+    long first = strtol(str, &after, 10);
+    long last = first;
+    if(*after == '-') {
+        const char *second = after + 1;
+        if(!isdigit((unsigned char)*second)) {
+            return 1;
+        }
+        last = strtol(second, &after, 10);
+    }
+
+    if(first < 1 || last > 65535 || first > last) {
+        return 1;
+    }
+    *lo = first;
+    *hi = last;
+    *end = after;
+    return 0;
+
+}
+
+int set_source_ports(struct SourcePool *pool, const char *str) {
+
+    // A single port, or two joined by a dash, with nothing else around them
+    const char *end;
+    int lo, hi;
+    if(parse_port_range(str, &end, &lo, &hi) || *end != '\0') {
+        fprintf(stderr, "invalid source port range: %s\n", str);
+        return 1;
+    }
+
+    pool->port_min = lo;
+    pool->port_max = hi;
+    return 0;
+
+}
+
+/* Choose the local address and port for a connection to `dest`, as an address of the same family (v4-mapped for IPv4).
+ * `attempt` is incremented by the caller after a collision so that the next call yields a different (address, port)
+ * pair. */
+void pick_source(struct SourcePool *pool, const struct in6_addr *dest, int attempt, struct sockaddr_in6 *out) {
+
+    bool v4 = is_ipv4(dest);
+    const struct in6_addr *addrs = v4 ? pool->addrs4 : pool->addrs6;
+    int count = v4 ? pool->num_addrs4 : pool->num_addrs6;
+    uint32_t num_addrs = count > 0 ? count : 1;
+    uint32_t num_ports = pool->port_max - pool->port_min + 1;
+
+    uint64_t idx;
+    if(pool->by_hash) {
+        // Spread neighboring destination addresses across the whole pool
+        idx = hash_address(dest) + attempt;
+    } else if(attempt == 0) {
+        idx = pool->counter++;
+    } else {
+        idx = pool->counter - 1 + attempt;
+    }
+
+    memset(out, 0, sizeof(*out));
+    out->sin6_family = AF_INET6;
+    if(count > 0) {
+        out->sin6_addr = addrs[idx % num_addrs];
+    } else if(v4) {
+        map_ipv4(&out->sin6_addr, htonl(INADDR_ANY));
+    } else {
+        out->sin6_addr = in6addr_any;
+    }
+    out->sin6_port = htons(pool->port_min + (idx / num_addrs) % num_ports);
+
+}
\ No newline at end of file
@@ -0,0 +1,30 @@
+#ifndef __SOURCE_POOL_H
+#define __SOURCE_POOL_H
+
+#include "address.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Maximum number of local addresses of each family that can be used as connection sources
+#define MAX_SOURCE_ADDRS 64
+
+// Source addresses are kept per family; a target is always reached from an address of its own family
+struct SourcePool {
+    int num_addrs4;
+    struct in6_addr addrs4[MAX_SOURCE_ADDRS]; // v4-mapped
+    int num_addrs6;
+    struct in6_addr addrs6[MAX_SOURCE_ADDRS];
+    uint16_t port_min;
+    uint16_t port_max;
+    bool by_hash;
+    uint64_t counter;
+    long collisions;
+};
+
+void init_source_pool(struct SourcePool *pool, uint16_t default_port);
+int add_source_addr(struct SourcePool *pool, const char *str);
+int parse_port_range(const char *str, const char **end, int *lo, int *hi);
+int set_source_ports(struct SourcePool *pool, const char *str);
+void pick_source(struct SourcePool *pool, const struct in6_addr *dest, int attempt, struct sockaddr_in6 *out);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,1102 @@
+#define _GNU_SOURCE
+#include "target-source.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+// Longest line accepted from target lists ("a.b.c.d/len" or "a.b.c.d:port" plus slack)
+#define MAX_TARGET_LINE 64
+
+// Read buffer for streaming sources
+#define STREAM_BUFFER_SIZE 65536
+
+void close_target_source(struct TargetSource *source) {
+    if(source != NULL) {
+        source->destroy(source);
+    }
+}
+
+/* Parse "ADDR", "ADDR/len" or "ADDR:PORT" from [str, end), where ADDR is IPv4 or IPv6 and an IPv6 address with a port
+ * is written "[ADDR]:PORT". Blank lines and '#' comments yield false with *valid left true; anything else unparseable
+ * sets *valid to false. prefix_len/port are -1 when absent. */
+bool parse_target(const char *str, const char *end, struct in6_addr *addr, int *prefix_len, int *port, bool *valid) {
+
+    *valid = true;
+    *prefix_len = -1;
+    *port = -1;
+
+    while(str < end && (*str == ' ' || *str == '\t' || *str == '\r')) {
+        str++;
+    }
+    while(end > str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) {
+        end--;
+    }
+    if(str == end || *str == '#') {
+        return false;
+    }
+
+    char line[MAX_TARGET_LINE];
+    if(end - str >= MAX_TARGET_LINE) {
+        *valid = false;
+        return false;
+    }
+    memcpy(line, str, end - str);
+    line[end - str] = '\0';
+
+    char *comment = strchr(line, '#');
+    if(comment != NULL) {
+        *comment = '\0';
+    }
+
+    // A port follows "]" for IPv6, or the only colon for IPv4; a prefix length follows "/" for either
+    char *host = line;
+    char *suffix = strchr(line, '/');
+    if(line[0] == '[') {
+        char *close = strchr(line, ']');
+        if(close == NULL || (close[1] != ':' && close[1] != '\0')) {
+            *valid = false;
+            return false;
+        }
+        *close = '\0';
+        host = line + 1;
+        suffix = close[1] == ':' ? close + 1 : NULL;
+    } else if(suffix == NULL) {
+        char *colon = strchr(line, ':');
+        if(colon != NULL && colon == strrchr(line, ':')) {
+            suffix = colon;
+        }
+    }
+
+    if(suffix != NULL) {
+        char *num_end;
+        long value = strtol(suffix + 1, &num_end, 10);
+        while(*num_end == ' ' || *num_end == '\t') {
+            num_end++;
+        }
+        if(num_end == suffix + 1 || *num_end != '\0') {
+            *valid = false;
+            return false;
+        }
+        if(*suffix == '/' && value >= 0 && value <= 128) {
+            *prefix_len = value;
+        } else if(*suffix == ':' && value >= 1 && value <= 65535) {
+            *port = value;
+        } else {
+            *valid = false;
+            return false;
+        }
+        *suffix = '\0';
+    }
+
+    if(!parse_address(host, addr) || (is_ipv4(addr) && *prefix_len > 32)) {
+        *valid = false;
+        return false;
+    }
+
+    return true;
+
+}
+
+// Map a file read-only; returns NULL on failure or for an empty file (with *length set to 0)
+static char *map_file(const char *path, size_t *length) {
+
+    *length = 0;
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        fprintf(stderr, "failed to map %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    *length = st.st_size;
+    return data;
+
+}
+
+/* Visits every index in [0, size) exactly once in a scrambled order, using the same kind of full-period LCG as the
+ * address generator over the next power of two and skipping values that are out of range. */
+struct IndexPermutation {
+    uint64_t size;
+    uint64_t mask;
+    uint64_t state;
+    uint64_t steps;
+};
+
+static void init_permutation(struct IndexPermutation *perm, uint64_t size) {
+    perm->size = size;
+    perm->mask = 0;
+    while(perm->mask < size - 1 && size > 1) {
+        perm->mask = perm->mask << 1 | 1;
+    }
+    perm->state = 0;
+    perm->steps = 0;
+}
+
+static bool next_index(struct IndexPermutation *perm, uint64_t *index) {
+    while(perm->size > 0 && perm->steps <= perm->mask) {
+        perm->state = (perm->state * 6364136223846793005ULL + 1442695040888963407ULL) & perm->mask;
+        perm->steps++;
+        if(perm->state < perm->size) {
+            *index = perm->state;
+            return true;
+        }
+    }
+    return false;
+}
+
+// ---- Full IPv4 generator ----
+
+struct GeneratorSource {
+    struct TargetSource base;
+    struct AddressGenerator *addr_gen;
+};
+
+static int generator_next_batch(struct TargetSource *source, struct Target *targets, int max) {
+    struct GeneratorSource *gen = (struct GeneratorSource *)source;
+    int count = 0;
+    while(count < max && next_target(gen->addr_gen, &targets[count])) {
+        count++;
+    }
+    source->finished = gen->addr_gen->finished && count < max;
+    return count;
+}
+
+static void generator_destroy(struct TargetSource *source) {
+    free(source);
+}
+
+struct TargetSource *open_generator_source(struct AddressGenerator *addr_gen) {
+    struct GeneratorSource *gen = malloc(sizeof(struct GeneratorSource));
+    if(gen == NULL) {
+        fprintf(stderr, "failed to allocate target source\n");
+        return NULL;
+    }
+    gen->base.next_batch = generator_next_batch;
+    gen->base.report = NULL;
+    gen->base.destroy = generator_destroy;
+    gen->base.finished = false;
+    gen->addr_gen = addr_gen;
+    return &gen->base;
+}
+
+// ---- Uniform sample ----
+
+struct SampleSource {
+    struct TargetSource base;
+    struct AddressGenerator *addr_gen;
+    struct SampleStats *stats;
+    long size;
+};
+
+static int sample_next_batch(struct TargetSource *source, struct Target *targets, int max) {
+    struct SampleSource *sample = (struct SampleSource *)source;
+    int count = 0;
+    while(count < max && sample->stats->drawn < sample->size && next_target(sample->addr_gen, &targets[count])) {
+        count++;
+        sample->stats->drawn++;
+    }
+    source->finished = sample->stats->drawn == sample->size || (sample->addr_gen->finished && count < max);
+    return count;
+}
+
+static void sample_destroy(struct TargetSource *source) {
+    free(source);
+}
+
+/* The first `size` targets of the full scan permutation. The permutation visits targets in pseudo-random order, so
+ * any prefix of it is a uniform sample of the space, and the counts in `stats` can be scaled up to the whole of it. */
+struct TargetSource *open_sample_source(struct AddressGenerator *addr_gen, struct SampleStats *stats, long size) {
+    struct SampleSource *sample = malloc(sizeof(struct SampleSource));
+    if(sample == NULL) {
+        fprintf(stderr, "failed to allocate target source\n");
+        return NULL;
+    }
+    sample->base.next_batch = sample_next_batch;
+    sample->base.report = NULL;
+    sample->base.destroy = sample_destroy;
+    sample->base.finished = size == 0;
+    sample->addr_gen = addr_gen;
+    sample->stats = stats;
+    sample->size = size;
+    return &sample->base;
+}
+
+// ---- CIDR include list ----
+
+// A run of included addresses, [start, start + size), in host byte order
+struct Interval {
+    uint32_t start;
+    uint64_t size;
+    uint64_t offset; // number of addresses in all earlier intervals
+};
+
+struct CidrSource {
+    struct TargetSource base;
+    const struct ExcludeList *exclude;
+    const uint16_t *ports;
+    int num_ports;
+    struct Interval *intervals;
+    int num_intervals;
+    uint64_t num_addrs;
+    struct IndexPermutation perm;
+};
+
+static int compare_intervals(const void *a, const void *b) {
+    const struct Interval *ia = a, *ib = b;
+    return ia->start < ib->start ? -1 : ia->start > ib->start;
+}
+
+static int cidr_next_batch(struct TargetSource *source, struct Target *targets, int max) {
+
+    struct CidrSource *cidr = (struct CidrSource *)source;
+    int count = 0;
+    uint64_t index;
+    while(count < max && next_index(&cidr->perm, &index)) {
+
+        // Index = port index * number of addresses + address index, so a host's ports are spread over the scan
+        uint64_t addr_index = index % cidr->num_addrs;
+        int port_index = index / cidr->num_addrs;
+
+        int lo = 0, hi = cidr->num_intervals - 1;
+        while(lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if(cidr->intervals[mid].offset <= addr_index) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+
+        uint32_t addr = cidr->intervals[lo].start + (uint32_t)(addr_index - cidr->intervals[lo].offset);
+        if(should_exclude(cidr->exclude, addr)) {
+            continue;
+        }
+
+        map_ipv4(&targets[count].addr, htonl(addr));
+        targets[count].port = cidr->ports[port_index];
+        count++;
+
+    }
+
+    source->finished = count < max;
+    return count;
+
+}
+
+static void cidr_destroy(struct TargetSource *source) {
+    struct CidrSource *cidr = (struct CidrSource *)source;
+    free(cidr->intervals);
+    free(cidr);
+}
+
+/* Scan only the subnets listed in a file, one CIDR per line. Overlapping entries are merged, and the (address, port)
+ * pairs are visited in permuted order just like a full scan. */
+struct TargetSource *open_cidr_source(const char *path, const struct ExcludeList *exclude, const uint16_t *ports, int num_ports) {
+
+    size_t length;
+    char *data = map_file(path, &length);
+    if(data == NULL) {
+        if(length == 0) {
+            fprintf(stderr, "%s contains no subnets\n", path);
+        }
+        return NULL;
+    }
+
+    struct CidrSource *cidr = calloc(1, sizeof(struct CidrSource));
+    int capacity = 64;
+    struct Interval *intervals = malloc(capacity * sizeof(struct Interval));
+    if(cidr == NULL || intervals == NULL) {
+        fprintf(stderr, "failed to allocate target source\n");
+        goto fail;
+    }
+
+    int num_intervals = 0;
+    int line_number = 0;
+    for(char *line = data; line < data + length; ) {
+
+        char *end = memchr(line, '\n', data + length - line);
+        if(end == NULL) {
+            end = data + length;
+        }
+        line_number++;
+
+        struct in6_addr parsed;
+        int prefix_len, port;
+        bool valid;
+        if(parse_target(line, end, &parsed, &prefix_len, &port, &valid)) {
+
+            if(!is_ipv4(&parsed)) {
+                fprintf(stderr, "%s:%d: IPv6 subnets are too large to scan, list addresses with --ip-file instead\n", path, line_number);
+            } else if(port != -1) {
+                valid = false;
+            } else {
+                uint32_t addr = ntohl(ipv4_of(&parsed));
+                if(prefix_len == -1) {
+                    prefix_len = 32;
+                }
+                if(num_intervals == capacity) {
+                    capacity *= 2;
+                    struct Interval *grown = realloc(intervals, capacity * sizeof(struct Interval));
+                    if(grown == NULL) {
+                        fprintf(stderr, "failed to allocate target source\n");
+                        goto fail;
+                    }
+                    intervals = grown;
+                }
+                uint64_t size = (uint64_t)1 << (32 - prefix_len);
+                intervals[num_intervals].start = addr & ~(uint32_t)(size - 1);
+                intervals[num_intervals].size = size;
+                num_intervals++;
+            }
+
+        }
+
+        if(!valid) {
+            fprintf(stderr, "%s:%d: ignoring invalid subnet\n", path, line_number);
+        }
+
+        line = end + 1;
+
+    }
+
+    // Merge overlapping subnets so that no address is probed twice
+    qsort(intervals, num_intervals, sizeof(struct Interval), compare_intervals);
+    int merged = 0;
+    uint64_t total = 0;
+    for(int i = 0; i < num_intervals; i++) {
+        if(merged > 0) {
+            struct Interval *last = &intervals[merged - 1];
+            uint64_t last_end = last->start + last->size;
+            if(intervals[i].start < last_end) {
+                uint64_t end = intervals[i].start + intervals[i].size;
+                if(end > last_end) {
+                    total += end - last_end;
+                    last->size = end - last->start;
+                }
+                continue;
+            }
+        }
+        intervals[merged] = intervals[i];
+        intervals[merged].offset = total;
+        total += intervals[i].size;
+        merged++;
+    }
+
+    if(total == 0) {
+        fprintf(stderr, "%s contains no subnets\n", path);
+        goto fail;
+    }
+
+    munmap(data, length);
+    cidr->base.next_batch = cidr_next_batch;
+    cidr->base.report = NULL;
+    cidr->base.destroy = cidr_destroy;
+    cidr->base.finished = false;
+    cidr->exclude = exclude;
+    cidr->ports = ports;
+    cidr->num_ports = num_ports;
+    cidr->intervals = intervals;
+    cidr->num_intervals = merged;
+    cidr->num_addrs = total;
+    init_permutation(&cidr->perm, total * num_ports);
+    return &cidr->base;
+
+fail:
+    munmap(data, length);
+    free(intervals);
+    free(cidr);
+    return NULL;
+
+}
+
+// ---- Flat IP list ----
+
+struct IpFileSource {
+    struct TargetSource base;
+    const struct ExcludeList *exclude;
+    const uint16_t *ports;
+    int num_ports;
+    struct in6_addr *addrs;
+    uint16_t *fixed_ports; // port given on the line, or 0 to use every configured port
+    uint64_t num_addrs;
+    int ports_per_addr;
+    struct IndexPermutation perm;
+};
+
+static int ip_file_next_batch(struct TargetSource *source, struct Target *targets, int max) {
+
+    struct IpFileSource *list = (struct IpFileSource *)source;
+    int count = 0;
+    uint64_t index;
+    while(count < max && next_index(&list->perm, &index)) {
+
+        uint64_t addr_index = index % list->num_addrs;
+        int port_index = index / list->num_addrs;
+
+        // Lines with an explicit port only produce one target
+        uint16_t port = list->fixed_ports[addr_index];
+        if(port != 0 && port_index != 0) {
+            continue;
+        }
+
+        if(should_exclude_address(list->exclude, &list->addrs[addr_index])) {
+            continue;
+        }
+
+        targets[count].addr = list->addrs[addr_index];
+        targets[count].port = port != 0 ? port : list->ports[port_index];
+        count++;
+
+    }
+
+    source->finished = count < max;
+    return count;
+
+}
+
+static void ip_file_destroy(struct TargetSource *source) {
+    struct IpFileSource *list = (struct IpFileSource *)source;
+    free(list->addrs);
+    free(list->fixed_ports);
+    free(list);
+}
+
+/* Scan the addresses in a hitlist file, one IPv4 or IPv6 address per line with an optional port ("a.b.c.d:port" or
+ * "[v6]:port"). The file is memory-mapped and parsed in one pass, and the list is visited in shuffled order. */
+struct TargetSource *open_ip_file_source(const char *path, const struct ExcludeList *exclude, const uint16_t *ports, int num_ports) {
+
+    size_t length;
+    char *data = map_file(path, &length);
+    if(data == NULL) {
+        if(length == 0) {
+            fprintf(stderr, "%s contains no addresses\n", path);
+        }
+        return NULL;
+    }
+
+    // Size the arrays by the number of lines, which is cheap to count in the mapped file
+    size_t capacity = 1;
+    for(char *pos = data; (pos = memchr(pos, '\n', data + length - pos)) != NULL; pos++) {
+        capacity++;
+    }
+
+    struct IpFileSource *list = calloc(1, sizeof(struct IpFileSource));
+    struct in6_addr *addrs = malloc(capacity * sizeof(struct in6_addr));
+    uint16_t *fixed_ports = malloc(capacity * sizeof(uint16_t));
+    if(list == NULL || addrs == NULL || fixed_ports == NULL) {
+        fprintf(stderr, "failed to allocate target source\n");
+        munmap(data, length);
+        free(list);
+        free(addrs);
+        free(fixed_ports);
+        return NULL;
+    }
+
+    uint64_t count = 0;
+    bool any_unported = false;
+    int line_number = 0;
+    for(char *line = data; line < data + length; ) {
+
+        char *end = memchr(line, '\n', data + length - line);
+        if(end == NULL) {
+            end = data + length;
+        }
+        line_number++;
+
+        struct in6_addr addr;
+        int prefix_len, port;
+        bool valid;
+        if(parse_target(line, end, &addr, &prefix_len, &port, &valid) && prefix_len == -1 && count < capacity) {
+            addrs[count] = addr;
+            fixed_ports[count] = port != -1 ? port : 0;
+            any_unported |= port == -1;
+            count++;
+        } else if(!valid || prefix_len != -1) {
+            fprintf(stderr, "%s:%d: ignoring invalid address\n", path, line_number);
+        }
+
+        line = end + 1;
+
+    }
+    munmap(data, length);
+
+    if(count == 0) {
+        fprintf(stderr, "%s contains no addresses\n", path);
+        ip_file_destroy(&list->base);
+        free(addrs);
+        free(fixed_ports);
+        return NULL;
+    }
+
+    list->base.next_batch = ip_file_next_batch;
+    list->base.report = NULL;
+    list->base.destroy = ip_file_destroy;
+    list->base.finished = false;
+    list->exclude = exclude;
+    list->ports = ports;
+    list->num_ports = num_ports;
+    list->addrs = addrs;
+    list->fixed_ports = fixed_ports;
+    list->num_addrs = count;
+    list->ports_per_addr = any_unported ? num_ports : 1;
+    init_permutation(&list->perm, count * list->ports_per_addr);
+    return &list->base;
+
+}
+
+// ---- Streaming input ----
+
+struct StreamSource {
+    struct TargetSource base;
+    int fd;
+    int saved_flags;
+    const struct ExcludeList *exclude;
+    const uint16_t *ports;
+    int num_ports;
+    char buf[STREAM_BUFFER_SIZE];
+    int buf_start;
+    int buf_end;
+    bool eof;
+    bool discarding; // skipping the rest of an overlong line
+
+    // Address whose configured ports are still being emitted
+    struct in6_addr pending_addr;
+    int pending_port;
+    int line_number;
+};
+
+static int stream_next_batch(struct TargetSource *source, struct Target *targets, int max) {
+
+    struct StreamSource *stream = (struct StreamSource *)source;
+    int count = 0;
+
+    while(count < max) {
+
+        if(stream->pending_port < stream->num_ports) {
+            targets[count].addr = stream->pending_addr;
+            targets[count].port = stream->ports[stream->pending_port++];
+            count++;
+            continue;
+        }
+
+        // Look for a complete line in the buffer, reading more input if there is none
+        char *start = stream->buf + stream->buf_start;
+        char *newline = memchr(start, '\n', stream->buf_end - stream->buf_start);
+        if(newline == NULL && stream->eof && stream->buf_end > stream->buf_start) {
+            newline = stream->buf + stream->buf_end;
+        }
+
+        if(newline == NULL) {
+
+            if(stream->eof) {
+                break;
+            }
+
+            // Compact the buffer. A line that fills all of it is overlong, and is skipped up to its newline.
+            memmove(stream->buf, start, stream->buf_end - stream->buf_start);
+            stream->buf_end -= stream->buf_start;
+            stream->buf_start = 0;
+            if(stream->buf_end == STREAM_BUFFER_SIZE) {
+                stream->buf_end = 0;
+                stream->discarding = true;
+            }
+
+            ssize_t bytes_read = read(stream->fd, stream->buf + stream->buf_end, STREAM_BUFFER_SIZE - stream->buf_end);
+            if(bytes_read == -1) {
+                if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    perror("read");
+                    stream->eof = true;
+                }
+                break;
+            }
+            if(bytes_read == 0) {
+                stream->eof = true;
+            }
+            stream->buf_end += bytes_read;
+            continue;
+
+        }
+
+        stream->line_number++;
+        int consumed = newline - start + 1;
+        if(stream->discarding) {
+            fprintf(stderr, "stdin:%d: ignoring overlong line\n", stream->line_number);
+            stream->discarding = false;
+            stream->buf_start += consumed;
+            if(stream->buf_start > stream->buf_end) {
+                stream->buf_start = stream->buf_end;
+            }
+            continue;
+        }
+
+        struct in6_addr addr;
+        int prefix_len, port;
+        bool valid;
+        if(parse_target(start, newline, &addr, &prefix_len, &port, &valid) && prefix_len == -1) {
+            if(!should_exclude_address(stream->exclude, &addr)) {
+                if(port != -1) {
+                    targets[count].addr = addr;
+                    targets[count].port = port;
+                    count++;
+                } else {
+                    stream->pending_addr = addr;
+                    stream->pending_port = 0;
+                }
+            }
+        } else if(!valid || prefix_len != -1) {
+            fprintf(stderr, "stdin:%d: ignoring invalid address\n", stream->line_number);
+        }
+
+        stream->buf_start += consumed;
+        if(stream->buf_start > stream->buf_end) {
+            stream->buf_start = stream->buf_end;
+        }
+
+    }
+
+    source->finished = stream->eof && stream->buf_start == stream->buf_end && stream->pending_port == stream->num_ports;
+    return count;
+
+}
+
+static void stream_destroy(struct TargetSource *source) {
+    struct StreamSource *stream = (struct StreamSource *)source;
+    fcntl(stream->fd, F_SETFL, stream->saved_flags);
+    free(stream);
+}
+
+/* Scan addresses as another tool writes them, one per line, in arrival order. The descriptor is made non-blocking so
+ * that an idle producer never stalls the event loop. */
+struct TargetSource *open_stream_source(int fd, const struct ExcludeList *exclude, const uint16_t *ports, int num_ports) {
+
+    struct StreamSource *stream = malloc(sizeof(struct StreamSource));
+    if(stream == NULL) {
+        fprintf(stderr, "failed to allocate target source\n");
+        return NULL;
+    }
+
+    stream->saved_flags = fcntl(fd, F_GETFL);
+    if(stream->saved_flags == -1 || fcntl(fd, F_SETFL, stream->saved_flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        free(stream);
+        return NULL;
+    }
+
+    stream->base.next_batch = stream_next_batch;
+    stream->base.report = NULL;
+    stream->base.destroy = stream_destroy;
+    stream->base.finished = false;
+    stream->fd = fd;
+    stream->exclude = exclude;
+    stream->ports = ports;
+    stream->num_ports = num_ports;
+    stream->buf_start = 0;
+    stream->buf_end = 0;
+    stream->eof = false;
+    stream->discarding = false;
+    stream->pending_port = num_ports;
+    stream->line_number = 0;
+    return &stream->base;
+
+}
+// ---- Known servers ----
+
+struct RescanSource {
+    struct TargetSource base;
+    sqlite3_stmt *stmt;
+    const struct ExcludeList *exclude;
+    uint8_t *port_filter; // bitmap of ports to rescan, or NULL for all
+};
+
+static int rescan_next_batch(struct TargetSource *source, struct Target *targets, int max) {
+
+    struct RescanSource *rescan = (struct RescanSource *)source;
+    int count = 0;
+    while(count < max && !source->finished) {
+
+        int result = sqlite3_step(rescan->stmt);
+        if(result != SQLITE_ROW) {
+            if(result != SQLITE_DONE) {
+                fprintf(stderr, "failed to read known servers: %s\n", sqlite3_errstr(result));
+            }
+            source->finished = true;
+            break;
+        }
+
+        const char *addr_str = (const char *)sqlite3_column_text(rescan->stmt, 0);
+        int port = sqlite3_column_int(rescan->stmt, 1);
+        struct in6_addr addr;
+        if(addr_str == NULL || !parse_address(addr_str, &addr) || port < 1 || port > 65535) {
+            continue;
+        }
+        if(rescan->port_filter != NULL && !(rescan->port_filter[port / 8] & 1 << port % 8)) {
+            continue;
+        }
+        if(should_exclude_address(rescan->exclude, &addr)) {
+            continue;
+        }
+
+        targets[count].addr = addr;
+        targets[count].port = port;
+        count++;
+
+    }
+
+    return count;
+
+}
+
+static void rescan_destroy(struct TargetSource *source) {
+    struct RescanSource *rescan = (struct RescanSource *)source;
+    sqlite3_finalize(rescan->stmt);
+    free(rescan->port_filter);
+    free(rescan);
+}
+
+/* Re-probe the distinct (address, port) pairs that earlier runs found, optionally only those last seen within
+ * `seen_within` seconds and/or not seen for `older_than` seconds (zero disables either filter). Only rows from earlier
+ * generations are read, so results written by this run never feed back into it. The rows are shuffled so that hosting
+ * providers with many servers are not probed in one burst. */
+struct TargetSource *open_rescan_source(struct Database *db, const struct ExcludeList *exclude, bool bedrock, const uint16_t *ports, int num_ports, int seen_within, int older_than) {
+
+    struct RescanSource *rescan = calloc(1, sizeof(struct RescanSource));
+    if(rescan == NULL) {
+        fprintf(stderr, "failed to allocate target source\n");
+        return NULL;
+    }
+
+    const char *query =
+        "SELECT address, port FROM servers "
+        "WHERE generation < ? AND (edition = 'bedrock') = ? "
+        "GROUP BY address, port "
+        "HAVING MAX(timestamp) >= ? AND MAX(timestamp) < ? "
+        "ORDER BY random()";
+    if(sqlite3_prepare_v2(db->db, query, -1, &rescan->stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "failed to prepare statement: %s\n", sqlite3_errmsg(db->db));
+        free(rescan);
+        return NULL;
+    }
+
+    long now = time(NULL);
+    sqlite3_bind_int(rescan->stmt, 1, db->generation);
+    sqlite3_bind_int(rescan->stmt, 2, bedrock);
+    sqlite3_bind_int64(rescan->stmt, 3, seen_within > 0 ? now - seen_within : 0);
+    sqlite3_bind_int64(rescan->stmt, 4, older_than > 0 ? now - older_than : now + 1);
+
+    if(ports != NULL) {
+        rescan->port_filter = calloc(65536 / 8, 1);
+        if(rescan->port_filter == NULL) {
+            fprintf(stderr, "failed to allocate target source\n");
+            rescan_destroy(&rescan->base);
+            return NULL;
+        }
+        for(int i = 0; i < num_ports; i++) {
+            rescan->port_filter[ports[i] / 8] |= 1 << ports[i] % 8;
+        }
+    }
+
+    rescan->base.next_batch = rescan_next_batch;
+    rescan->base.report = NULL;
+    rescan->base.destroy = rescan_destroy;
+    rescan->base.finished = false;
+    rescan->exclude = exclude;
+    return &rescan->base;
+
+}
+
+// ---- Blocks ranked by density ----
+
+// Number of blocks in the first tier of the ranking; each later tier is twice the size of the one before
+#define DENSITY_FIRST_TIER 16
+
+// Seconds between coverage reports
+#define COVERAGE_INTERVAL_S 60
+
+// A block of addresses and the number of servers earlier scans found in it
+struct RankedBlock {
+    uint32_t block;
+    uint32_t servers;
+};
+
+struct DensitySource {
+    struct TargetSource base;
+    const struct ExcludeList *exclude;
+    const uint16_t *ports;
+    int num_ports;
+    struct AddressGenerator *explorer;
+    int prefix_len;
+    struct RankedBlock *ranked;
+    int num_ranked;
+    uint8_t *ranked_bitmap; // one bit per block, set for ranked ones
+    double explore_fraction;
+    double explore_credit;
+
+    // Tiers are scanned one after another, each as a single permutation over all of its blocks' targets
+    int tier;
+    int num_tiers;
+    int tier_start;
+    int tier_end;
+    struct IndexPermutation perm;
+    bool ranked_done;
+
+    // Coverage statistics
+    long known_servers;
+    long ranked_probes;
+    long explore_probes;
+    long found_ranked;
+    long found_explored;
+    time_t start_time;
+    time_t last_report;
+};
+
+static int compare_blocks(const void *a, const void *b) {
+    uint32_t ba = *(const uint32_t *)a, bb = *(const uint32_t *)b;
+    return ba < bb ? -1 : ba > bb;
+}
+
+static int compare_density(const void *a, const void *b) {
+    const struct RankedBlock *ra = a, *rb = b;
+    if(ra->servers != rb->servers) {
+        return ra->servers < rb->servers ? 1 : -1;
+    }
+    return ra->block < rb->block ? -1 : ra->block > rb->block;
+}
+
+static bool is_ranked(const struct DensitySource *density, const struct in6_addr *addr) {
+    uint32_t block = ntohl(ipv4_of(addr)) >> (32 - density->prefix_len);
+    return density->ranked_bitmap[block / 8] & 1 << block % 8;
+}
+
+static void start_tier(struct DensitySource *density, int start) {
+    int size = DENSITY_FIRST_TIER << density->tier;
+    density->tier_start = start;
+    density->tier_end = start + size < density->num_ranked ? start + size : density->num_ranked;
+    uint64_t block_size = (uint64_t)1 << (32 - density->prefix_len);
+    init_permutation(&density->perm, (uint64_t)(density->tier_end - density->tier_start) * block_size * density->num_ports);
+}
+
+// Next target in the ranked blocks, moving on to the next tier when the current one is done
+static bool next_ranked(struct DensitySource *density, struct Target *target) {
+
+    uint64_t block_size = (uint64_t)1 << (32 - density->prefix_len);
+    while(!density->ranked_done) {
+
+        uint64_t index;
+        if(!next_index(&density->perm, &index)) {
+            if(density->tier_end == density->num_ranked) {
+                density->ranked_done = true;
+                break;
+            }
+            density->tier++;
+            start_tier(density, density->tier_end);
+            continue;
+        }
+
+        // Consecutive indices go to different blocks, so no block sees a burst of probes
+        uint64_t num_blocks = density->tier_end - density->tier_start;
+        uint32_t block = density->ranked[density->tier_start + index % num_blocks].block;
+        uint64_t rest = index / num_blocks;
+        uint32_t addr = block << (32 - density->prefix_len) | (uint32_t)(rest % block_size);
+        if(should_exclude(density->exclude, addr)) {
+            continue;
+        }
+
+        map_ipv4(&target->addr, htonl(addr));
+        target->port = density->ports[rest / block_size];
+        return true;
+
+    }
+    return false;
+
+}
+
+// Next target outside the ranked blocks, from the ordinary full-space generator
+static bool next_explored(struct DensitySource *density, struct Target *target) {
+    while(next_target(density->explorer, target)) {
+        if(!is_ranked(density, &target->addr)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void print_coverage(struct DensitySource *density) {
+    long found = density->found_ranked + density->found_explored;
+    printf("coverage after %lds: %ld targets issued (%ld exploring), tier %d/%d, %ld servers found (%ld in ranked blocks, %.1f%% of the %ld known there)\n",
+        (long)(time(NULL) - density->start_time), density->ranked_probes + density->explore_probes, density->explore_probes,
+        density->ranked_done ? density->num_tiers : density->tier + 1, density->num_tiers, found, density->found_ranked,
+        density->known_servers > 0 ? 100.0 * density->found_ranked / density->known_servers : 0.0, density->known_servers);
+    fflush(stdout);
+}
+
+static int density_next_batch(struct TargetSource *source, struct Target *targets, int max) {
+
+    struct DensitySource *density = (struct DensitySource *)source;
+
+    if(time(NULL) - density->last_report >= COVERAGE_INTERVAL_S) {
+        density->last_report = time(NULL);
+        print_coverage(density);
+    }
+
+    // Set aside the exploration share of this batch; fractions of a target carry over to later batches
+    density->explore_credit += max * density->explore_fraction;
+    int explore = density->explore_credit < max ? (int)density->explore_credit : max;
+    density->explore_credit -= explore;
+
+    int count = 0;
+    while(count < explore && next_explored(density, &targets[count])) {
+        count++;
+    }
+    density->explore_probes += count;
+    while(count < max && next_ranked(density, &targets[count])) {
+        count++;
+        density->ranked_probes++;
+    }
+
+    // Once the ranked blocks are done, the rest of the space is all that's left
+    while(count < max && next_explored(density, &targets[count])) {
+        count++;
+        density->explore_probes++;
+    }
+
+    source->finished = density->ranked_done && density->explorer->finished && count < max;
+    return count;
+
+}
+
+static void density_report(struct TargetSource *source, struct Target target, bool found) {
+    struct DensitySource *density = (struct DensitySource *)source;
+    if(found) {
+        if(is_ranked(density, &target.addr)) {
+            density->found_ranked++;
+        } else {
+            density->found_explored++;
+        }
+    }
+}
+
+static void density_destroy(struct TargetSource *source) {
+    struct DensitySource *density = (struct DensitySource *)source;
+    print_coverage(density);
+    free(density->ranked);
+    free(density->ranked_bitmap);
+    free(density);
+}
+
+/* Scan the blocks (/prefix_len) in which earlier runs found servers first, densest first, and spend
+ * `explore_fraction` of the probes on the rest of IPv4 in the meantime. After the ranked blocks are done, the rest of
+ * the space is scanned as usual. Blocks are grouped into tiers of doubling size and each tier is scanned as one
+ * permutation, which keeps probes spread over many networks while preserving the ranking at the tier level. */
+struct TargetSource *open_density_source(struct Database *db, const struct ExcludeList *exclude, struct AddressGenerator *explorer, const uint16_t *ports, int num_ports, int prefix_len, double explore_fraction) {
+
+    struct DensitySource *density = calloc(1, sizeof(struct DensitySource));
+    size_t blocks_capacity = 1024, num_blocks = 0;
+    uint32_t *blocks = malloc(blocks_capacity * sizeof(uint32_t));
+    if(density == NULL || blocks == NULL) {
+        fprintf(stderr, "failed to allocate target source\n");
+        goto fail;
+    }
+
+    // Collect the block of every distinct IPv4 server found by earlier runs
+    sqlite3_stmt *stmt;
+    const char *query = "SELECT DISTINCT address, port FROM servers WHERE generation < ? AND edition != 'bedrock'";
+    if(sqlite3_prepare_v2(db->db, query, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "failed to query previous results: %s\n", sqlite3_errmsg(db->db));
+        goto fail;
+    }
+    sqlite3_bind_int(stmt, 1, db->generation);
+    while(sqlite3_step(stmt) == SQLITE_ROW) {
+        struct in_addr addr;
+        const char *addr_str = (const char *)sqlite3_column_text(stmt, 0);
+        if(addr_str == NULL || inet_pton(AF_INET, addr_str, &addr) != 1) {
+            continue;
+        }
+        if(num_blocks == blocks_capacity) {
+            blocks_capacity *= 2;
+            uint32_t *grown = realloc(blocks, blocks_capacity * sizeof(uint32_t));
+            if(grown == NULL) {
+                fprintf(stderr, "failed to allocate target source\n");
+                sqlite3_finalize(stmt);
+                goto fail;
+            }
+            blocks = grown;
+        }
+        blocks[num_blocks++] = ntohl(addr.s_addr) >> (32 - prefix_len);
+    }
+    sqlite3_finalize(stmt);
+
+    if(num_blocks == 0) {
+        fprintf(stderr, "no earlier results in scan.db to rank blocks by\n");
+        goto fail;
+    }
+
+    // Count servers per block and rank the blocks by that count
+    qsort(blocks, num_blocks, sizeof(uint32_t), compare_blocks);
+    density->ranked = malloc(num_blocks * sizeof(struct RankedBlock));
+    density->ranked_bitmap = calloc(((size_t)1 << prefix_len) / 8, 1);
+    if(density->ranked == NULL || density->ranked_bitmap == NULL) {
+        fprintf(stderr, "failed to allocate target source\n");
+        goto fail;
+    }
+    for(size_t i = 0; i < num_blocks; i++) {
+        if(density->num_ranked > 0 && density->ranked[density->num_ranked - 1].block == blocks[i]) {
+            density->ranked[density->num_ranked - 1].servers++;
+        } else {
+            density->ranked[density->num_ranked++] = (struct RankedBlock){blocks[i], 1};
+            density->ranked_bitmap[blocks[i] / 8] |= 1 << blocks[i] % 8;
+        }
+    }
+    free(blocks);
+    qsort(density->ranked, density->num_ranked, sizeof(struct RankedBlock), compare_density);
+
+    for(int covered = 0; covered < density->num_ranked; density->num_tiers++) {
+        covered += DENSITY_FIRST_TIER << density->num_tiers;
+    }
+
+    density->base.next_batch = density_next_batch;
+    density->base.report = density_report;
+    density->base.destroy = density_destroy;
+    density->base.finished = false;
+    density->exclude = exclude;
+    density->ports = ports;
+    density->num_ports = num_ports;
+    density->explorer = explorer;
+    density->prefix_len = prefix_len;
+    density->explore_fraction = explore_fraction;
+    density->known_servers = num_blocks;
+    density->start_time = time(NULL);
+    density->last_report = density->start_time;
+    start_tier(density, 0);
+
+    printf("ranked %d /%d blocks holding %zu known servers into %d tiers; densest block has %u\n", density->num_ranked, prefix_len, num_blocks, density->num_tiers, density->ranked[0].servers);
+    return &density->base;
+
+fail:
+    free(blocks);
+    if(density != NULL) {
+        free(density->ranked);
+        free(density->ranked_bitmap);
+        free(density);
+    }
+    return NULL;
+
+}
@@ -0,0 +1,34 @@
+#ifndef __TARGET_SOURCE_H
+#define __TARGET_SOURCE_H
+
+#include "addr-gen.h"
+#include "db.h"
+#include "exclude.h"
+#include "sample-stats.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Maximum number of targets the event loops pull from a source at once
+#define TARGET_BATCH_SIZE 256
+
+/* Where targets come from. Implementations embed this as their first member. next_batch() fills up to `max` targets and
+ * returns how many it wrote; a streaming source may return zero before it is finished if no input is ready yet. Sources
+ * that care how their probes ended set report(), which is called once per target after any retries. */
+struct TargetSource {
+    int (*next_batch)(struct TargetSource *source, struct Target *targets, int max);
+    void (*report)(struct TargetSource *source, struct Target target, bool found);
+    void (*destroy)(struct TargetSource *source);
+    bool finished;
+};
+
+bool parse_target(const char *str, const char *end, struct in6_addr *addr, int *prefix_len, int *port, bool *valid);
+struct TargetSource *open_generator_source(struct AddressGenerator *addr_gen);
+struct TargetSource *open_cidr_source(const char *path, const struct ExcludeList *exclude, const uint16_t *ports, int num_ports);
+struct TargetSource *open_ip_file_source(const char *path, const struct ExcludeList *exclude, const uint16_t *ports, int num_ports);
+struct TargetSource *open_stream_source(int fd, const struct ExcludeList *exclude, const uint16_t *ports, int num_ports);
+struct TargetSource *open_rescan_source(struct Database *db, const struct ExcludeList *exclude, bool bedrock, const uint16_t *ports, int num_ports, int seen_within, int older_than);
+struct TargetSource *open_density_source(struct Database *db, const struct ExcludeList *exclude, struct AddressGenerator *explorer, const uint16_t *ports, int num_ports, int prefix_len, double explore_fraction);
+struct TargetSource *open_sample_source(struct AddressGenerator *addr_gen, struct SampleStats *stats, long size);
+void close_target_source(struct TargetSource *source);
+
+#endif
\ No newline at end of file
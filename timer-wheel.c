@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+#include "timer-wheel.h"
+#include <stddef.h>
+#include <time.h>
+
+uint64_t monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void init_timer_wheel(struct TimerWheel *wheel, uint64_t now) {
+    for(int i = 0; i < TIMER_SLOTS; i++) {
+        wheel->slots[i].next = &wheel->slots[i];
+        wheel->slots[i].prev = &wheel->slots[i];
+    }
+    wheel->current_tick = now / TIMER_RESOLUTION_MS;
+}
+
+void schedule_timer(struct TimerWheel *wheel, struct TimerEntry *entry, uint64_t deadline) {
+
+    // Deadlines in the past are put in the current slot so that they fire on the next expiry check
+    uint64_t tick = deadline / TIMER_RESOLUTION_MS;
+    if(tick < wheel->current_tick) {
+        tick = wheel->current_tick;
+    }
+
+    // Append at the tail so that each slot stays roughly in deadline order and expiry finds due entries first
+    struct TimerEntry *head = &wheel->slots[tick % TIMER_SLOTS];
+    entry->deadline = deadline;
+    entry->next = head;
+    entry->prev = head->prev;
+    head->prev->next = entry;
+    head->prev = entry;
+
+}
+
+// Unlink a timer; safe to call on entries that are not scheduled as long as they were zeroed initially
+void cancel_timer(struct TimerEntry *entry) {
+    if(entry->next != NULL) {
+        entry->prev->next = entry->next;
+        entry->next->prev = entry->prev;
+        entry->next = NULL;
+        entry->prev = NULL;
+    }
+}
+
+/* Remove and return one timer whose deadline has passed, or NULL once there are none left. Callers loop on this after
+ * every wakeup. */
+struct TimerEntry *expire_timer(struct TimerWheel *wheel, uint64_t now) {
+
+    uint64_t now_tick = now / TIMER_RESOLUTION_MS;
+    while(1) {
+
+        struct TimerEntry *head = &wheel->slots[wheel->current_tick % TIMER_SLOTS];
+        for(struct TimerEntry *entry = head->next; entry != head; entry = entry->next) {
+            if(entry->deadline <= now) {
+                cancel_timer(entry);
+                return entry;
+            }
+        }
+
+        if(wheel->current_tick >= now_tick) {
+            return NULL;
+        }
+        wheel->current_tick++;
+
+    }
+
+}
@@ -0,0 +1,30 @@
+#ifndef __TIMER_WHEEL_H
+#define __TIMER_WHEEL_H
+
+#include <stdint.h>
+
+// Granularity of timer deadlines in milliseconds
+#define TIMER_RESOLUTION_MS 100
+
+// Number of slots in the wheel; deadlines further out than this many ticks simply stay in their slot for another lap
+#define TIMER_SLOTS 1024
+
+// Timers are intrusive list nodes embedded in the structure they belong to
+struct TimerEntry {
+    struct TimerEntry *next;
+    struct TimerEntry *prev;
+    uint64_t deadline;
+};
+
+struct TimerWheel {
+    struct TimerEntry slots[TIMER_SLOTS];
+    uint64_t current_tick;
+};
+
+uint64_t monotonic_ms(void);
+void init_timer_wheel(struct TimerWheel *wheel, uint64_t now);
+void schedule_timer(struct TimerWheel *wheel, struct TimerEntry *entry, uint64_t deadline);
+void cancel_timer(struct TimerEntry *entry);
+struct TimerEntry *expire_timer(struct TimerWheel *wheel, uint64_t now);
+
+#endif
@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+#include "unreachable.h"
+#include "address.h"
+#include "hash.h"
+#include <linux/errqueue.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+// Number of slots searched for a prefix before the cache evicts one
+#define UNREACHABLE_MAX_PROBES 8
+
+// Reports needed before a prefix in which no host has answered is skipped
+#define UNREACHABLE_NET_THRESHOLD 2
+#define UNREACHABLE_HOST_THRESHOLD 8
+
+// ICMP and ICMPv6 destination unreachable message types
+#define ICMP_TYPE_UNREACH 3
+#define ICMP6_TYPE_UNREACH 1
+
+int init_unreachable_cache(struct UnreachableCache *cache) {
+    cache->entries = calloc(UNREACHABLE_CACHE_SIZE, sizeof(struct UnreachableEntry));
+    if(cache->entries == NULL) {
+        fprintf(stderr, "failed to allocate unreachable prefix cache\n");
+        return 1;
+    }
+    memset(cache->reports, 0, sizeof(cache->reports));
+    cache->skipped = 0;
+    return 0;
+}
+
+void free_unreachable_cache(struct UnreachableCache *cache) {
+    free(cache->entries);
+}
+
+// Queue ICMP errors for the socket so that classify_socket_error() can tell why a connection failed
+int enable_error_queue(int socket_fd, int family) {
+
+    int optval = 1;
+    int result = family == AF_INET ? setsockopt(socket_fd, IPPROTO_IP, IP_RECVERR, &optval, sizeof(optval)) : setsockopt(socket_fd, IPPROTO_IPV6, IPV6_RECVERR, &optval, sizeof(optval));
+    if(result == -1) {
+        perror("setsockopt(IP_RECVERR)");
+        return 1;
+    }
+    return 0;
+
+}
+
+static enum ProbeError classify_icmp(uint8_t origin, uint8_t type, uint8_t code) {
+
+    if(origin == SO_EE_ORIGIN_ICMP && type == ICMP_TYPE_UNREACH) {
+        switch(code) {
+            case 0: case 6: case 11: return PROBE_ERROR_NET;  // network unreachable/unknown, unreachable for TOS
+            case 1: case 7: case 12: return PROBE_ERROR_HOST; // host unreachable/unknown, unreachable for TOS
+            case 9: case 10: case 13: return PROBE_ERROR_ADMIN; // network/host/communication prohibited
+            case 2: case 3: return PROBE_ERROR_REFUSED;       // protocol/port unreachable, sent by the host itself
+        }
+    }
+
+    if(origin == SO_EE_ORIGIN_ICMP6 && type == ICMP6_TYPE_UNREACH) {
+        switch(code) {
+            case 0: case 2: return PROBE_ERROR_NET;           // no route, beyond scope of source address
+            case 3: return PROBE_ERROR_HOST;                  // address unreachable
+            case 1: case 5: case 6: return PROBE_ERROR_ADMIN; // prohibited, failed policy, reject route
+            case 4: return PROBE_ERROR_REFUSED;               // port unreachable
+        }
+    }
+
+    return PROBE_ERROR_OTHER;
+
+}
+
+enum ProbeError classify_connect_errno(int error) {
+    switch(error) {
+        case ECONNREFUSED: return PROBE_ERROR_REFUSED;
+        case ENETUNREACH: return PROBE_ERROR_NET;
+        case EHOSTUNREACH: return PROBE_ERROR_HOST;
+        case EACCES: case EPERM: return PROBE_ERROR_ADMIN; // prohibit route or a local firewall rule
+        default: return PROBE_ERROR_OTHER;
+    }
+}
+
+/* Work out why a socket reported EPOLLERR. An ICMP error on the error queue says exactly what the router answered;
+ * without one, the pending socket error is all there is to go on. */
+enum ProbeError classify_socket_error(int socket_fd) {
+
+    char control[512];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if(recvmsg(socket_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) != -1) {
+        for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            bool is_error = (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR) || (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
+            if(is_error) {
+                struct sock_extended_err err;
+                memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+                enum ProbeError result = classify_icmp(err.ee_origin, err.ee_type, err.ee_code);
+                if(result != PROBE_ERROR_OTHER) {
+                    return result;
+                }
+            }
+        }
+    }
+
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if(getsockopt(socket_fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1) {
+        return PROBE_ERROR_OTHER;
+    }
+    return classify_connect_errno(error);
+
+}
+
+// Cache key of the prefix containing an address; the top bits tell IPv4 and IPv6 prefixes apart and keep keys non-zero
+static uint64_t prefix_key(const struct in6_addr *addr) {
+    if(is_ipv4(addr)) {
+        return (1ULL << 63) | (ntohl(ipv4_of(addr)) >> (32 - UNREACHABLE_PREFIX4));
+    }
+    uint64_t hi = 0;
+    for(int i = 0; i < 8; i++) {
+        hi = hi << 8 | addr->s6_addr[i];
+    }
+    return (1ULL << 62) | (hi >> (64 - UNREACHABLE_PREFIX6));
+}
+
+static int evidence(const struct UnreachableEntry *entry) {
+    return entry->reachable ? 0 : entry->net_reports * UNREACHABLE_HOST_THRESHOLD + entry->host_reports;
+}
+
+// Find the entry for an address's prefix, optionally creating it (evicting the weakest nearby entry if needed)
+static struct UnreachableEntry *find_entry(struct UnreachableCache *cache, const struct in6_addr *addr, bool create) {
+
+    uint64_t key = prefix_key(addr);
+    uint32_t slot = mix32((uint32_t)key ^ mix32(key >> 32));
+    struct UnreachableEntry *free_entry = NULL, *weakest = NULL;
+    for(int i = 0; i < UNREACHABLE_MAX_PROBES; i++) {
+        struct UnreachableEntry *entry = &cache->entries[(slot + i) % UNREACHABLE_CACHE_SIZE];
+        if(entry->key == key) {
+            return entry;
+        }
+        if(entry->key == 0) {
+            if(free_entry == NULL) {
+                free_entry = entry;
+            }
+        } else if(weakest == NULL || evidence(entry) < evidence(weakest)) {
+            weakest = entry;
+        }
+    }
+
+    if(!create) {
+        return NULL;
+    }
+    struct UnreachableEntry *entry = free_entry != NULL ? free_entry : weakest;
+    memset(entry, 0, sizeof(*entry));
+    entry->key = key;
+    return entry;
+
+}
+
+void record_probe_error(struct UnreachableCache *cache, const struct in6_addr *addr, enum ProbeError error) {
+
+    cache->reports[error]++;
+    if(error == PROBE_ERROR_OTHER) {
+        return;
+    }
+    if(error == PROBE_ERROR_REFUSED) {
+        record_reachable(cache, addr);
+        return;
+    }
+
+    struct UnreachableEntry *entry = find_entry(cache, addr, true);
+    if(error == PROBE_ERROR_HOST) {
+        if(entry->host_reports < UINT16_MAX) {
+            entry->host_reports++;
+        }
+    } else if(entry->net_reports < UINT16_MAX) {
+        entry->net_reports++;
+    }
+
+}
+
+// A host answered in a prefix that has reports against it, so the prefix is routed after all and won't be skipped
+void record_reachable(struct UnreachableCache *cache, const struct in6_addr *addr) {
+    struct UnreachableEntry *entry = find_entry(cache, addr, false);
+    if(entry != NULL) {
+        entry->reachable = true;
+    }
+}
+
+// Whether a target should be skipped because its prefix has been reported unreachable
+bool is_unreachable(struct UnreachableCache *cache, const struct in6_addr *addr) {
+    struct UnreachableEntry *entry = find_entry(cache, addr, false);
+    if(entry == NULL || entry->reachable) {
+        return false;
+    }
+    if(entry->net_reports >= UNREACHABLE_NET_THRESHOLD || entry->host_reports >= UNREACHABLE_HOST_THRESHOLD) {
+        cache->skipped++;
+        return true;
+    }
+    return false;
+}
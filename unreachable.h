@@ -0,0 +1,49 @@
+#ifndef __UNREACHABLE_H
+#define __UNREACHABLE_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Number of prefixes the cache can track; a full cache evicts the prefix with the least evidence
+#define UNREACHABLE_CACHE_SIZE 65536
+
+// Prefix lengths that unreachable reports are aggregated over
+#define UNREACHABLE_PREFIX4 24
+#define UNREACHABLE_PREFIX6 48
+
+// Why a probe failed, as far as the kernel told us
+enum ProbeError {
+    PROBE_ERROR_OTHER,   // timeout, reset after connecting, or anything else that says nothing about the prefix
+    PROBE_ERROR_REFUSED, // RST or ICMP port unreachable: the host is up
+    PROBE_ERROR_NET,     // ICMP network unreachable, or no route at all
+    PROBE_ERROR_HOST,    // ICMP host unreachable
+    PROBE_ERROR_ADMIN    // ICMP administratively prohibited
+};
+
+struct UnreachableEntry {
+    uint64_t key; // 0 for an empty slot
+    uint16_t net_reports;
+    uint16_t host_reports;
+    bool reachable;
+};
+
+/* Prefixes that routers have reported unreachable during this scan. Network and administrative unreachables describe
+ * the whole prefix, so a couple of them are enough to skip it; host unreachables only describe one address, so it
+ * takes many of them with no host in the prefix answering. */
+struct UnreachableCache {
+    struct UnreachableEntry *entries;
+    long reports[PROBE_ERROR_ADMIN + 1];
+    long skipped;
+};
+
+int init_unreachable_cache(struct UnreachableCache *cache);
+void free_unreachable_cache(struct UnreachableCache *cache);
+int enable_error_queue(int socket_fd, int family);
+enum ProbeError classify_socket_error(int socket_fd);
+enum ProbeError classify_connect_errno(int error);
+void record_probe_error(struct UnreachableCache *cache, const struct in6_addr *addr, enum ProbeError error);
+void record_reachable(struct UnreachableCache *cache, const struct in6_addr *addr);
+bool is_unreachable(struct UnreachableCache *cache, const struct in6_addr *addr);
+
+#endif
@@ -0,0 +1,312 @@
+#include "watchlist.h"
+#include "timer-wheel.h"
+#include "hash.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+// Longest line accepted in a watchlist file
+#define MAX_WATCH_LINE 128
+
+// Failed probes double a server's interval up to this many times, and never past WATCH_MAX_BACKOFF_S
+#define WATCH_MAX_BACKOFF_SHIFT 6
+#define WATCH_MAX_BACKOFF_S 3600
+
+struct WatchEntry {
+    struct in6_addr addr;
+    uint16_t port;
+    int interval_s;
+    int failures;
+    bool in_flight;
+    uint64_t next_due_ms;
+};
+
+/* Servers to probe repeatedly. Entries are sorted by (address, port) so that results can be matched back to them, and
+ * the ones waiting for their next probe sit in a min-heap ordered by due time. Each pass of the event loop only looks
+ * at the top of the heap, so idle cost does not depend on the size of the list. */
+struct Watchlist {
+    struct TargetSource base;
+    const struct ExcludeList *exclude;
+    struct WatchEntry *entries;
+    int num_entries;
+    int *heap; // indices into entries
+    int heap_size;
+};
+
+static bool due_before(struct Watchlist *list, int a, int b) {
+    return list->entries[a].next_due_ms < list->entries[b].next_due_ms;
+}
+
+static void heap_push(struct Watchlist *list, int entry) {
+    int pos = list->heap_size++;
+    while(pos > 0) {
+        int parent = (pos - 1) / 2;
+        if(!due_before(list, entry, list->heap[parent])) {
+            break;
+        }
+        list->heap[pos] = list->heap[parent];
+        pos = parent;
+    }
+    list->heap[pos] = entry;
+}
+
+static int heap_pop(struct Watchlist *list) {
+    int top = list->heap[0];
+    int last = list->heap[--list->heap_size];
+    int pos = 0;
+    while(1) {
+        int child = pos * 2 + 1;
+        if(child >= list->heap_size) {
+            break;
+        }
+        if(child + 1 < list->heap_size && due_before(list, list->heap[child + 1], list->heap[child])) {
+            child++;
+        }
+        if(!due_before(list, list->heap[child], last)) {
+            break;
+        }
+        list->heap[pos] = list->heap[child];
+        pos = child;
+    }
+    list->heap[pos] = last;
+    return top;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const struct WatchEntry *ea = a, *eb = b;
+    int result = memcmp(&ea->addr, &eb->addr, sizeof(struct in6_addr));
+    if(result != 0) {
+        return result;
+    }
+    return (int)ea->port - (int)eb->port;
+}
+
+static int watchlist_next_batch(struct TargetSource *source, struct Target *targets, int max) {
+
+    struct Watchlist *list = (struct Watchlist *)source;
+    uint64_t now = monotonic_ms();
+    int count = 0;
+    while(count < max && list->heap_size > 0 && list->entries[list->heap[0]].next_due_ms <= now) {
+        int index = heap_pop(list);
+        struct WatchEntry *entry = &list->entries[index];
+
+        // Servers blocked by a reloaded blocklist are skipped, but kept in case the block is lifted again
+        if(should_exclude_address(list->exclude, &entry->addr)) {
+            entry->next_due_ms = now + (uint64_t)entry->interval_s * 1000;
+            heap_push(list, index);
+            continue;
+        }
+
+        entry->in_flight = true;
+        targets[count].addr = entry->addr;
+        targets[count].port = entry->port;
+        count++;
+    }
+    return count;
+
+}
+
+// Schedule the next probe of a server: one interval after a success, backing off exponentially after failures
+static void watchlist_report(struct TargetSource *source, struct Target target, bool found) {
+
+    struct Watchlist *list = (struct Watchlist *)source;
+    struct WatchEntry key = {.addr = target.addr, .port = target.port};
+    struct WatchEntry *entry = bsearch(&key, list->entries, list->num_entries, sizeof(struct WatchEntry), compare_entries);
+    if(entry == NULL || !entry->in_flight) {
+        return;
+    }
+
+    uint64_t delay_s = entry->interval_s;
+    if(found) {
+        entry->failures = 0;
+    } else {
+        int shift = entry->failures < WATCH_MAX_BACKOFF_SHIFT ? entry->failures : WATCH_MAX_BACKOFF_SHIFT;
+        entry->failures++;
+        delay_s <<= shift;
+        if(delay_s > WATCH_MAX_BACKOFF_S) {
+            delay_s = entry->interval_s > WATCH_MAX_BACKOFF_S ? entry->interval_s : WATCH_MAX_BACKOFF_S;
+        }
+    }
+
+    entry->in_flight = false;
+    entry->next_due_ms = monotonic_ms() + delay_s * 1000;
+    heap_push(list, entry - list->entries);
+
+}
+
+static void watchlist_destroy(struct TargetSource *source) {
+    struct Watchlist *list = (struct Watchlist *)source;
+    free(list->entries);
+    free(list->heap);
+    free(list);
+}
+
+/* Load servers to watch from a file, one "ADDR[:PORT] [INTERVAL]" per line (IPv6 addresses with a port in brackets) with the interval in seconds. The first
+ * probes are spread over each server's interval so that a freshly started monitor doesn't send them all at once. */
+struct TargetSource *open_watchlist(const char *path, const struct ExcludeList *exclude, uint16_t default_port, int default_interval_s) {
+
+    FILE *fp = fopen(path, "r");
+    if(fp == NULL) {
+        fprintf(stderr, "failed to read %s: ", path);
+        perror(NULL);
+        return NULL;
+    }
+
+    struct Watchlist *list = calloc(1, sizeof(struct Watchlist));
+    int capacity = 64;
+    if(list == NULL || (list->entries = malloc(capacity * sizeof(struct WatchEntry))) == NULL) {
+        fprintf(stderr, "failed to allocate watchlist\n");
+        free(list);
+        fclose(fp);
+        return NULL;
+    }
+
+    char line[MAX_WATCH_LINE];
+    int line_number = 0;
+    while(fgets(line, sizeof(line), fp)) {
+
+        line_number++;
+        char *comment = strchr(line, '#');
+        if(comment != NULL) {
+            *comment = '\0';
+        }
+
+        char addr_str[64];
+        int interval_s = default_interval_s;
+        int fields = sscanf(line, "%63s %d", addr_str, &interval_s);
+        if(fields < 1) {
+            continue;
+        }
+
+        struct in6_addr addr;
+        int prefix_len, port;
+        bool valid;
+        if(!parse_target(addr_str, addr_str + strlen(addr_str), &addr, &prefix_len, &port, &valid) || prefix_len != -1 || interval_s < 1) {
+            fprintf(stderr, "%s:%d: ignoring invalid entry\n", path, line_number);
+            continue;
+        }
+        if(port == -1) {
+            port = default_port;
+        }
+        if(should_exclude_address(exclude, &addr)) {
+            fprintf(stderr, "%s:%d: ignoring excluded address %s\n", path, line_number, addr_str);
+            continue;
+        }
+
+        if(list->num_entries == capacity) {
+            capacity *= 2;
+            struct WatchEntry *grown = realloc(list->entries, capacity * sizeof(struct WatchEntry));
+            if(grown == NULL) {
+                fprintf(stderr, "failed to allocate watchlist\n");
+                fclose(fp);
+                watchlist_destroy(&list->base);
+                return NULL;
+            }
+            list->entries = grown;
+        }
+
+        struct WatchEntry *entry = &list->entries[list->num_entries++];
+        entry->addr = addr;
+        entry->port = port;
+        entry->interval_s = interval_s;
+        entry->failures = 0;
+        entry->in_flight = false;
+
+    }
+    fclose(fp);
+
+    if(list->num_entries == 0) {
+        fprintf(stderr, "%s contains no servers\n", path);
+        watchlist_destroy(&list->base);
+        return NULL;
+    }
+
+    // Sort for lookups and drop duplicate servers
+    qsort(list->entries, list->num_entries, sizeof(struct WatchEntry), compare_entries);
+    int unique = 1;
+    for(int i = 1; i < list->num_entries; i++) {
+        if(compare_entries(&list->entries[i], &list->entries[unique - 1]) != 0) {
+            list->entries[unique++] = list->entries[i];
+        }
+    }
+    list->num_entries = unique;
+
+    list->heap = malloc(list->num_entries * sizeof(int));
+    if(list->heap == NULL) {
+        fprintf(stderr, "failed to allocate watchlist\n");
+        watchlist_destroy(&list->base);
+        return NULL;
+    }
+
+    uint64_t now = monotonic_ms();
+    for(int i = 0; i < list->num_entries; i++) {
+        struct WatchEntry *entry = &list->entries[i];
+        entry->next_due_ms = now + mix32(hash_address(&entry->addr) ^ entry->port) % ((uint64_t)entry->interval_s * 1000);
+        heap_push(list, i);
+    }
+
+    list->exclude = exclude;
+    list->base.next_batch = watchlist_next_batch;
+    list->base.report = watchlist_report;
+    list->base.destroy = watchlist_destroy;
+    list->base.finished = false;
+    printf("watching %d servers\n", list->num_entries);
+    return &list->base;
+
+}
+
+// Find the integer value of "key" inside the "players" object of a status response
+static bool find_count(const char *players, const char *end, const char *key, int *value) {
+
+    size_t key_length = strlen(key);
+    for(const char *pos = players; pos + key_length < end; pos++) {
+        if(memcmp(pos, key, key_length) != 0) {
+            continue;
+        }
+        pos += key_length;
+        while(pos < end && (*pos == ' ' || *pos == ':')) {
+            pos++;
+        }
+        if(pos == end || *pos < '0' || *pos > '9') {
+            return false;
+        }
+        long count = 0;
+        while(pos < end && *pos >= '0' && *pos <= '9' && count < 0x7fffffff / 10) {
+            count = count * 10 + (*pos++ - '0');
+        }
+        *value = count;
+        return true;
+    }
+    return false;
+
+}
+
+/* Extract the online and maximum player counts from a status response without a full JSON parse. Both come from the
+ * "players" object, which is a flat object apart from the optional "sample" array that follows the counts. */
+bool parse_player_counts(const char *json, int length, int *online, int *max_players) {
+
+    const char *end = json + length;
+    const char *players = NULL;
+    for(const char *pos = json; pos + 9 < end; pos++) {
+        if(memcmp(pos, "\"players\"", 9) == 0) {
+            players = pos + 9;
+            break;
+        }
+    }
+    if(players == NULL) {
+        return false;
+    }
+
+    // Stop at the end of the counts so that a sample entry's name can't be mistaken for a count
+    const char *object_end = players;
+    while(object_end < end && *object_end != '}' && *object_end != '[') {
+        object_end++;
+    }
+
+    *online = -1;
+    *max_players = -1;
+    find_count(players, object_end, "\"online\"", online);
+    find_count(players, object_end, "\"max\"", max_players);
+    return *online != -1 || *max_players != -1;
+
+}
\ No newline at end of file
@@ -0,0 +1,9 @@
+#ifndef __WATCHLIST_H
+#define __WATCHLIST_H
+
+#include "target-source.h"
+
+struct TargetSource *open_watchlist(const char *path, const struct ExcludeList *exclude, uint16_t default_port, int default_interval_s);
+bool parse_player_counts(const char *json, int length, int *online, int *max_players);
+
+#endif
\ No newline at end of file